@@ -28,6 +28,10 @@ ChatDemo::ChatDemo() {
 
     modelManager = std::make_unique<iamai::ModelManager>();
     refreshModelList();
+    // The only choice - start paging it in while the UI comes up
+    if (availableModels.size() == 1) {
+        modelManager->prefetchModel(availableModels[0]);
+    }
 
     messages.emplace_back(welcomeMessage, false);
 }
@@ -171,12 +175,19 @@ void ChatDemo::SendChatMessage(const std::string& userInput) {
     messages.emplace_back(userInput, true);
 
     isGenerating = true;
-    currentlyGenerating = "";
+    {
+        std::lock_guard<std::mutex> lock(generatingMutex);
+        currentlyGenerating = "";
+    }
     lastGenStart = std::chrono::high_resolution_clock::now();
 
     generationFuture = std::async(std::launch::async, [this, userInput, interface]() {
         try {
-            return interface->generate(userInput);
+            return interface->generate(userInput, [this](const std::string& piece) {
+                std::lock_guard<std::mutex> lock(generatingMutex);
+                currentlyGenerating += piece;
+                return true;
+            });
         } catch (const std::exception& e) {
             return std::string("❌ Generation error: ") + e.what();
         }
@@ -191,9 +202,21 @@ void ChatDemo::Update() {
 
             auto endTime = std::chrono::high_resolution_clock::now();
             lastGenTime = std::chrono::duration<double>(endTime - lastGenStart).count();
-            tokensGenerated = maxTokens;
+
+            // What the model actually produced, not the max_tokens budget
+            tokensGenerated = 0;
+            lastFirstTokenMs = 0.0;
+            if (Interface* interface = modelManager->getCurrentModel()) {
+                const Interface::Stats& stats = interface->getStats();
+                tokensGenerated = stats.generated_tokens;
+                lastFirstTokenMs = stats.first_token_ms;
+            }
 
             messages.emplace_back(response, false);
+            {
+                std::lock_guard<std::mutex> lock(generatingMutex);
+                currentlyGenerating.clear();
+            }
             isGenerating = false;
         }
     }
@@ -26,6 +26,7 @@
 #include <future>
 #include <atomic>
 #include <memory>
+#include <mutex>
 
 struct DownloadProgress {
     std::atomic<double> downloaded{0.0};
@@ -54,6 +55,7 @@ private:
     std::atomic<bool> isGenerating{false};
     std::future<std::string> generationFuture;
     std::string currentlyGenerating;
+    std::mutex generatingMutex;  // Guards currentlyGenerating (written by the generation thread)
 
     // UI state
     bool showSettings = false;
@@ -72,6 +74,7 @@ private:
     std::chrono::high_resolution_clock::time_point lastGenStart;
     double lastGenTime = 0.0;
     int tokensGenerated = 0;
+    double lastFirstTokenMs = 0.0;
 
     // Default settings
     int maxTokens = 64;
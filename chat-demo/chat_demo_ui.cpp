@@ -64,7 +64,8 @@ void ChatDemo::RenderHeader() {
     if (lastGenTime > 0) {
         ImGui::SameLine();
         float tokensPerSec = tokensGenerated / lastGenTime;
-        ImGui::Text("| Last: %.2fs (%.1f t/s)", lastGenTime, tokensPerSec);
+        ImGui::Text("| Last: %.2fs, %d tokens (%.1f t/s, first after %.0f ms)",
+                    lastGenTime, tokensGenerated, tokensPerSec, lastFirstTokenMs);
     }
 
     if (showModels) {
@@ -291,6 +292,31 @@ void ChatDemo::RenderMessages() {
         ImGui::Spacing();
     }
 
+    // Show the reply as it streams in
+    if (isGenerating) {
+        std::string partial;
+        {
+            std::lock_guard<std::mutex> lock(generatingMutex);
+            partial = currentlyGenerating;
+        }
+
+        ImGui::PushStyleColor(ImGuiCol_ChildBg, ImVec4(0.3f, 0.3f, 0.3f, 0.3f));
+        ImGui::PushStyleVar(ImGuiStyleVar_ChildRounding, 8.0f);
+        if (ImGui::BeginChild("msg_generating", ImVec2(0, 0), ImGuiChildFlags_Border | ImGuiChildFlags_AutoResizeY)) {
+            ImGui::TextColored(ImVec4(0.8f, 1.0f, 0.6f, 1.0f), "AI Companion");
+            ImGui::Separator();
+
+            ImGui::PushTextWrapPos(ImGui::GetWindowWidth() - 20);
+            ImGui::TextWrapped("%s", partial.empty() ? "..." : partial.c_str());
+            ImGui::PopTextWrapPos();
+        }
+        ImGui::EndChild();
+        ImGui::PopStyleColor();
+        ImGui::PopStyleVar();
+
+        ImGui::Spacing();
+    }
+
     if (autoScroll && ImGui::GetScrollY() >= ImGui::GetScrollMaxY()) {
         ImGui::SetScrollHereY(1.0f);
     }
@@ -325,7 +351,15 @@ void ChatDemo::RenderInput() {
     ImGui::PopItemWidth();
 
     ImGui::SameLine();
-    bool sendClicked = ImGui::Button("Send", ImVec2(70, 0));
+    bool sendClicked = false;
+    if (isGenerating) {
+        if (ImGui::Button("Stop", ImVec2(70, 0))) {
+            Interface* interface = modelManager->getCurrentModel();
+            if (interface) interface->cancel();
+        }
+    } else {
+        sendClicked = ImGui::Button("Send", ImVec2(70, 0));
+    }
 
     if ((enterPressed || sendClicked) && !isGenerating && strlen(inputBuffer) > 0) {
         SendChatMessage(std::string(inputBuffer));
@@ -371,6 +405,19 @@ void ChatDemo::RenderSettingsDropdown() {
         ImGui::Spacing();
 
         if (ImGui::Button("Clear Chat History", ImVec2(-1, 0))) {
+            Interface* interface = modelManager->getCurrentModel();
+            if (interface) {
+                // Stop the reply in progress (returns within one decode step), then reset the conversation
+                interface->cancel();
+                if (generationFuture.valid()) generationFuture.wait();
+                interface->clearContext();
+            }
+            if (generationFuture.valid()) generationFuture.get();
+            isGenerating = false;
+            {
+                std::lock_guard<std::mutex> lock(generatingMutex);
+                currentlyGenerating.clear();
+            }
             messages.clear();
             messages.emplace_back("Chat history cleared. How can I help you?", false);
             showSettings = false;
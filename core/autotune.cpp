@@ -0,0 +1,384 @@
+#include "autotune.h"
+#include "folder_manager.h"
+#include "numa.h"
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <set>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <intrin.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+namespace {
+
+// The probes' stand-in for a typical request when weighing prefill against decode
+const int REPLY_TOKENS = 64;
+
+uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 1469598103934665603ULL) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string hex(uint64_t value) {
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(value));
+    return buf;
+}
+
+int logicalCores() {
+    return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+#if defined(__linux__)
+
+std::string readLine(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+#endif
+
+std::string cpuBrand() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int regs[12] = {};
+    for (unsigned int i = 0; i < 3; i++) {
+        if (!__get_cpuid(0x80000002 + i, &regs[i * 4], &regs[i * 4 + 1], &regs[i * 4 + 2], &regs[i * 4 + 3])) return "x86";
+    }
+    return std::string(reinterpret_cast<const char*>(regs), sizeof(regs)).c_str();
+#elif defined(_WIN32) && (defined(_M_X64) || defined(_M_IX86))
+    int regs[12] = {};
+    for (int i = 0; i < 3; i++) __cpuid(&regs[i * 4], 0x80000002 + i);
+    return std::string(reinterpret_cast<const char*>(regs), sizeof(regs)).c_str();
+#elif defined(__APPLE__)
+    char brand[128] = {};
+    size_t size = sizeof(brand);
+    if (sysctlbyname("machdep.cpu.brand_string", brand, &size, nullptr, 0) == 0) return brand;
+    return "apple";
+#elif defined(__linux__)
+    // aarch64 has no brand string; implementer and part identify the core
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line, brand;
+    while (std::getline(cpuinfo, line)) {
+        if (line.rfind("model name", 0) == 0 || line.rfind("CPU implementer", 0) == 0 || line.rfind("CPU part", 0) == 0) {
+            brand += line.substr(line.find(':') + 1);
+            if (line.rfind("CPU implementer", 0) != 0) break;
+        }
+    }
+    return brand.empty() ? "unknown" : brand;
+#else
+    return "unknown";
+#endif
+}
+
+// Random token ids - attention and matmul cost doesn't depend on which tokens they are
+std::vector<llama_token> probeTokens(const llama_model* model, int n) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> pick(0, std::max(0, n_vocab - 1));
+    std::vector<llama_token> tokens(n);
+    for (llama_token& token : tokens) token = pick(rng);
+    return tokens;
+}
+
+struct Probe {
+    double prefill_ms = 0.0;
+    double decode_ms = 0.0;  // Per token
+    double score() const { return prefill_ms + REPLY_TOKENS * decode_ms; }
+};
+
+class ProbeContext {
+public:
+    ProbeContext(llama_model* model, const TuneParams& params, int n_prompt, int ubatch, llama_flash_attn_type flash_attn) {
+        auto ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = n_prompt + params.decode_tokens + 1;
+        ctx_params.n_batch = n_prompt;
+        ctx_params.n_ubatch = ubatch;
+        ctx_params.n_seq_max = 1;
+        ctx_params.type_k = params.type_k;
+        ctx_params.type_v = params.type_v;
+        ctx_params.flash_attn_type = flash_attn;
+        ctx_params.no_perf = true;
+        ctx = llama_init_from_model(model, ctx_params);
+        if (ctx == NULL) {
+            throw std::runtime_error("Failed to create autotune context");
+        }
+    }
+    ~ProbeContext() { llama_free(ctx); }
+    ProbeContext(const ProbeContext&) = delete;
+    ProbeContext& operator=(const ProbeContext&) = delete;
+
+    // Prompt in one call, then decode_tokens single-token steps. A context's first run is
+    // preceded by an untimed one-token decode, so paging the weights in isn't measured.
+    Probe run(std::vector<llama_token>& tokens, int decode_tokens, int threads, int threads_batch) {
+        llama_set_n_threads(ctx, threads, threads_batch);
+        if (!warm) {
+            llama_memory_clear(llama_get_memory(ctx), true);
+            if (llama_decode(ctx, llama_batch_get_one(tokens.data(), 1)) != 0) {
+                throw std::runtime_error("Autotune warm-up failed");
+            }
+            warm = true;
+        }
+        return measure(tokens, decode_tokens);
+    }
+
+private:
+    llama_context* ctx = nullptr;
+    bool warm = false;
+
+    Probe measure(std::vector<llama_token>& tokens, int decode_tokens) {
+        using ms = std::chrono::duration<double, std::milli>;
+        llama_memory_clear(llama_get_memory(ctx), true);
+        Probe probe;
+
+        auto start = std::chrono::steady_clock::now();
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), static_cast<int32_t>(tokens.size()))) != 0) {
+            throw std::runtime_error("Autotune prefill failed");
+        }
+        llama_synchronize(ctx);
+        probe.prefill_ms = ms(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < decode_tokens; i++) {
+            if (llama_decode(ctx, llama_batch_get_one(&tokens[i % tokens.size()], 1)) != 0) {
+                throw std::runtime_error("Autotune decode failed");
+            }
+            llama_synchronize(ctx);
+        }
+        probe.decode_ms = ms(std::chrono::steady_clock::now() - start).count() / std::max(1, decode_tokens);
+        return probe;
+    }
+};
+
+// The probes' settings are part of the key: ubatch and flash attention measured for one
+// batch size or cache type don't carry over to another
+std::filesystem::path cachePath(const std::string& model_path, const TuneParams& params) {
+    auto& folder_manager = iamai::FolderManager::getInstance();
+    if (folder_manager.getConfigPath().empty()) {
+        folder_manager.createFolderStructure();
+    }
+    const std::string signature = cpuSignature();
+    const char* flash_attn = params.flash_attn == LLAMA_FLASH_ATTN_TYPE_AUTO ? "auto" :
+                             params.flash_attn == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "on" : "off";
+    // Thread counts tuned on one node fit any node with as many CPUs
+    const std::string node = params.numa_node >= 0 ? "-n" + std::to_string(numaNodeCpus(params.numa_node).size()) : "";
+    const std::string name = modelFingerprint(model_path) + "-" + hex(fnv1a(signature.data(), signature.size())) +
+                             "-b" + std::to_string(params.batch) + "-" + ggml_type_name(params.type_k) + "-" +
+                             ggml_type_name(params.type_v) + "-fa-" + flash_attn + node + ".ini";
+    return folder_manager.getConfigPath() / "autotune" / name;
+}
+
+bool readCache(const std::filesystem::path& path, TuneResult& result) {
+    std::ifstream file(path);
+    if (!file) return false;
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == std::string::npos) continue;
+        const std::string key = line.substr(0, eq);
+        const int value = std::atoi(line.c_str() + eq + 1);
+        if (key == "threads") result.threads = value;
+        else if (key == "threads_batch") result.threads_batch = value;
+        else if (key == "ubatch") result.ubatch = value;
+        else if (key == "flash_attn") result.flash_attn = value != 0;
+    }
+    return result.threads > 0 && result.threads_batch > 0 && result.ubatch > 0;
+}
+
+void writeCache(const std::filesystem::path& path, const TuneResult& result) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    std::ofstream file(path);
+    file << "# " << cpuSignature() << "\n"
+         << "# Written by the autotune pass, delete to measure again\n"
+         << "threads=" << result.threads << "\n"
+         << "threads_batch=" << result.threads_batch << "\n"
+         << "ubatch=" << result.ubatch << "\n"
+         << "flash_attn=" << (result.flash_attn ? 1 : 0) << "\n";
+    if (!file) {
+        std::cerr << "Warning: couldn't save autotune result to " << path.string() << std::endl;
+    }
+}
+
+} // namespace
+
+int performanceCores() {
+#if defined(_WIN32)
+    DWORD size = 0;
+    GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &size);
+    std::vector<char> buffer(size);
+    auto* info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data());
+    if (size == 0 || !GetLogicalProcessorInformationEx(RelationProcessorCore, info, &size)) return logicalCores();
+    // One entry per physical core; E-cores report a lower efficiency class
+    int best_class = -1;
+    int count = 0;
+    for (DWORD offset = 0; offset < size;) {
+        auto* entry = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+        int efficiency = entry->Processor.EfficiencyClass;
+        if (efficiency > best_class) {
+            best_class = efficiency;
+            count = 0;
+        }
+        if (efficiency == best_class) count++;
+        offset += entry->Size;
+    }
+    return count > 0 ? count : logicalCores();
+#elif defined(__APPLE__)
+    int count = 0;
+    size_t size = sizeof(count);
+    if (sysctlbyname("hw.perflevel0.physicalcpu", &count, &size, nullptr, 0) == 0 && count > 0) return count;
+    size = sizeof(count);
+    if (sysctlbyname("hw.physicalcpu", &count, &size, nullptr, 0) == 0 && count > 0) return count;
+    return logicalCores();
+#elif defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return logicalCores();
+
+    // Hybrid Intel lists its P-cores here; big.LITTLE ARM ranks cores by cpu_capacity
+    const std::set<int> p_cores = parseCpuList(readLine("/sys/devices/cpu_core/cpus"));
+    int max_capacity = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        const std::string capacity = readLine("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpu_capacity");
+        max_capacity = std::max(max_capacity, std::atoi(capacity.c_str()));
+    }
+
+    std::set<std::pair<std::string, std::string>> cores;  // (package, core) - SMT siblings share one
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (!p_cores.empty() && p_cores.count(cpu) == 0) continue;
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        if (max_capacity > 0 && std::atoi(readLine(dir + "/cpu_capacity").c_str()) < max_capacity) continue;
+        const std::string core = readLine(dir + "/topology/core_id");
+        if (core.empty()) return logicalCores();
+        cores.insert({readLine(dir + "/topology/physical_package_id"), core});
+    }
+    return cores.empty() ? logicalCores() : static_cast<int>(cores.size());
+#else
+    return logicalCores();
+#endif
+}
+
+std::string cpuSignature() {
+    return cpuBrand() + " | " + std::to_string(logicalCores()) + " logical, " +
+           std::to_string(performanceCores()) + " performance | " + llama_print_system_info();
+}
+
+std::string modelFingerprint(const std::string& model_path) {
+    std::ifstream file(model_path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        throw std::runtime_error("Can't read model file: " + model_path);
+    }
+    const std::streamoff size = file.tellg();
+    const std::streamoff chunk = 1 << 20;
+    std::vector<char> buffer(static_cast<size_t>(std::min(size, chunk)));
+
+    uint64_t hash = fnv1a(reinterpret_cast<const char*>(&size), sizeof(size));
+    for (std::streamoff offset : {std::streamoff(0), std::max(std::streamoff(0), size - chunk)}) {
+        file.seekg(offset);
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        hash = fnv1a(buffer.data(), static_cast<size_t>(file.gcount()), hash);
+    }
+    return hex(hash);
+}
+
+TuneResult autotune(llama_model* model, const TuneParams& params) {
+    const int n_prompt = std::max(1, std::min(params.batch, 1024));
+    const int decode_tokens = std::max(1, params.decode_tokens);
+    std::vector<llama_token> tokens = probeTokens(model, n_prompt);
+
+    TuneResult result;
+    result.ubatch = std::min(n_prompt, 512);
+    result.flash_attn = params.flash_attn == LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    llama_flash_attn_type flash_attn = params.flash_attn;
+
+    // On a node, the probes' threads inherit this thread's affinity and the counts stop at
+    // its CPUs - a replica runs there, with the other nodes busy with their own replicas
+    NodeAffinity pin(params.numa_node);
+    const int cpus = params.numa_node >= 0 ? static_cast<int>(numaNodeCpus(params.numa_node).size()) : logicalCores();
+
+    // Threads: half the P-cores, all of them, every logical CPU
+    const int perf = std::min(performanceCores(), cpus);
+    std::vector<int> counts = {std::max(1, perf / 2), perf, cpus};
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+    {
+        ProbeContext probe_ctx(model, params, n_prompt, result.ubatch, flash_attn);
+        double best_decode = 0.0, best_prefill = 0.0;
+        for (int n : counts) {
+            Probe probe = probe_ctx.run(tokens, decode_tokens, n, n);
+            if (result.threads == 0 || probe.decode_ms < best_decode) {
+                result.threads = n;
+                best_decode = probe.decode_ms;
+            }
+            if (result.threads_batch == 0 || probe.prefill_ms < best_prefill) {
+                result.threads_batch = n;
+                best_prefill = probe.prefill_ms;
+            }
+        }
+    }
+
+    // ubatch: only prefill cost changes (a bigger one also needs a bigger compute buffer)
+    double best_prefill = 0.0;
+    for (int ubatch = 128; ubatch <= n_prompt; ubatch *= 2) {
+        ProbeContext probe_ctx(model, params, n_prompt, ubatch, flash_attn);
+        Probe probe = probe_ctx.run(tokens, 1, result.threads, result.threads_batch);
+        if (best_prefill == 0.0 || probe.prefill_ms < best_prefill) {
+            result.ubatch = ubatch;
+            best_prefill = probe.prefill_ms;
+        }
+    }
+
+    // Flash attention, only when the caller left it to us
+    if (params.flash_attn == LLAMA_FLASH_ATTN_TYPE_AUTO) {
+        double best_score = 0.0;
+        for (bool enabled : {false, true}) {
+            ProbeContext probe_ctx(model, params, n_prompt, result.ubatch,
+                                   enabled ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED);
+            Probe probe = probe_ctx.run(tokens, decode_tokens, result.threads, result.threads_batch);
+            if (!enabled || probe.score() < best_score) {
+                result.flash_attn = enabled;
+                best_score = probe.score();
+            }
+        }
+    }
+    return result;
+}
+
+TuneResult loadOrAutotune(llama_model* model, const std::string& model_path, const TuneParams& params) {
+    const std::filesystem::path path = cachePath(model_path, params);
+    TuneResult result;
+    if (readCache(path, result)) return result;
+
+    std::cout << "Autotuning for this model and CPU..." << std::endl;
+    result = autotune(model, params);
+    writeCache(path, result);
+    return result;
+}
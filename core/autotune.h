@@ -0,0 +1,47 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+#include "llama.h"
+
+// Context settings that depend on the host more than on the model
+struct TuneResult {
+    int threads = 0;          // Decode: memory-bound, usually best on physical P-cores
+    int threads_batch = 0;    // Prefill: compute-bound, may gain from SMT siblings
+    int ubatch = 512;
+    bool flash_attn = false;
+};
+
+// What the probes run against, taken from the caller's Config
+struct TuneParams {
+    int batch = 512;          // Largest ubatch tried, and the prefill probe's length (up to 1024)
+    int decode_tokens = 16;   // Timed single-token decodes per probe
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    llama_flash_attn_type flash_attn = LLAMA_FLASH_ATTN_TYPE_AUTO;  // Only AUTO is tuned
+    int numa_node = -1;       // Probe pinned to this node, thread counts capped at its CPUs
+};
+
+// Physical cores of the fastest class the process may run on: no SMT siblings, no E-cores
+// on hybrid CPUs. Falls back to hardware_concurrency() where the topology isn't readable.
+int performanceCores();
+
+// CPU brand, logical/physical core counts and ggml's compiled-in features
+std::string cpuSignature();
+
+// Hash of the model file's size and its first and last MiB (the GGUF header and metadata,
+// the tail of the tensor data) - cheap on multi-GB files, changes when the file does
+std::string modelFingerprint(const std::string& model_path);
+
+// Times prefill and decode probes of random tokens on throwaway contexts: decode and
+// prefill thread counts, then ubatch size, then flash attention, each picked with the
+// earlier choices fixed. Takes a few seconds; throws std::runtime_error if no probe runs.
+TuneResult autotune(llama_model* model, const TuneParams& params);
+
+// autotune() once per model, host and probe settings: the result is kept in FolderManager's
+// config directory (autotune/<model>-<cpu>-b<batch>-<type_k>-<type_v>-fa-<mode>.ini, with
+// -n<cpus> before .ini when pinned to a node) and read back on later loads with the same
+// settings
+TuneResult loadOrAutotune(llama_model* model, const std::string& model_path, const TuneParams& params);
+
+#endif // AUTOTUNE_H
@@ -0,0 +1,148 @@
+// Counts heap allocations per generated token. A bare llama_decode + sampler loop over
+// the same model is the floor (llama.cpp allocates internally); Interface must not add
+// anything on top of it. Exits with 1 if it does.
+//
+// Usage: bench-alloc [model.gguf] [tokens]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "interface.h"
+
+static std::atomic<long long> g_allocations{0};
+
+void* operator new(std::size_t size) {
+    g_allocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+static const char* PROMPT = "Write a long story about a lighthouse keeper and the ships that pass by.";
+
+// Allocations per token of a minimal decode loop: persistent candidate buffer, no history
+static double baselineAllocsPerToken(const std::string& model_path, const Interface::Config& config, int n_tokens) {
+    llama_model* model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    if (model == NULL) {
+        throw std::runtime_error("Failed to load model");
+    }
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+
+    auto ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = config.ctx;
+    ctx_params.n_batch = config.batch;
+    ctx_params.n_threads = config.threads;
+    ctx_params.n_threads_batch = config.threads;
+    llama_context* ctx = llama_init_from_model(model, ctx_params);
+
+    llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(config.top_k));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(config.top_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(config.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(config.seed));
+
+    std::string prompt = PROMPT;
+    std::vector<llama_token> tokens(prompt.size() + 2);
+    int n_prompt = llama_tokenize(vocab, prompt.c_str(), prompt.size(), tokens.data(), tokens.size(), true, false);
+    tokens.resize(n_prompt);
+    llama_decode(ctx, llama_batch_get_one(tokens.data(), n_prompt));
+
+    std::vector<llama_token_data> candidates(llama_vocab_n_tokens(vocab));
+    auto step = [&]() {
+        const float* logits = llama_get_logits_ith(ctx, -1);
+        for (llama_token i = 0; i < static_cast<llama_token>(candidates.size()); i++) {
+            candidates[i] = {i, logits[i], 0.0f};
+        }
+        llama_token_data_array cur_p = {candidates.data(), candidates.size(), -1, false};
+        llama_sampler_apply(chain, &cur_p);
+        llama_token id = cur_p.data[cur_p.selected].id;
+        llama_sampler_accept(chain, id);
+        llama_decode(ctx, llama_batch_get_one(&id, 1));
+    };
+
+    // Warm up before counting, llama.cpp sizes some buffers on first use
+    for (int i = 0; i < 4; i++) step();
+
+    long long before = g_allocations;
+    for (int i = 0; i < n_tokens; i++) step();
+    long long allocations = g_allocations - before;
+
+    llama_sampler_free(chain);
+    llama_free(ctx);
+    llama_model_free(model);
+
+    return static_cast<double>(allocations) / n_tokens;
+}
+
+int main(int argc, char** argv) {
+    const std::string model_path = argc > 1 ? argv[1] : "./models/Llama-3.2-1B-Instruct-Q4_K_M.gguf";
+    const int n_tokens = argc > 2 ? std::atoi(argv[2]) : 128;
+
+    Interface::Config config;
+    config.ctx = 2048;
+    config.max_tokens = n_tokens;
+    config.seed = 42;               // Same sequence on every run, so runs only differ in length
+    config.reuse_prefix = false;    // Every run prefills the full prompt
+    Interface iface(model_path, config);
+
+    std::vector<llama_token> prompt = iface.tokenize(PROMPT);
+    std::vector<llama_token> out(n_tokens);
+
+    // Per-call costs (prefill, callback wrappers) cancel out between a short and a long run
+    auto tokenRun = [&](int max_tokens, int& generated) {
+        iface.clearContext();
+        iface.setMaxTokens(max_tokens);
+        long long before = g_allocations;
+        generated = iface.generateTokens(prompt.data(), static_cast<int>(prompt.size()), out.data(), max_tokens);
+        return g_allocations - before;
+    };
+    auto textRun = [&](int max_tokens, int& generated) {
+        iface.clearContext();
+        iface.setMaxTokens(max_tokens);
+        size_t bytes = 0;
+        Interface::TokenCallback onToken = [&bytes](const std::string& piece) {
+            bytes += piece.size();
+            return true;
+        };
+        long long before = g_allocations;
+        iface.generate(PROMPT, onToken);
+        long long allocations = g_allocations - before;
+        generated = iface.getStats().generated_tokens;
+        return allocations;
+    };
+
+    int short_len = std::max(1, n_tokens / 4);
+    int warmup = 0;
+    tokenRun(n_tokens, warmup);
+
+    double baseline = baselineAllocsPerToken(model_path, config, n_tokens);
+    std::cout << "baseline (llama_decode + sampler): " << baseline << " allocations/token" << std::endl;
+
+    bool ok = true;
+    auto report = [&](const char* name, auto run) {
+        int n_short = 0, n_long = 0;
+        long long a_short = run(short_len, n_short);
+        long long a_long = run(n_tokens, n_long);
+        if (n_long <= n_short) {
+            std::cout << name << ": model stopped after " << n_long << " tokens, use a longer prompt" << std::endl;
+            ok = false;
+            return;
+        }
+
+        double per_token = static_cast<double>(a_long - a_short) / (n_long - n_short);
+        double extra = per_token - baseline;
+        std::cout << name << ": " << per_token << " allocations/token (" << extra << " over baseline, "
+                  << n_long - n_short << " tokens measured)" << std::endl;
+        if (extra > 0.01) ok = false;
+    };
+    report("generateTokens", tokenRun);
+    report("generate (streaming)", textRun);
+
+    std::cout << (ok ? "PASS" : "FAIL") << ": Interface adds " << (ok ? "no" : "some")
+              << " heap allocations per generated token" << std::endl;
+    return ok ? 0 : 1;
+}
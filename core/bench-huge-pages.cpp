@@ -0,0 +1,90 @@
+// Decode speed with and without transparent huge pages. Each round loads the model twice,
+// plain and with Config::huge_pages, and times the same greedy reply; the best round of
+// each is reported with the huge-page coverage it reached. Exits with 1 if nothing could be
+// backed by huge pages (THP off, or not Linux).
+//
+// With mmap'd weights only the KV cache and compute buffers qualify, unless the kernel has
+// CONFIG_READ_ONLY_THP_FOR_FS; --no-mmap reads the weights into anonymous memory instead.
+//
+// Usage: bench-huge-pages [model.gguf] [--rounds 2] [--gen 128] [--ctx 4096] [--threads 8] [--no-mmap]
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <cstdlib>
+#include "interface.h"
+
+static const char* PROMPT = "Write a long story about a lighthouse keeper and the ships that pass by.";
+
+struct Run {
+    double decode_tps = 0.0;
+    double load_ms = 0.0;
+    HugePageCoverage coverage;
+};
+
+static Run runOnce(const std::string& model_path, Interface::Config config, bool huge_pages) {
+    config.huge_pages = huge_pages;
+    Interface iface(model_path, config);
+    iface.generate(PROMPT);
+
+    Run run;
+    run.decode_tps = iface.getStats().generatedTokensPerSec();
+    run.load_ms = iface.getLoadStats().ready_ms;
+    run.coverage = iface.getHugePageCoverage();  // After the reply, so everything it touched counts
+    return run;
+}
+
+int main(int argc, char** argv) {
+    std::string model_path = "./models/Llama-3.2-1B-Instruct-Q4_K_M.gguf";
+    int rounds = 2;
+    Interface::Config config;
+    config.ctx = 4096;
+    config.batch = 512;
+    config.max_tokens = 128;
+    config.threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    config.temperature = 0.0f;  // Same reply, same amount of work, every run
+    config.seed = 42;
+    config.unbounded = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--rounds" && has_value) rounds = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--gen" && has_value) config.max_tokens = std::atoi(argv[++i]);
+        else if (arg == "--ctx" && has_value) config.ctx = std::atoi(argv[++i]);
+        else if (arg == "--threads" && has_value) config.threads = std::atoi(argv[++i]);
+        else if (arg == "--no-mmap") config.use_mmap = false;
+        else if (arg.rfind("--", 0) != 0) model_path = arg;
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    std::cout << "THP: " << HugePageRegions::systemMode() << std::endl;
+    Run best[2];
+    try {
+        // Alternating, so page cache and thermal drift hit both the same way
+        for (int round = 0; round < rounds; round++) {
+            for (int mode = 0; mode < 2; mode++) {
+                Run run = runOnce(model_path, config, mode == 1);
+                std::cerr << "round " << round + 1 << (mode ? " huge pages: " : " plain: ") << run.decode_tps
+                          << " tok/s" << std::endl;
+                if (run.decode_tps > best[mode].decode_tps) best[mode] = run;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+
+    const HugePageCoverage& coverage = best[1].coverage;
+    std::cout << "plain:      " << best[0].decode_tps << " tok/s decode, loaded in " << best[0].load_ms << " ms" << std::endl;
+    std::cout << "huge pages: " << best[1].decode_tps << " tok/s decode, loaded in " << best[1].load_ms << " ms, "
+              << (coverage.huge_bytes >> 20) << " of " << (coverage.bytes >> 20) << " MiB covered ("
+              << static_cast<int>(coverage.ratio() * 100.0) << "%)" << std::endl;
+    if (best[0].decode_tps > 0.0) {
+        std::cout << "speedup:    " << best[1].decode_tps / best[0].decode_tps << "x" << std::endl;
+    }
+    return coverage.huge_bytes > 0 ? 0 : 1;
+}
@@ -0,0 +1,425 @@
+// Prefill/decode benchmark for Interface. Sweeps prompt length, generation length, thread
+// count, batch size and how full the context already is, one dimension at a time around a
+// base point, and writes the results as JSON:
+//   ttft_ms      call start to the first streamed piece (median over repeats)
+//   prefill_tps  prompt tokens evaluated per second
+//   decode_tps   generated tokens per second after the first one
+//   p50_ms/p99_ms  gap between streamed pieces (one per token, except where a token ends
+//                  inside a UTF-8 character and its text arrives with the next one)
+//   peak_rss_mb  process peak so far - model loads dominate it, later points only raise it
+//   kv_est_mb    KV cache size worked out from --ctx and the --type-k/--type-v types, not
+//                measured (SWA layers, padding and recurrent state aren't accounted for)
+// The header also has the first model load: load_ms (construction) and
+// load_to_first_token_ms (construction plus the first reply's time to first token).
+//
+// With --baseline, every point also present in that file (one this tool wrote earlier) is
+// compared against it; anything worse than the tolerance is reported and the exit code is 1.
+//
+// --synthetic runs against a small random-weight model written to the temp directory, so
+// the suite works offline (its numbers only compare with other synthetic runs).
+//
+// Runs with different cache types share point names, so a q8_0 run can take an f16 run as
+// its baseline to see what the smaller cache costs in speed.
+//
+// Usage: bench-interface [model.gguf | --synthetic] [--out results.json] [--baseline baseline.json]
+//                        [--tolerance 0.10] [--repeat 3] [--threads 4,8] [--ctx 4096] [--quick]
+//                        [--type-k f16] [--type-v f16] [--flash-attn auto|on|off]
+//                        [--numa-node 0 | --numa distribute|isolate|numactl]
+//                        [--no-mmap] [--mlock] [--no-warmup] [--huge-pages]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include "interface.h"
+#include "synthetic_model.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+static const char* STORY =
+    "The lighthouse keeper climbed the spiral stairs every evening at dusk, counting the steps as his "
+    "father had taught him. From the lamp room he could see the harbour, the fishing boats coming home "
+    "and the long grey line of the cargo ships waiting for the tide. He wrote each one down in the log: "
+    "its name, its flag, the hour it passed the point and anything unusual about the way it moved. ";
+
+struct Point {
+    int threads;
+    int batch;
+    int prompt;       // Prompt tokens
+    int gen;          // Tokens to generate
+    float fill;       // Fraction of the context filled before the prompt
+
+    std::string name() const {
+        char buf[128];
+        std::snprintf(buf, sizeof(buf), "prompt=%d gen=%d threads=%d batch=%d fill=%.2f",
+                      prompt, gen, threads, batch, fill);
+        return buf;
+    }
+};
+
+struct Result {
+    Point point;
+    int prompt_tokens = 0;
+    int generated_tokens = 0;
+    double ttft_ms = 0.0;
+    double prefill_tps = 0.0;
+    double decode_tps = 0.0;
+    double p50_ms = 0.0;
+    double p99_ms = 0.0;
+    double peak_rss_mb = 0.0;
+    double kv_est_mb = 0.0;
+};
+
+static double peakRssMb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0.0;
+    return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);  // Bytes
+#else
+    return usage.ru_maxrss / 1024.0;             // Kilobytes
+#endif
+#endif
+}
+
+static double median(std::vector<double> values) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2.0;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t i = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[std::min(i, values.size() - 1)];
+}
+
+static std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+static std::vector<int> parseList(const std::string& text) {
+    std::vector<int> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) values.push_back(std::atoi(item.c_str()));
+    }
+    return values;
+}
+
+// One result per line, so the baseline reader doesn't need a JSON parser
+static std::string toJson(const Result& r) {
+    char buf[512];
+    std::snprintf(buf, sizeof(buf),
+                  "{\"name\": \"%s\", \"prompt\": %d, \"gen\": %d, \"threads\": %d, \"batch\": %d, \"fill\": %.2f, "
+                  "\"prompt_tokens\": %d, \"generated_tokens\": %d, \"ttft_ms\": %.3f, \"prefill_tps\": %.2f, "
+                  "\"decode_tps\": %.2f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"peak_rss_mb\": %.1f, \"kv_est_mb\": %.1f}",
+                  r.point.name().c_str(), r.point.prompt, r.point.gen, r.point.threads, r.point.batch, r.point.fill,
+                  r.prompt_tokens, r.generated_tokens, r.ttft_ms, r.prefill_tps, r.decode_tps, r.p50_ms, r.p99_ms,
+                  r.peak_rss_mb, r.kv_est_mb);
+    return buf;
+}
+
+static double numberField(const std::string& line, const std::string& key) {
+    size_t at = line.find("\"" + key + "\":");
+    if (at == std::string::npos) return 0.0;
+    return std::strtod(line.c_str() + at + key.size() + 3, nullptr);
+}
+
+static std::map<std::string, Result> readBaseline(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Failed to open baseline " + path);
+    }
+    std::map<std::string, Result> baseline;
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t at = line.find("\"name\": \"");
+        if (at == std::string::npos) continue;
+        size_t begin = at + 9;
+        size_t end = line.find('"', begin);
+        if (end == std::string::npos) continue;
+        Result r;
+        r.ttft_ms = numberField(line, "ttft_ms");
+        r.prefill_tps = numberField(line, "prefill_tps");
+        r.decode_tps = numberField(line, "decode_tps");
+        r.p99_ms = numberField(line, "p99_ms");
+        baseline[line.substr(begin, end - begin)] = r;
+    }
+    return baseline;
+}
+
+// Lower-is-better metrics regress when they grow past the tolerance, rates when they shrink
+static int compareToBaseline(const std::vector<Result>& results, const std::map<std::string, Result>& baseline,
+                             double tolerance) {
+    int regressions = 0;
+    auto check = [&](const std::string& name, const char* metric, double value, double base, bool higher_is_better) {
+        if (base <= 0.0 || value <= 0.0) return;
+        double change = (value - base) / base;
+        bool worse = higher_is_better ? change < -tolerance : change > tolerance;
+        if (worse) {
+            std::cerr << "REGRESSION " << name << ": " << metric << " " << base << " -> " << value
+                      << " (" << (change > 0 ? "+" : "") << change * 100.0 << "%)" << std::endl;
+            regressions++;
+        }
+    };
+
+    int compared = 0;
+    for (const Result& r : results) {
+        const std::string name = r.point.name();
+        auto it = baseline.find(name);
+        if (it == baseline.end()) continue;
+        compared++;
+        check(name, "ttft_ms", r.ttft_ms, it->second.ttft_ms, false);
+        check(name, "prefill_tps", r.prefill_tps, it->second.prefill_tps, true);
+        check(name, "decode_tps", r.decode_tps, it->second.decode_tps, true);
+        check(name, "p99_ms", r.p99_ms, it->second.p99_ms, false);
+    }
+    std::cerr << compared << " points compared against the baseline, " << regressions << " regressions" << std::endl;
+    return regressions;
+}
+
+static Result measure(Interface& iface, const Point& point, const std::vector<llama_token>& story, int repeat) {
+    // A prompt of about point.prompt tokens that stops mid-story, so the model keeps writing
+    std::vector<llama_token> prompt_tokens;
+    std::vector<llama_token> fill_tokens;
+    while (static_cast<int>(prompt_tokens.size()) < point.prompt) {
+        prompt_tokens.insert(prompt_tokens.end(), story.begin(), story.end());
+    }
+    prompt_tokens.resize(point.prompt);
+    const std::string prompt = iface.detokenize(prompt_tokens.data(), static_cast<int>(prompt_tokens.size()));
+
+    const int n_fill = static_cast<int>(point.fill * iface.getContextSize());
+    while (static_cast<int>(fill_tokens.size()) < n_fill) {
+        fill_tokens.insert(fill_tokens.end(), story.begin(), story.end());
+    }
+    fill_tokens.resize(n_fill);
+
+    std::vector<double> ttft, prefill, decode, gaps;
+    gaps.reserve(static_cast<size_t>(repeat) * point.gen);
+    std::vector<llama_token> one(1);
+    Result result;
+    result.point = point;
+
+    for (int rep = 0; rep < repeat; rep++) {
+        iface.clearContext();
+        if (n_fill > 0) {
+            iface.setMaxTokens(1);
+            iface.generateTokens(fill_tokens.data(), n_fill, one.data(), 1);
+        }
+
+        iface.setMaxTokens(point.gen);
+        auto last = std::chrono::steady_clock::now();
+        bool first = true;
+        Interface::TokenCallback onToken = [&](const std::string&) {
+            auto now = std::chrono::steady_clock::now();
+            if (!first) gaps.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+            first = false;
+            last = now;
+            return true;
+        };
+        iface.generate(prompt, onToken);
+
+        const Interface::Stats& stats = iface.getStats();
+        ttft.push_back(stats.first_token_ms);
+        prefill.push_back(stats.prefillTokensPerSec());
+        decode.push_back(stats.generatedTokensPerSec());
+        result.prompt_tokens = stats.prompt_tokens;
+        result.generated_tokens = stats.generated_tokens;
+    }
+
+    result.ttft_ms = median(ttft);
+    result.prefill_tps = median(prefill);
+    result.decode_tps = median(decode);
+    result.p50_ms = percentile(gaps, 0.50);
+    result.p99_ms = percentile(gaps, 0.99);
+    result.peak_rss_mb = peakRssMb();
+    return result;
+}
+
+int main(int argc, char** argv) {
+    std::string model_path = "./models/Llama-3.2-1B-Instruct-Q4_K_M.gguf";
+    std::string out_path, baseline_path;
+    double tolerance = 0.10;
+    int repeat = 3;
+    int ctx = 4096;
+    bool quick = false;
+    bool synthetic = false;
+    std::string type_k = "f16", type_v = "f16", flash_attn = "auto";
+    int numa_node = -1;
+    bool use_mmap = true, use_mlock = false, warmup = true, huge_pages = false;
+    std::string numa = "disabled";
+
+    unsigned int hw = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> threads = {static_cast<int>(std::max(1u, hw / 2)), static_cast<int>(hw)};
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--out" && has_value) out_path = argv[++i];
+        else if (arg == "--baseline" && has_value) baseline_path = argv[++i];
+        else if (arg == "--tolerance" && has_value) tolerance = std::atof(argv[++i]);
+        else if (arg == "--repeat" && has_value) repeat = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--threads" && has_value) threads = parseList(argv[++i]);
+        else if (arg == "--ctx" && has_value) ctx = std::atoi(argv[++i]);
+        else if (arg == "--type-k" && has_value) type_k = argv[++i];
+        else if (arg == "--type-v" && has_value) type_v = argv[++i];
+        else if (arg == "--flash-attn" && has_value) flash_attn = argv[++i];
+        else if (arg == "--numa-node" && has_value) numa_node = std::atoi(argv[++i]);
+        else if (arg == "--numa" && has_value) numa = argv[++i];
+        else if (arg == "--no-mmap") use_mmap = false;
+        else if (arg == "--mlock") use_mlock = true;
+        else if (arg == "--no-warmup") warmup = false;
+        else if (arg == "--huge-pages") huge_pages = true;
+        else if (arg == "--quick") quick = true;
+        else if (arg == "--synthetic") synthetic = true;
+        else if (arg.rfind("--", 0) != 0) model_path = arg;
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 2;
+        }
+    }
+    if (threads.empty()) {
+        std::cerr << "--threads needs at least one value" << std::endl;
+        return 2;
+    }
+    if (quick) repeat = 1;
+    if (synthetic) {
+        model_path = (std::filesystem::temp_directory_path() / "iamai-bench-synthetic.gguf").string();
+        try {
+            writeSyntheticModel(model_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 2;
+        }
+    }
+
+    // One dimension at a time around the base point
+    const Point base = {threads.back(), 512, 256, 64, 0.0f};
+    std::vector<int> prompts = quick ? std::vector<int>{32, 256} : std::vector<int>{32, 256, 1024, 2048};
+    std::vector<int> gens = quick ? std::vector<int>{64} : std::vector<int>{16, 64, 256};
+    std::vector<int> batches = quick ? std::vector<int>{512} : std::vector<int>{64, 256, 512};
+    std::vector<float> fills = quick ? std::vector<float>{0.0f, 0.5f} : std::vector<float>{0.0f, 0.5f, 0.9f};
+
+    std::vector<Point> points;
+    for (int p : prompts) { Point pt = base; pt.prompt = p; points.push_back(pt); }
+    for (int g : gens) { Point pt = base; pt.gen = g; points.push_back(pt); }
+    for (int t : threads) { Point pt = base; pt.threads = t; points.push_back(pt); }
+    for (int b : batches) { Point pt = base; pt.batch = b; points.push_back(pt); }
+    for (float f : fills) { Point pt = base; pt.fill = f; points.push_back(pt); }
+
+    // Drop repeats of the base point and anything that wouldn't fit without a context shift
+    std::vector<Point> unique;
+    for (const Point& pt : points) {
+        bool seen = std::any_of(unique.begin(), unique.end(), [&](const Point& u) { return u.name() == pt.name(); });
+        bool fits = static_cast<int>(pt.fill * ctx) + pt.prompt + pt.gen + 2 <= ctx;
+        if (!seen && fits) unique.push_back(pt);
+    }
+    // Threads and batch size are context parameters - group points that can share a context
+    std::stable_sort(unique.begin(), unique.end(), [](const Point& a, const Point& b) {
+        return a.threads != b.threads ? a.threads < b.threads : a.batch < b.batch;
+    });
+
+    std::vector<Result> results;
+    Interface::LoadStats first_load;
+    try {
+        std::unique_ptr<Interface> iface;
+        std::vector<llama_token> story;
+        for (const Point& pt : unique) {
+            if (!iface || iface->config.threads != pt.threads || iface->config.batch != pt.batch) {
+                iface.reset();
+                Interface::Config config;
+                config.ctx = ctx;
+                config.batch = pt.batch;
+                config.threads = pt.threads;
+                config.seed = 42;
+                config.reuse_prefix = false;  // Every repeat prefills the whole prompt
+                config.unbounded = false;
+                config.type_k = Interface::kvCacheType(type_k);
+                config.type_v = Interface::kvCacheType(type_v);
+                config.flash_attn = flash_attn == "on" ? LLAMA_FLASH_ATTN_TYPE_ENABLED
+                                  : flash_attn == "off" ? LLAMA_FLASH_ATTN_TYPE_DISABLED : LLAMA_FLASH_ATTN_TYPE_AUTO;
+                config.numa_node = numa_node;
+                config.use_mmap = use_mmap;
+                config.use_mlock = use_mlock;
+                config.warmup = warmup;
+                config.huge_pages = huge_pages;
+                config.numa = numa == "distribute" ? GGML_NUMA_STRATEGY_DISTRIBUTE
+                            : numa == "isolate" ? GGML_NUMA_STRATEGY_ISOLATE
+                            : numa == "numactl" ? GGML_NUMA_STRATEGY_NUMACTL : GGML_NUMA_STRATEGY_DISABLED;
+                iface.reset(new Interface(model_path, config));
+                story = iface->tokenize(STORY, false);
+            }
+            Result r = measure(*iface, pt, story, repeat);
+            if (results.empty()) first_load = iface->getLoadStats();
+            r.kv_est_mb = iface->estimateKvCacheBytes() / (1024.0 * 1024.0);
+            std::cerr << pt.name() << ": ttft " << r.ttft_ms << " ms, prefill " << r.prefill_tps
+                      << " tok/s, decode " << r.decode_tps << " tok/s, p50 " << r.p50_ms << " ms, p99 "
+                      << r.p99_ms << " ms (" << r.generated_tokens << " tokens)" << std::endl;
+            results.push_back(r);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+
+    std::ostringstream json;
+    json << "{\n\"model\": \"" << jsonEscape(model_path) << "\",\n\"ctx\": " << ctx
+         << ",\n\"type_k\": \"" << jsonEscape(type_k) << "\",\n\"type_v\": \"" << jsonEscape(type_v)
+         << "\",\n\"flash_attn\": \"" << jsonEscape(flash_attn) << "\",\n\"numa_node\": " << numa_node
+         << ",\n\"numa\": \"" << jsonEscape(numa) << "\",\n\"load_ms\": " << first_load.ready_ms
+         << ",\n\"load_to_first_token_ms\": " << first_load.first_token_ms
+         << ",\n\"huge_pages\": " << (huge_pages ? "true" : "false") << ",\n\"repeat\": " << repeat
+         << ",\n\"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        json << toJson(results[i]) << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "]\n}\n";
+
+    if (out_path.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream file(out_path);
+        file << json.str();
+        if (!file) {
+            std::cerr << "Error: failed to write " << out_path << std::endl;
+            return 2;
+        }
+    }
+
+    if (!baseline_path.empty()) {
+        try {
+            return compareToBaseline(results, readBaseline(baseline_path), tolerance) > 0 ? 1 : 0;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Compares the fused top-k/top-p/temperature sampler with llama.cpp's separate stages on
+// synthetic logits rows: time per sampled token and whether both draw the same tokens
+// from the same seed. No model needed.
+//
+// Usage: bench-sampler [n_vocab] [iterations] [top_k] [top_p] [temperature]
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include "llama.h"
+#include "fused_sampler.h"
+
+int main(int argc, char** argv) {
+    const int n_vocab = argc > 1 ? std::atoi(argv[1]) : 152064;
+    const int iterations = argc > 2 ? std::atoi(argv[2]) : 2000;
+    FusedSamplerParams params;
+    if (argc > 3) params.top_k = std::atoi(argv[3]);
+    if (argc > 4) params.top_p = static_cast<float>(std::atof(argv[4]));
+    if (argc > 5) params.temperature = static_cast<float>(std::atof(argv[5]));
+    const uint32_t seed = 1234;
+
+    // A few rows with a long tail and a handful of strong candidates, like real logits
+    std::mt19937 rng(42);
+    std::normal_distribution<float> tail(0.0f, 2.0f);
+    std::uniform_int_distribution<int> pick(0, n_vocab - 1);
+    std::vector<std::vector<float>> rows(16, std::vector<float>(n_vocab));
+    for (auto& row : rows) {
+        for (auto& logit : row) logit = tail(rng);
+        for (int i = 0; i < 8; i++) row[pick(rng)] += 12.0f - i;
+    }
+
+    llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(params.top_k));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(params.top_p, params.min_keep));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+
+    llama_sampler* dist = llama_sampler_init_dist(seed);
+
+    std::vector<llama_token_data> candidates(n_vocab);
+    std::vector<llama_token> chain_tokens(iterations), fused_tokens(iterations);
+
+    // Separate stages, fed the way llama_sampler_sample() feeds them
+    auto start = std::chrono::steady_clock::now();
+    for (int it = 0; it < iterations; it++) {
+        const std::vector<float>& row = rows[it % rows.size()];
+        for (llama_token i = 0; i < n_vocab; i++) candidates[i] = {i, row[i], 0.0f};
+        llama_token_data_array cur_p = {candidates.data(), candidates.size(), -1, false};
+        llama_sampler_apply(chain, &cur_p);
+        chain_tokens[it] = cur_p.data[cur_p.selected].id;
+        llama_sampler_accept(chain, chain_tokens[it]);
+    }
+    std::chrono::duration<double, std::micro> chain_time = std::chrono::steady_clock::now() - start;
+
+    // Fused selection straight from the row, then dist - what Interface does
+    start = std::chrono::steady_clock::now();
+    for (int it = 0; it < iterations; it++) {
+        const std::vector<float>& row = rows[it % rows.size()];
+        size_t n = fusedSelect(row.data(), n_vocab, params, candidates.data());
+        llama_token_data_array cur_p = {candidates.data(), n, -1, true};
+        llama_sampler_apply(dist, &cur_p);
+        fused_tokens[it] = cur_p.data[cur_p.selected].id;
+        llama_sampler_accept(dist, fused_tokens[it]);
+    }
+    std::chrono::duration<double, std::micro> fused_time = std::chrono::steady_clock::now() - start;
+
+    int mismatches = 0;
+    for (int it = 0; it < iterations; it++) {
+        if (chain_tokens[it] != fused_tokens[it]) mismatches++;
+    }
+
+    double chain_us = chain_time.count() / iterations;
+    double fused_us = fused_time.count() / iterations;
+    std::cout << "n_vocab " << n_vocab << ", top_k " << params.top_k << ", top_p " << params.top_p
+              << ", temperature " << params.temperature << ", " << iterations << " samples" << std::endl;
+    std::cout << "chain: " << chain_us << " us/token" << std::endl;
+    std::cout << "fused: " << fused_us << " us/token (" << chain_us / fused_us << "x)" << std::endl;
+    std::cout << "same token from the same seed: " << iterations - mismatches << "/" << iterations << std::endl;
+
+    llama_sampler_free(dist);
+    llama_sampler_free(chain);
+
+    // Only exactly equal logits may be ordered differently, that must stay rare
+    return mismatches * 1000 > iterations ? 1 : 0;
+}
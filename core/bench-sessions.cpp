@@ -0,0 +1,152 @@
+// Aggregate throughput of SessionEngine. For each concurrency level, opens that many
+// sessions, queues --requests turns on every one of them at once and reports the
+// generated tokens per second over all sessions, next to the single-session rate. Every
+// request must come back with a reply; exits with 1 if one was dropped or came back empty.
+//
+// --synthetic runs against a small random-weight model written to the temp directory, so
+// it works offline (its replies never end early, so every request generates --gen tokens).
+//
+// Usage: bench-sessions [model.gguf | --synthetic] [--sessions 1,4,8,16] [--requests 2]
+//                       [--gen 64] [--ctx 8192] [--batch 512] [--threads 8]
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <stdexcept>
+#include <filesystem>
+#include "session_engine.h"
+#include "synthetic_model.h"
+
+static const char* PROMPTS[] = {
+    "Write a short story about a lighthouse keeper.",
+    "Explain how a steam engine works to a ten year old.",
+    "List some things to pack for a week of hiking in the mountains.",
+    "Describe the harbour of a small fishing town at dawn.",
+};
+
+static std::vector<int> parseList(const std::string& text) {
+    std::vector<int> values;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) values.push_back(std::atoi(item.c_str()));
+    }
+    return values;
+}
+
+struct Run {
+    double seconds = 0.0;
+    long long tokens = 0;
+    int failed = 0;
+    double tps() const { return seconds > 0.0 ? tokens / seconds : 0.0; }
+};
+
+static Run runSessions(const std::string& model_path, SessionEngine::Config config, int n_sessions, int requests) {
+    // Declared before the engine, whose worker may still call onDone until it's destroyed
+    std::mutex mutex;
+    std::condition_variable cv;
+    int pending = 0;
+    Run run;
+
+    config.max_sessions = n_sessions;
+    SessionEngine engine(model_path, config);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int s = 0; s < n_sessions; s++) {
+        int session = engine.openSession();
+        if (session < 0) {
+            throw std::runtime_error("Failed to open session");
+        }
+        // Turns of one session run in order, different sessions run side by side
+        for (int r = 0; r < requests; r++) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending++;
+            }
+            const char* prompt = PROMPTS[(s + r) % (sizeof(PROMPTS) / sizeof(PROMPTS[0]))];
+            engine.submit(session, prompt, nullptr, [&](const std::string& reply) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (reply.empty()) run.failed++;
+                if (--pending == 0) cv.notify_all();
+            });
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&pending] { return pending == 0; });
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run.tokens = engine.generatedTokens();
+    return run;
+}
+
+int main(int argc, char** argv) {
+    std::string model_path = "./models/Llama-3.2-1B-Instruct-Q4_K_M.gguf";
+    std::vector<int> levels = {1, 4, 8, 16};
+    int requests = 2;
+    bool synthetic = false;
+    SessionEngine::Config config;
+    config.max_tokens = 64;
+    config.threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    config.seed = 42;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--sessions" && has_value) levels = parseList(argv[++i]);
+        else if (arg == "--requests" && has_value) requests = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--gen" && has_value) config.max_tokens = std::atoi(argv[++i]);
+        else if (arg == "--ctx" && has_value) config.ctx = std::atoi(argv[++i]);
+        else if (arg == "--batch" && has_value) config.batch = std::atoi(argv[++i]);
+        else if (arg == "--threads" && has_value) config.threads = std::atoi(argv[++i]);
+        else if (arg == "--synthetic") synthetic = true;
+        else if (arg.rfind("--", 0) != 0) model_path = arg;
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 2;
+        }
+    }
+    levels.erase(std::remove_if(levels.begin(), levels.end(), [](int n) { return n < 1; }), levels.end());
+    if (levels.empty()) {
+        std::cerr << "--sessions needs at least one value" << std::endl;
+        return 2;
+    }
+    if (synthetic) {
+        model_path = (std::filesystem::temp_directory_path() / "iamai-bench-synthetic.gguf").string();
+        try {
+            writeSyntheticModel(model_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 2;
+        }
+    }
+
+    int failed = 0;
+    double single_tps = 0.0;
+    try {
+        for (int n : levels) {
+            Run run = runSessions(model_path, config, n, requests);
+            if (n == 1) single_tps = run.tps();
+            failed += run.failed;
+
+            std::cout << "sessions=" << n << ": " << run.tokens << " tokens in " << run.seconds << " s, "
+                      << run.tps() << " tok/s aggregate";
+            if (single_tps > 0.0 && n > 1) {
+                std::cout << " (" << run.tps() / single_tps << "x single session)";
+            }
+            if (run.failed > 0) {
+                std::cout << ", " << run.failed << " of " << n * requests << " requests failed";
+            }
+            std::cout << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+// Constrained replies stay valid when the model's best tokens are all outside the grammar.
+// Interface checks only the token the chain sampled and goes over the whole vocab when it
+// was rejected (see Config::grammar), so this drives that fallback on every step: the
+// grammar allows a single letter the model never picked in an unconstrained greedy reply,
+// and top-k keeps only a handful of candidates. Every constrained reply must be that
+// letter repeated; exits with 1 if one isn't.
+//
+// --synthetic runs against a small random-weight model written to the temp directory, so
+// it works offline.
+//
+// Usage: check-grammar [model.gguf | --synthetic] [--runs 8] [--gen 32] [--top-k 4] [--threads 8]
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <cstdlib>
+#include <filesystem>
+#include "interface.h"
+#include "synthetic_model.h"
+
+static const char* PROMPTS[] = {
+    "Write a short story about a lighthouse keeper.",
+    "Explain how a steam engine works to a ten year old.",
+    "List some things to pack for a week of hiking in the mountains.",
+    "Describe the harbour of a small fishing town at dawn.",
+};
+
+int main(int argc, char** argv) {
+    std::string model_path = "./models/Llama-3.2-1B-Instruct-Q4_K_M.gguf";
+    int runs = 8;
+    bool synthetic = false;
+    Interface::Config config;
+    config.max_tokens = 32;
+    config.top_k = 4;
+    config.threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    config.seed = 42;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--runs" && has_value) runs = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--gen" && has_value) config.max_tokens = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--top-k" && has_value) config.top_k = std::atoi(argv[++i]);
+        else if (arg == "--threads" && has_value) config.threads = std::atoi(argv[++i]);
+        else if (arg == "--synthetic") synthetic = true;
+        else if (arg.rfind("--", 0) != 0) model_path = arg;
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    int invalid = 0;
+    try {
+        if (synthetic) {
+            model_path = (std::filesystem::temp_directory_path() / "iamai-check-synthetic.gguf").string();
+            writeSyntheticModel(model_path);
+        }
+
+        // The letter: one the model doesn't choose on its own for any of the prompts
+        std::string unconstrained;
+        {
+            Interface::Config greedy = config;
+            greedy.temperature = 0.0f;
+            Interface iface(model_path, greedy);
+            for (const char* prompt : PROMPTS) {
+                iface.clearContext();
+                unconstrained += iface.generate(prompt);
+            }
+        }
+        char letter = 0;
+        for (char c : std::string("xqzjkvwybfgpmhcdulrsnotiae")) {
+            if (unconstrained.find(c) == std::string::npos) {
+                letter = c;
+                break;
+            }
+        }
+        if (letter == 0) {
+            std::cerr << "Error: the unconstrained replies use every letter, nothing to constrain to" << std::endl;
+            return 2;
+        }
+        std::cout << "grammar: root ::= \"" << letter << "\"+ (never in the unconstrained replies), top_k "
+                  << config.top_k << std::endl;
+
+        config.grammar = std::string("root ::= \"") + letter + "\"+";
+        Interface iface(model_path, config);
+        for (int r = 0; r < runs; r++) {
+            iface.clearContext();
+            const std::string reply = iface.generate(PROMPTS[r % (sizeof(PROMPTS) / sizeof(PROMPTS[0]))]);
+            const bool valid = !reply.empty() &&
+                               std::all_of(reply.begin(), reply.end(), [letter](char c) { return c == letter; });
+            if (!valid) {
+                invalid++;
+                std::cout << "run " << r << ": invalid reply \"" << reply << "\"" << std::endl;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+
+    std::cout << (invalid == 0 ? "PASS" : "FAIL") << ": " << runs - invalid << " of " << runs
+              << " constrained replies match the grammar" << std::endl;
+    return invalid > 0 ? 1 : 0;
+}
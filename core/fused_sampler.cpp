@@ -0,0 +1,264 @@
+#include "fused_sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Same dispatch as logprobs.cpp: x86 kernels are built with target attributes and
+// chosen at runtime, MSVC only gets them with /arch:AVX2 (AVX-512 with /arch:AVX512),
+// NEON is always there on aarch64
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FUSED_X86 1
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+static bool hasAvx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+static bool hasAvx512() {
+    static const bool supported = __builtin_cpu_supports("avx512f");
+    return supported;
+}
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#include <immintrin.h>
+#define FUSED_X86 1
+#define AVX2_TARGET
+#define AVX512_TARGET
+static bool hasAvx2() { return true; }
+#ifdef __AVX512F__
+static bool hasAvx512() { return true; }
+#else
+static bool hasAvx512() { return false; }
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define FUSED_NEON 1
+#endif
+
+namespace {
+
+// Heap order puts the smallest kept logit at the front
+inline bool greaterLogit(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit;
+}
+
+inline void heapPush(llama_token_data* heap, size_t& count, size_t k, llama_token id, float logit) {
+    if (count < k) {
+        heap[count++] = {id, logit, 0.0f};
+        std::push_heap(heap, heap + count, greaterLogit);
+    } else if (logit > heap[0].logit) {
+        std::pop_heap(heap, heap + k, greaterLogit);
+        heap[k - 1] = {id, logit, 0.0f};
+        std::push_heap(heap, heap + k, greaterLogit);
+    }
+}
+
+// Logits that can't beat the current k-th best are skipped a whole vector at a time
+void heapSelectScalar(const float* logits, int begin, int end, size_t k, llama_token_data* heap, size_t& count) {
+    for (int i = begin; i < end; i++) heapPush(heap, count, k, i, logits[i]);
+}
+
+#ifdef FUSED_X86
+
+AVX2_TARGET int heapSelectAvx2(const float* logits, int n, size_t k, llama_token_data* heap, size_t& count) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int mask = 0xFF;
+        if (count == k) {
+            __m256 v = _mm256_loadu_ps(logits + i);
+            mask = _mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_set1_ps(heap[0].logit), _CMP_GT_OQ));
+        }
+        for (int j = 0; mask != 0; j++, mask >>= 1) {
+            if (mask & 1) heapPush(heap, count, k, i + j, logits[i + j]);
+        }
+    }
+    return i;
+}
+
+AVX512_TARGET int heapSelectAvx512(const float* logits, int n, size_t k, llama_token_data* heap, size_t& count) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = 0xFFFF;
+        if (count == k) {
+            __m512 v = _mm512_loadu_ps(logits + i);
+            mask = _mm512_cmp_ps_mask(v, _mm512_set1_ps(heap[0].logit), _CMP_GT_OQ);
+        }
+        for (int j = 0; mask != 0; j++, mask >>= 1) {
+            if (mask & 1) heapPush(heap, count, k, i + j, logits[i + j]);
+        }
+    }
+    return i;
+}
+
+#endif // FUSED_X86
+
+#ifdef FUSED_NEON
+
+int heapSelectNeon(const float* logits, int n, size_t k, llama_token_data* heap, size_t& count) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        if (count == k && vmaxvq_u32(vcgtq_f32(vld1q_f32(logits + i), vdupq_n_f32(heap[0].logit))) == 0) {
+            continue;
+        }
+        for (int j = 0; j < 4; j++) heapPush(heap, count, k, i + j, logits[i + j]);
+    }
+    return i;
+}
+
+#endif // FUSED_NEON
+
+// llama_sampler_top_p on sorted candidates: softmax at temperature 1, keep the smallest
+// prefix reaching p. Float math in the same order so the cut lands on the same token.
+size_t applyTopP(llama_token_data* data, size_t n, float p, size_t min_keep) {
+    if (p >= 1.0f || n == 0) return n;
+
+    const float max_l = data[0].logit;
+    float cum_sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        float prob = expf(data[i].logit - max_l);
+        data[i].p = prob;
+        cum_sum += prob;
+    }
+    for (size_t i = 0; i < n; i++) {
+        data[i].p /= cum_sum;
+    }
+
+    float cum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        cum += data[i].p;
+        if (cum >= p && i + 1 >= min_keep) return i + 1;
+    }
+    return n;
+}
+
+// llama_sampler_temp, including the greedy case
+void applyTemperature(llama_token_data* data, size_t n, float temperature) {
+    if (n == 0) return;
+    if (temperature <= 0.0f) {
+        size_t max_i = 0;
+        float max_l = data[0].logit;
+        for (size_t i = 1; i < n; i++) {
+            if (data[i].logit > max_l) {
+                data[max_i].logit = -INFINITY;
+                max_i = i;
+                max_l = data[i].logit;
+            } else {
+                data[i].logit = -INFINITY;
+            }
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        data[i].logit /= temperature;
+    }
+}
+
+// top_k <= 0 skips the top-k stage; the set is then only sorted if top-p needs it
+size_t keptBySelection(const FusedSamplerParams& params, size_t n) {
+    return params.top_k > 0 ? std::min(static_cast<size_t>(params.top_k), n) : n;
+}
+
+bool needsSort(const FusedSamplerParams& params) {
+    return params.top_k > 0 || params.top_p < 1.0f;
+}
+
+size_t finish(llama_token_data* data, size_t n, const FusedSamplerParams& params) {
+    n = applyTopP(data, n, params.top_p, params.min_keep);
+    applyTemperature(data, n, params.temperature);
+    return n;
+}
+
+struct FusedSampler {
+    FusedSamplerParams params;
+    std::vector<llama_token_data> heap;  // Grows to top_k once
+};
+
+const char* fusedName(const llama_sampler*) {
+    return "fused-top-k-top-p-temp";
+}
+
+void fusedApply(llama_sampler* smpl, llama_token_data_array* cur_p) {
+    auto* state = static_cast<FusedSampler*>(smpl->ctx);
+    const FusedSamplerParams& params = state->params;
+    size_t n = cur_p->size;
+    size_t k = keptBySelection(params, n);
+
+    if (needsSort(params) && !cur_p->sorted) {
+        if (k < n) {
+            // Single pass keeping the k best in a min-heap, written back sorted
+            state->heap.resize(k);
+            size_t count = 0;
+            for (size_t i = 0; i < n; i++) {
+                const llama_token_data& c = cur_p->data[i];
+                if (count < k) {
+                    state->heap[count++] = c;
+                    std::push_heap(state->heap.begin(), state->heap.begin() + count, greaterLogit);
+                } else if (c.logit > state->heap[0].logit) {
+                    std::pop_heap(state->heap.begin(), state->heap.end(), greaterLogit);
+                    state->heap[k - 1] = c;
+                    std::push_heap(state->heap.begin(), state->heap.end(), greaterLogit);
+                }
+            }
+            std::sort_heap(state->heap.begin(), state->heap.end(), greaterLogit);
+            std::copy(state->heap.begin(), state->heap.end(), cur_p->data);
+        } else {
+            std::sort(cur_p->data, cur_p->data + n, greaterLogit);
+        }
+        cur_p->sorted = true;
+    }
+
+    cur_p->size = finish(cur_p->data, std::min(k, n), params);
+}
+
+llama_sampler* fusedClone(const llama_sampler* smpl) {
+    return fusedSamplerInit(static_cast<const FusedSampler*>(smpl->ctx)->params);
+}
+
+void fusedFree(llama_sampler* smpl) {
+    delete static_cast<FusedSampler*>(smpl->ctx);
+}
+
+const llama_sampler_i FUSED_SAMPLER_I = {
+    /* .name   = */ fusedName,
+    /* .accept = */ nullptr,
+    /* .apply  = */ fusedApply,
+    /* .reset  = */ nullptr,
+    /* .clone  = */ fusedClone,
+    /* .free   = */ fusedFree,
+};
+
+} // namespace
+
+llama_sampler* fusedSamplerInit(const FusedSamplerParams& params) {
+    return llama_sampler_init(&FUSED_SAMPLER_I, new FusedSampler{params, {}});
+}
+
+size_t fusedSelect(const float* logits, int n_vocab, const FusedSamplerParams& params, llama_token_data* out) {
+    if (n_vocab <= 0) return 0;
+    const size_t n = static_cast<size_t>(n_vocab);
+    const size_t k = keptBySelection(params, n);
+
+    if (!needsSort(params) || k * 16 >= n) {
+        // Keeping most of the vocab - a heap doesn't pay off
+        for (llama_token i = 0; i < n_vocab; i++) {
+            out[i] = {i, logits[i], 0.0f};
+        }
+        if (needsSort(params)) {
+            std::partial_sort(out, out + k, out + n, greaterLogit);
+        }
+        return finish(out, k, params);
+    }
+
+    size_t count = 0;
+    int done = 0;
+#if defined(FUSED_X86)
+    if (hasAvx512()) done = heapSelectAvx512(logits, n_vocab, k, out, count);
+    else if (hasAvx2()) done = heapSelectAvx2(logits, n_vocab, k, out, count);
+#elif defined(FUSED_NEON)
+    done = heapSelectNeon(logits, n_vocab, k, out, count);
+#endif
+    heapSelectScalar(logits, done, n_vocab, k, out, count);
+
+    std::sort_heap(out, out + count, greaterLogit);
+    return finish(out, count, params);
+}
@@ -0,0 +1,25 @@
+#ifndef FUSED_SAMPLER_H
+#define FUSED_SAMPLER_H
+
+#include <cstddef>
+#include "llama.h"
+
+// top-k -> top-p -> temperature as a single stage. It follows llama.cpp's separate samplers
+// step for step (same surviving candidates, same order, same logits), so a dist sampler
+// after it draws the same tokens for a given seed.
+struct FusedSamplerParams {
+    int32_t top_k = 50;        // <= 0 keeps the whole vocab
+    float top_p = 0.9f;        // >= 1 disables
+    float temperature = 0.7f;  // <= 0 keeps only the most likely token
+    size_t min_keep = 1;
+};
+
+// Chain stage for any candidate array (e.g. one a grammar already masked)
+llama_sampler* fusedSamplerInit(const FusedSamplerParams& params);
+
+// The same selection straight from a logits row: a SIMD-filtered heap pass instead of
+// building and sorting a vocab-sized candidate array. out needs room for n_vocab entries.
+// Returns how many candidates survive; follow with the rest of the chain (dist).
+size_t fusedSelect(const float* logits, int n_vocab, const FusedSamplerParams& params, llama_token_data* out);
+
+#endif // FUSED_SAMPLER_H
@@ -0,0 +1,141 @@
+#include "huge_pages.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <cstdlib>
+#include <cctype>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+namespace {
+
+const size_t MIN_REGION = 16u << 20;
+
+// Serializes the allocate-and-diff windows of every instance in the process
+std::mutex window_mutex;
+
+struct Mapping {
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    std::string perms;
+    unsigned long inode = 0;
+    std::string path;
+};
+
+// "start-end perms offset dev inode   path"
+bool parseMapping(const std::string& line, Mapping& mapping) {
+    std::istringstream ss(line);
+    std::string range, offset, dev;
+    mapping.path.clear();
+    if (!(ss >> range >> mapping.perms >> offset >> dev >> mapping.inode)) return false;
+    size_t dash = range.find('-');
+    if (dash == std::string::npos) return false;
+    mapping.start = std::strtoull(range.c_str(), nullptr, 16);
+    mapping.end = std::strtoull(range.c_str() + dash + 1, nullptr, 16);
+    std::getline(ss >> std::ws, mapping.path);
+    return true;
+}
+
+std::vector<Mapping> readMappings() {
+    std::vector<Mapping> mappings;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    Mapping mapping;
+    while (std::getline(maps, line)) {
+        if (parseMapping(line, mapping)) mappings.push_back(mapping);
+    }
+    return mappings;
+}
+
+std::vector<uintptr_t> mappingStarts() {
+    std::vector<uintptr_t> starts;
+    for (const Mapping& mapping : readMappings()) starts.push_back(mapping.start);
+    std::sort(starts.begin(), starts.end());
+    return starts;
+}
+
+} // namespace
+
+void HugePageRegions::snapshot() {
+    active = true;
+    known = mappingStarts();
+    advised.clear();
+}
+
+std::unique_lock<std::mutex> HugePageRegions::window() {
+    if (!active) return {};
+    std::unique_lock<std::mutex> lock(window_mutex);
+    known = mappingStarts();  // Also forgets freed mappings, a new buffer may reuse a start
+    return lock;
+}
+
+size_t HugePageRegions::adviseNew(const std::string& file_path) {
+#ifdef __linux__
+    if (!active) return 0;
+    std::string canonical;
+    if (!file_path.empty()) {
+        std::error_code ec;
+        canonical = std::filesystem::canonical(file_path, ec).string();
+    }
+
+    size_t total = 0;
+    for (const Mapping& mapping : readMappings()) {
+        const bool is_new = !std::binary_search(known.begin(), known.end(), mapping.start);
+        const bool is_model = !canonical.empty() && mapping.path == canonical;
+        const bool is_buffer = mapping.inode == 0 && mapping.path.empty() && mapping.perms.compare(0, 2, "rw") == 0 &&
+                               mapping.end - mapping.start >= MIN_REGION;
+        if (!is_new || !(is_model || is_buffer)) continue;
+
+        known.insert(std::upper_bound(known.begin(), known.end(), mapping.start), mapping.start);
+        void* addr = reinterpret_cast<void*>(mapping.start);
+        const size_t size = mapping.end - mapping.start;
+        if (madvise(addr, size, MADV_HUGEPAGE) != 0) continue;
+        madvise(addr, size, MADV_COLLAPSE);  // Best effort - EINVAL before 6.1, EAGAIN under memory pressure
+        advised.push_back({mapping.start, mapping.end});
+        total += size;
+    }
+    return total;
+#else
+    (void)file_path;
+    return 0;
+#endif
+}
+
+HugePageCoverage HugePageRegions::coverage() const {
+    HugePageCoverage result;
+    if (advised.empty()) return result;
+
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool counting = false;
+    Mapping mapping;
+    while (std::getline(smaps, line)) {
+        // Header lines start with the address range, field lines with "Name:"
+        if (!line.empty() && std::isxdigit(static_cast<unsigned char>(line[0])) && line.find(':') > line.find('-')) {
+            if (!parseMapping(line, mapping)) continue;
+            counting = std::any_of(advised.begin(), advised.end(), [&](const std::pair<uintptr_t, uintptr_t>& region) {
+                return mapping.start >= region.first && mapping.start < region.second;
+            });
+            continue;
+        }
+        if (!counting) continue;
+        const size_t kb = std::strtoull(line.c_str() + line.find(':') + 1, nullptr, 10);
+        if (line.rfind("Rss:", 0) == 0) result.bytes += kb << 10;
+        else if (line.rfind("AnonHugePages:", 0) == 0 || line.rfind("FilePmdMapped:", 0) == 0) result.huge_bytes += kb << 10;
+    }
+    return result;
+}
+
+std::string HugePageRegions::systemMode() {
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string mode;
+    std::getline(file, mode);
+    return mode;
+}
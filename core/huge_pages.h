@@ -0,0 +1,54 @@
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Resident memory of the advised regions and how much of it huge pages back
+struct HugePageCoverage {
+    size_t bytes = 0;
+    size_t huge_bytes = 0;  // AnonHugePages + FilePmdMapped in /proc/self/smaps
+    double ratio() const { return bytes > 0 ? static_cast<double>(huge_bytes) / bytes : 0.0; }
+};
+
+// Transparent huge pages for buffers llama.cpp allocates itself (weights read without mmap,
+// KV cache, compute buffers). Their addresses aren't exposed, so mappings are found by
+// diffing /proc/self/maps against a snapshot taken before the allocations. The maps are
+// process-wide, so allocations are made inside a window() that keeps other instances from
+// allocating or diffing at the same time. Linux only, everything is a no-op elsewhere.
+//
+// Explicit (hugetlbfs) pages would need those allocations to be made with MAP_HUGETLB;
+// glibc does that for large mallocs with GLIBC_TUNABLES=glibc.malloc.hugetlb=2 set at
+// process start, provided vm.nr_hugepages has pages reserved.
+class HugePageRegions {
+public:
+    // Remembers the mappings that exist now, they're never advised
+    void snapshot();
+
+    // Takes the process-wide allocation lock and re-takes the snapshot, so mappings other
+    // instances made since the last window aren't taken for this one's. Hold it from before
+    // the allocations until adviseNew() is done. Doesn't lock anything before snapshot().
+    std::unique_lock<std::mutex> window();
+
+    // madvise(MADV_HUGEPAGE) every new anonymous read-write mapping of at least 16 MiB (more
+    // than a thread stack) and any mapping of file_path, then MADV_COLLAPSE them so pages
+    // already touched are collapsed now (Linux 6.1+; before that khugepaged gets to them
+    // over time). Returns the bytes advised by this call.
+    size_t adviseNew(const std::string& file_path = "");
+
+    HugePageCoverage coverage() const;
+
+    // Contents of /sys/kernel/mm/transparent_hugepage/enabled, e.g. "always [madvise] never".
+    // Empty if THP isn't available; "[never]" means adviseNew() can't do anything.
+    static std::string systemMode();
+
+private:
+    bool active = false;
+    std::vector<uintptr_t> known;                              // Mapping starts seen so far, sorted
+    std::vector<std::pair<uintptr_t, uintptr_t>> advised;      // [start, end)
+};
+
+#endif // HUGE_PAGES_H
@@ -0,0 +1,22 @@
+# Interface and everything it pulls in, as one object library for every target that
+# compiles Interface in (the dll, the tests and benches, chat-demo). A new source goes
+# here once instead of into each of their lists. Include after llama.cpp is added.
+add_library(iamai-core-objects OBJECT
+    ${CMAKE_CURRENT_LIST_DIR}/interface.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/autotune.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/numa.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/huge_pages.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/logprobs.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/json_schema.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/fused_sampler.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/session_engine.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/model_manager.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/folder_manager.cpp
+)
+# Also linked into the shared iamai-core library
+set_target_properties(iamai-core-objects PROPERTIES
+    POSITION_INDEPENDENT_CODE ON
+)
+target_link_libraries(iamai-core-objects PUBLIC
+    llama
+)
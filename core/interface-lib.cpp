@@ -1,5 +1,6 @@
 #include "interface.h"
 #include <cstring>
+#include <algorithm>
 
 #ifdef _WIN32
 #define EXPORT __declspec(dllexport)
@@ -12,6 +13,54 @@ struct Context {
     Interface* interface;
 };
 
+// Timings (milliseconds) and counters of the last generate call, see Interface::Stats
+struct Stats {
+    double total_ms;
+    double first_token_ms;
+    double template_ms;
+    double tokenize_ms;
+    double prefill_ms;
+    double decode_ms;
+    double draft_ms;
+    double sample_ms;
+    double detokenize_ms;
+    double shift_ms;
+    int prompt_tokens;
+    int reused_tokens;
+    int prefill_tokens;
+    int generated_tokens;
+    int decode_calls;
+    int context_shifts;
+    int kv_used;
+    int kv_size;
+};
+
+// Cold start timings (milliseconds), see Interface::LoadStats
+struct LoadStats {
+    double model_ms;
+    double warmup_ms;
+    double ready_ms;
+    double first_token_ms;
+};
+
+// Called with each generated piece (UTF-8, null terminated). Return false to stop.
+typedef bool (*StreamCallback)(const char* piece, void* user_data);
+
+// Called after each prefill chunk. Return false to cancel the prefill.
+typedef bool (*PrefillCallback)(int processed, int total, float percent, double tokens_per_sec, void* user_data);
+
+// Writes ranked candidates (best first) to outputs[i] / logprobs[i], which need room for
+// n entries; each output buffer is output_size bytes. Returns how many were written.
+static int writeCandidates(const std::vector<Interface::Candidate>& candidates, int n, char** outputs, float* logprobs, int output_size) {
+    int count = std::min(n, static_cast<int>(candidates.size()));
+    for (int i = 0; i < count; i++) {
+        strncpy(outputs[i], candidates[i].text.c_str(), output_size - 1);
+        outputs[i][output_size - 1] = '\0';
+        if (logprobs) logprobs[i] = candidates[i].logprob;
+    }
+    return count;
+}
+
 extern "C" {
 
 EXPORT Context* Init(const char* model_path) {
@@ -24,7 +73,11 @@ EXPORT Context* Init(const char* model_path) {
     }
 }
 
-EXPORT Context* FullInit(const char* model_path, int max_tokens, int batch, int size, int threads, int top_k, float top_p, float temperature, uint32_t seed) {
+// type_k / type_v: KV cache types by name ("f16", "q8_0", "q4_0", ...), NULL or "" keeps f16.
+// flash_attn: -1 = auto, 0 = off, 1 = on. A quantized V cache needs it on or auto.
+// threads <= 0 autotunes threads, ubatch and flash attention (measured once per model and CPU).
+EXPORT Context* FullInit(const char* model_path, int max_tokens, int batch, int size, int threads, int top_k, float top_p, float temperature, uint32_t seed,
+                         const char* type_k, const char* type_v, int flash_attn) {
     try {
         Context* ctx = new Context();
 
@@ -33,12 +86,18 @@ EXPORT Context* FullInit(const char* model_path, int max_tokens, int batch, int
         config.batch = batch;
         config.ctx = size;
         config.threads = threads;
+        config.autotune = threads <= 0;
 
         config.seed = seed;
         config.temperature = temperature;
         config.top_k = top_k;
         config.top_p = top_p;
 
+        if (type_k && *type_k) config.type_k = Interface::kvCacheType(type_k);
+        if (type_v && *type_v) config.type_v = Interface::kvCacheType(type_v);
+        config.flash_attn = flash_attn < 0 ? LLAMA_FLASH_ATTN_TYPE_AUTO
+                          : flash_attn == 0 ? LLAMA_FLASH_ATTN_TYPE_DISABLED : LLAMA_FLASH_ATTN_TYPE_ENABLED;
+
         ctx->interface = new Interface(model_path, config);
         return ctx;
     } catch (...) {
@@ -54,6 +113,10 @@ EXPORT void ClearPromptFormat(Context* ctx) {
     if (ctx) ctx->interface->clearPromptFormat();
 }
 
+EXPORT void SetSystemPrompt(Context* ctx, const char* prompt) {
+    if (ctx) ctx->interface->setSystemPrompt(prompt ? prompt : "");
+}
+
 EXPORT void ClearContext(Context* ctx) {
     if (ctx) ctx->interface->clearContext();
 }
@@ -68,6 +131,12 @@ EXPORT int GetContextSize(Context* ctx) {
     return 0;
 }
 
+// Estimated bytes of the main context's KV cache (see Interface::estimateKvCacheBytes)
+EXPORT uint64_t EstimateKvCacheBytes(Context* ctx) {
+    if (ctx) return ctx->interface->estimateKvCacheBytes();
+    return 0;
+}
+
 // Generate text from a prompt
 EXPORT bool Generate(Context* ctx, const char* prompt, char* output, int output_size) {
     if (!ctx || !prompt || !output || output_size <= 0) {
@@ -84,6 +153,111 @@ EXPORT bool Generate(Context* ctx, const char* prompt, char* output, int output_
     }
 }
 
+// Independent replies for n_prompts prompts, decoded together. outputs[i] receives the
+// reply to prompts[i] (each buffer output_size bytes, truncated to fit).
+EXPORT bool GenerateBatch(Context* ctx, const char** prompts, int n_prompts, char** outputs, int output_size) {
+    if (!ctx || !prompts || !outputs || n_prompts < 0 || output_size <= 0) {
+        return false;
+    }
+
+    try {
+        std::vector<std::string> inputs(prompts, prompts + n_prompts);
+        std::vector<std::string> replies = ctx->interface->generateBatch(inputs);
+        for (int i = 0; i < n_prompts; i++) {
+            strncpy(outputs[i], replies[i].c_str(), output_size - 1);
+            outputs[i][output_size - 1] = '\0';
+        }
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+EXPORT void SetParallel(Context* ctx, int sequences) {
+    if (ctx) ctx->interface->setParallel(sequences);
+}
+
+// n sampled replies to one prompt, sharing its prefill
+EXPORT int GenerateN(Context* ctx, const char* prompt, int n, char** outputs, float* logprobs, int output_size) {
+    if (!ctx || !prompt || !outputs || n <= 0 || output_size <= 0) return -1;
+    try {
+        return writeCandidates(ctx->interface->generateN(prompt, n), n, outputs, logprobs, output_size);
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Beam search with `width` beams
+EXPORT int BeamSearch(Context* ctx, const char* prompt, int width, char** outputs, float* logprobs, int output_size) {
+    if (!ctx || !prompt || !outputs || width <= 0 || output_size <= 0) return -1;
+    try {
+        return writeCandidates(ctx->interface->beamSearch(prompt, width), width, outputs, logprobs, output_size);
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Generate text from a prompt, streaming each piece to the callback as it is produced
+EXPORT bool GenerateStream(Context* ctx, const char* prompt, StreamCallback callback, void* user_data) {
+    if (!ctx || !prompt || !callback) {
+        return false;
+    }
+
+    try {
+        ctx->interface->generate(prompt, [callback, user_data](const std::string& piece) {
+            return callback(piece.c_str(), user_data);
+        });
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Token-level API - callers that already hold token ids skip the text round trip.
+// Returns the number of tokens written (-1 on error or cancelled prefill).
+EXPORT int Tokenize(Context* ctx, const char* text, bool add_bos, int32_t* tokens, int capacity) {
+    if (!ctx || !text || !tokens || capacity <= 0) return -1;
+    try {
+        std::vector<llama_token> result = ctx->interface->tokenize(text, add_bos, true);
+        if (static_cast<int>(result.size()) > capacity) return -1;
+        std::copy(result.begin(), result.end(), tokens);
+        return static_cast<int>(result.size());
+    } catch (...) {
+        return -1;
+    }
+}
+
+EXPORT bool Detokenize(Context* ctx, const int32_t* tokens, int n_tokens, char* output, int output_size) {
+    if (!ctx || !tokens || !output || output_size <= 0) return false;
+    try {
+        std::string result = ctx->interface->detokenize(tokens, n_tokens);
+        strncpy(output, result.c_str(), output_size - 1);
+        output[output_size - 1] = '\0';
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+EXPORT int GenerateTokens(Context* ctx, const int32_t* tokens, int n_tokens, int32_t* out_tokens, int out_capacity) {
+    if (!ctx || !tokens || n_tokens <= 0 || !out_tokens || out_capacity <= 0) return -1;
+    try {
+        return ctx->interface->generateTokens(tokens, n_tokens, out_tokens, out_capacity);
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Stop the generation running on another thread; it returns what it has so far
+EXPORT void Cancel(Context* ctx) {
+    if (ctx) ctx->interface->cancel();
+}
+
+// Wall-clock limit per generate call in milliseconds (0 = none)
+EXPORT void SetTimeout(Context* ctx, int milliseconds) {
+    if (ctx) ctx->interface->setTimeout(milliseconds);
+}
+
 // Configure model parameters
 EXPORT void SetMaxTokens(Context* ctx, int max_tokens) {
     if (ctx) {
@@ -91,6 +265,189 @@ EXPORT void SetMaxTokens(Context* ctx, int max_tokens) {
     }
 }
 
+EXPORT void SetPrefillChunk(Context* ctx, int tokens) {
+    if (ctx) {
+        ctx->interface->setPrefillChunk(tokens);
+    }
+}
+
+// Pass a null callback to stop reporting
+EXPORT void SetPrefillCallback(Context* ctx, PrefillCallback callback, void* user_data) {
+    if (!ctx) return;
+
+    if (!callback) {
+        ctx->interface->setProgressCallback(nullptr);
+        return;
+    }
+
+    ctx->interface->setProgressCallback([callback, user_data](const Interface::PrefillProgress& progress) {
+        return callback(progress.processed, progress.total, progress.percent, progress.tokens_per_sec, user_data);
+    });
+}
+
+// Session snapshots - relative paths land in the iamai-core cache folder
+EXPORT bool SaveSession(Context* ctx, const char* path) {
+    if (!ctx || !path) return false;
+    try {
+        return ctx->interface->saveSession(path);
+    } catch (...) {
+        return false;
+    }
+}
+
+EXPORT bool LoadSession(Context* ctx, const char* path) {
+    if (!ctx || !path) return false;
+    try {
+        return ctx->interface->loadSession(path);
+    } catch (...) {
+        return false;
+    }
+}
+
+// Speculative decoding with a smaller model of the same family
+EXPORT bool LoadDraftModel(Context* ctx, const char* model_path, int draft_tokens) {
+    if (!ctx || !model_path) return false;
+    try {
+        if (draft_tokens > 0) ctx->interface->config.draft_tokens = draft_tokens;
+        ctx->interface->loadDraftModel(model_path);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Draft-free speculation from the conversation history (ngram = 0 turns it off)
+EXPORT void SetLookupDecoding(Context* ctx, int ngram, int draft_tokens) {
+    if (!ctx) return;
+    if (draft_tokens > 0) ctx->interface->config.draft_tokens = draft_tokens;
+    ctx->interface->setLookupDecoding(ngram);
+}
+
+EXPORT void GetSpeculativeStats(Context* ctx, int* drafted, int* accepted) {
+    if (!ctx) return;
+    Interface::SpeculativeStats stats = ctx->interface->getSpeculativeStats();
+    if (drafted) *drafted = stats.drafted;
+    if (accepted) *accepted = stats.accepted;
+}
+
+// Constrained decoding - every following reply matches the grammar / schema.
+// False if it doesn't parse. Compiled grammars are cached, switching back is cheap.
+EXPORT bool SetGrammar(Context* ctx, const char* gbnf) {
+    if (!ctx || !gbnf) return false;
+    try {
+        ctx->interface->setGrammar(gbnf);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+EXPORT bool SetJsonSchema(Context* ctx, const char* schema) {
+    if (!ctx || !schema) return false;
+    try {
+        ctx->interface->setJsonSchema(schema);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+EXPORT void ClearGrammar(Context* ctx) {
+    if (ctx) ctx->interface->clearGrammar();
+}
+
+// Per-token logprobs for the following generate calls (top = alternatives per token, up to 20)
+EXPORT void SetLogprobs(Context* ctx, bool enabled, int top) {
+    if (ctx) ctx->interface->setLogprobs(enabled, top);
+}
+
+// Token, logprob and entropy of each token emitted by the last call. Any output pointer
+// may be null; pass capacity 0 to just get the count.
+EXPORT int GetLogprobs(Context* ctx, int32_t* tokens, float* logprobs, float* entropies, int capacity) {
+    if (!ctx) return -1;
+    const auto& entries = ctx->interface->getLogprobs();
+    int n = std::min(static_cast<int>(entries.size()), std::max(capacity, 0));
+    for (int i = 0; i < n; i++) {
+        if (tokens) tokens[i] = entries[i].token;
+        if (logprobs) logprobs[i] = entries[i].logprob;
+        if (entropies) entropies[i] = entries[i].entropy;
+    }
+    return capacity > 0 ? n : static_cast<int>(entries.size());
+}
+
+// Most likely alternatives for token index of the last call, best first
+EXPORT int GetTopLogprobs(Context* ctx, int index, int32_t* tokens, float* logprobs, int capacity) {
+    if (!ctx || !tokens || !logprobs) return -1;
+    const auto& entries = ctx->interface->getLogprobs();
+    if (index < 0 || index >= static_cast<int>(entries.size())) return -1;
+    const auto& entry = entries[index];
+    int n = std::min(entry.n_top, capacity);
+    std::copy(entry.top_tokens, entry.top_tokens + n, tokens);
+    std::copy(entry.top_logprobs, entry.top_logprobs + n, logprobs);
+    return n;
+}
+
+EXPORT bool GetStats(Context* ctx, Stats* out) {
+    if (!ctx || !out) return false;
+    const Interface::Stats& stats = ctx->interface->getStats();
+    out->total_ms = stats.total_ms;
+    out->first_token_ms = stats.first_token_ms;
+    out->template_ms = stats.template_ms;
+    out->tokenize_ms = stats.tokenize_ms;
+    out->prefill_ms = stats.prefill_ms;
+    out->decode_ms = stats.decode_ms;
+    out->draft_ms = stats.draft_ms;
+    out->sample_ms = stats.sample_ms;
+    out->detokenize_ms = stats.detokenize_ms;
+    out->shift_ms = stats.shift_ms;
+    out->prompt_tokens = stats.prompt_tokens;
+    out->reused_tokens = stats.reused_tokens;
+    out->prefill_tokens = stats.prefill_tokens;
+    out->generated_tokens = stats.generated_tokens;
+    out->decode_calls = stats.decode_calls;
+    out->context_shifts = stats.context_shifts;
+    out->kv_used = stats.kv_used;
+    out->kv_size = stats.kv_size;
+    return true;
+}
+
+EXPORT bool GetLoadStats(Context* ctx, LoadStats* out) {
+    if (!ctx || !out) return false;
+    const Interface::LoadStats& stats = ctx->interface->getLoadStats();
+    out->model_ms = stats.model_ms;
+    out->warmup_ms = stats.warmup_ms;
+    out->ready_ms = stats.ready_ms;
+    out->first_token_ms = stats.first_token_ms;
+    return true;
+}
+
+// Starts reading the model file into the page cache in the background, call before Init
+EXPORT void PrefetchModel(const char* model_path) {
+    if (!model_path) return;
+    try {
+        Interface::prefetchModel(model_path);
+    } catch (...) {
+    }
+}
+
+EXPORT int GetEmbeddingSize(Context* ctx) {
+    if (!ctx) return -1;
+    return ctx->interface->getEmbeddingSize();
+}
+
+// Embeds n_texts texts into out, n_texts * GetEmbeddingSize() floats, one row per text.
+// pooling: 0 = mean, 1 = first token (CLS), 2 = last token. False on error.
+EXPORT bool Embed(Context* ctx, const char** texts, int n_texts, float* out, int pooling, bool normalize) {
+    if (!ctx || !texts || !out || n_texts < 0 || pooling < 0 || pooling > 2) return false;
+    try {
+        std::vector<std::string> inputs(texts, texts + n_texts);
+        ctx->interface->embed(inputs, out, static_cast<Interface::Pooling>(pooling), normalize);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
 // Cleanup
 EXPORT void Free(Context* ctx) {
     if (ctx) {
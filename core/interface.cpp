@@ -1,8 +1,34 @@
 #include "interface.h"
+#include "folder_manager.h"
+#include "logprobs.h"
+#include "json_schema.h"
+#include "autotune.h"
+#include "numa.h"
 #include "ggml-backend.h"
+#include "ggml-cpu.h"
 #include <iostream>
+#include <fstream>
 #include <thread>
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <filesystem>
+#include <stdexcept>
+#include <mutex>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #ifdef _WIN32
 #define EXPORT __declspec(dllexport)
@@ -10,6 +36,135 @@
 #define EXPORT
 #endif
 
+namespace {
+
+// Session snapshot layout: header, token history, then the raw llama_state_seq blob
+const uint32_t SESSION_MAGIC = 0x534D4149;  // "IAMS"
+const uint32_t SESSION_VERSION = 2;
+
+struct SessionHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t n_past;
+    int32_t n_pinned;
+    uint32_t n_tokens;
+    int32_t top_k;
+    float top_p;
+    float temperature;
+    uint32_t seed;
+    uint64_t state_size;
+};
+
+// Read-only memory map so the KV blob goes straight from the page cache into the context
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) return;
+        data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data) size = static_cast<size_t>(file_size.QuadPart);
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) return;
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const uint8_t*>(addr);
+        size = static_cast<size_t>(st.st_size);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data) munmap(const_cast<uint8_t*>(data), size);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+uint64_t hashTokens(const llama_token* tokens, int n) {
+    uint64_t hash = 1469598103934665603ULL;  // FNV-1a over the token ids
+    for (int i = 0; i < n; i++) {
+        hash ^= static_cast<uint32_t>(tokens[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Adds the time until the end of the scope to a Stats field
+class PhaseTimer {
+public:
+    explicit PhaseTimer(double& total_ms) : total_ms(total_ms), start(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        total_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    double& total_ms;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Training contexts of recent models (128k for Llama 3.2) would allocate gigabytes of KV
+// cache up front; the single-argument constructor stops here, Config::ctx can go further
+const int DEFAULT_CTX_LIMIT = 8192;
+
+// Cache types llama.cpp has kernels for
+const ggml_type KV_CACHE_TYPES[] = {
+    GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0,
+    GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_IQ4_NL,
+};
+
+bool isQuantized(ggml_type type) {
+    return type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && type != GGML_TYPE_BF16;
+}
+
+// "<arch>.attention.key_length" and friends, falling back to n_embd / n_head
+int headSize(const llama_model* model, const char* key) {
+    char arch[64];
+    char value[32];
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) > 0 &&
+        llama_model_meta_val_str(model, (std::string(arch) + ".attention." + key).c_str(), value, sizeof(value)) > 0) {
+        return std::atoi(value);
+    }
+    return llama_model_n_embd(model) / std::max(1, llama_model_n_head(model));
+}
+
+uint64_t hashText(const std::string& text) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+} // namespace
+
 extern "C" {
     // C-style factory functions
     EXPORT Interface* create_interface(const char* model_path) {
@@ -37,33 +192,117 @@ extern "C" {
 }
 
 Interface::Interface(const std::string& modelPath) {
+    PhaseTimer ready_timer(load_stats.ready_ms);
+
     // Load model first to auto-detect optimal settings
-    loadModel(modelPath);
+    {
+        PhaseTimer model_timer(load_stats.model_ms);
+        loadModel(modelPath);
+    }
 
     // Get the model's training context size and set optimal defaults
     int n_ctx_train = llama_model_n_ctx_train(model);
-    config.ctx = n_ctx_train;
-    config.batch = n_ctx_train;  // Set batch to match context for maximum efficiency
+    config.ctx = std::min(n_ctx_train, DEFAULT_CTX_LIMIT);
+    config.batch = config.ctx;  // Set batch to match context for maximum efficiency
     setThreadDefaults();
 
     initializeContext();
 }
 
 Interface::Interface(const std::string& modelPath, Config config) {
+    PhaseTimer ready_timer(load_stats.ready_ms);
     this->config = config;
-    loadModel(modelPath);
+    if (this->config.numa_node >= 0) {
+        if (this->config.numa != GGML_NUMA_STRATEGY_DISABLED) {
+            throw std::runtime_error("numa_node and a process-wide NUMA strategy can't be combined");
+        }
+        if (numaNodeCpus(this->config.numa_node).empty()) {
+            throw std::runtime_error("NUMA node " + std::to_string(this->config.numa_node) + " has no usable CPUs");
+        }
+    } else if (this->config.numa != GGML_NUMA_STRATEGY_DISABLED) {
+        initNumaStrategy(this->config.numa);
+    }
+    if (this->config.huge_pages) {
+        huge_pages.snapshot();
+    }
+    {
+        std::unique_lock<std::mutex> window = huge_pages.window();
+        {
+            PhaseTimer model_timer(load_stats.model_ms);
+            loadModel(modelPath);
+        }
+        huge_pages.adviseNew(modelPath);  // Weight buffers, or the file mapping
+    }
+    if (this->config.autotune) {
+        applyAutotune(modelPath);
+    }
     initializeContext();
+
+    if (!this->config.draft_model.empty()) {
+        loadDraftModel(this->config.draft_model);
+    }
 }
 
-void Interface::loadModel(const std::string& modelPath) {
-    ggml_backend_load_all();
+void Interface::loadBackends() {
+    static std::once_flag loaded;
+    std::call_once(loaded, ggml_backend_load_all);
+}
+
+llama_model* Interface::loadModelFile(const std::string& modelPath, const Config& config) {
+    loadBackends();
     // llama_backend_init();
 
     auto model_params = llama_model_default_params();
     // model_params.n_gpu_layers = 999;
     // model_params.split_mode = LLAMA_SPLIT_MODE_NONE;
+    model_params.use_mmap = config.use_mmap;
+    model_params.use_mlock = config.use_mlock;
+
+    if (config.numa_node >= 0) {
+        // Pages are placed where they're first touched: read the weights into buffers from
+        // a thread on the node. mmap'd pages would be shared, wherever they were faulted in.
+        model_params.use_mmap = false;
+        NodeAffinity pin(config.numa_node);
+        return llama_model_load_from_file(modelPath.c_str(), model_params);
+    }
+    return llama_model_load_from_file(modelPath.c_str(), model_params);
+}
+
+void Interface::prefetchModel(const std::string& modelPath) {
+    std::error_code ec;
+    const uintmax_t size = std::filesystem::file_size(modelPath, ec);
+    if (ec || size == 0) return;
+
+    // A file that doesn't fit would evict its own beginning before the load gets to it
+#ifdef _WIN32
+    MEMORYSTATUSEX memory_status = {};
+    memory_status.dwLength = sizeof(memory_status);
+    if (GlobalMemoryStatusEx(&memory_status) && size > memory_status.ullAvailPhys) return;
+#else
+    const long pages = sysconf(_SC_AVPHYS_PAGES);
+    const long page_size = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && page_size > 0 && size > static_cast<uintmax_t>(pages) * page_size) return;
+#endif
+
+    std::thread([modelPath]() {
+#ifdef __linux__
+        // Kernel readahead starts on the whole file right away...
+        int fd = open(modelPath.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+#endif
+        // ...and reading it through makes sure every page is in by the time it's mapped
+        std::ifstream file(modelPath, std::ios::binary);
+        std::vector<char> buffer(8 << 20);
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        }
+    }).detach();
+}
 
-    model = llama_model_load_from_file(modelPath.c_str(), model_params);
+void Interface::loadModel(const std::string& modelPath) {
+    model = loadModelFile(modelPath, config);
     if (model == NULL) {
         throw std::runtime_error("Failed to load model");
     }
@@ -77,51 +316,176 @@ void Interface::loadModel(const std::string& modelPath) {
 
     // Extract role marker from template and tokenize it
     if (hasTemplate) {
-        std::string stop_string;
-
-        // Find the pattern for starting a new role
-        if (chatTemplate.find("<|start_header_id|>") != std::string::npos) {
-            stop_string = "<|start_header_id|>";
-        } else if (chatTemplate.find("<|im_start|>") != std::string::npos) {
-            stop_string = "<|im_start|>";
-        } else if (chatTemplate.find("<start_of_turn>") != std::string::npos) {
-            stop_string = "<start_of_turn>";
-        } else if (chatTemplate.find("<|user|>") != std::string::npos) {
-            stop_string = "<|user|>";
-        } else if (chatTemplate.find("<|assistant|>") != std::string::npos) {
-            stop_string = "<|user|>";
-        } else if (chatTemplate.find("<｜User｜>") != std::string::npos) {
-            stop_string = "<｜User｜>";
-        }
-
-        // Tokenize the stop string to get its token ID
-        if (!stop_string.empty()) {
-            auto stop_tokens = tokenize(stop_string, false, true);  // parse_special=true
-            if (!stop_tokens.empty()) {
-                stop_token = stop_tokens[0];  // Usually a single token
-            }
-        }
+        stop_token = roleMarkerToken(vocab, chatTemplate);
+    }
+}
+
+llama_token Interface::roleMarkerToken(const llama_vocab* vocab, const std::string& chatTemplate) {
+    // Find the pattern for starting a new role
+    std::string stop_string;
+    if (chatTemplate.find("<|start_header_id|>") != std::string::npos) {
+        stop_string = "<|start_header_id|>";
+    } else if (chatTemplate.find("<|im_start|>") != std::string::npos) {
+        stop_string = "<|im_start|>";
+    } else if (chatTemplate.find("<start_of_turn>") != std::string::npos) {
+        stop_string = "<start_of_turn>";
+    } else if (chatTemplate.find("<|user|>") != std::string::npos) {
+        stop_string = "<|user|>";
+    } else if (chatTemplate.find("<|assistant|>") != std::string::npos) {
+        stop_string = "<|user|>";
+    } else if (chatTemplate.find("<｜User｜>") != std::string::npos) {
+        stop_string = "<｜User｜>";
     }
+    if (stop_string.empty()) {
+        return LLAMA_TOKEN_NULL;
+    }
+
+    // Usually a single token (parse_special=true)
+    llama_token tokens[8];
+    int n_tokens = llama_tokenize(vocab, stop_string.c_str(), stop_string.length(), tokens, 8, false, true);
+    return n_tokens > 0 ? tokens[0] : LLAMA_TOKEN_NULL;
 }
 
 void Interface::setThreadDefaults() {
-    unsigned int maxThreads = std::thread::hardware_concurrency();
-    if (maxThreads > 0) config.threads = maxThreads;
+    // SMT siblings and E-cores slow decoding down rather than up
+    config.threads = performanceCores();
+}
+
+void Interface::applyAutotune(const std::string& modelPath) {
+    const bool fixed_flash_attn = config.flash_attn != LLAMA_FLASH_ATTN_TYPE_AUTO || isQuantized(config.type_v);
+    TuneParams params;
+    params.batch = config.batch;
+    params.type_k = config.type_k;
+    params.type_v = config.type_v;
+    params.flash_attn = isQuantized(config.type_v) ? LLAMA_FLASH_ATTN_TYPE_ENABLED : config.flash_attn;
+    params.numa_node = config.numa_node;
+
+    try {
+        TuneResult tuned = loadOrAutotune(model, modelPath, params);
+        config.threads = tuned.threads;
+        config.threads_batch = tuned.threads_batch;
+        config.ubatch = tuned.ubatch;
+        if (!fixed_flash_attn) {
+            config.flash_attn = tuned.flash_attn ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        }
+        std::cout << "Autotune: " << config.threads << " decode threads, " << config.threads_batch
+                  << " prefill threads, ubatch " << config.ubatch << ", flash attention "
+                  << (config.flash_attn == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "on" : "off") << std::endl;
+    } catch (const std::exception& e) {
+        // Optional - the configured settings still work
+        std::cerr << "Autotune skipped: " << e.what() << std::endl;
+        if (config.threads <= 0) setThreadDefaults();
+    }
+}
+
+ggml_type Interface::kvCacheType(const std::string& name) {
+    for (ggml_type type : KV_CACHE_TYPES) {
+        if (name == ggml_type_name(type)) return type;
+    }
+    throw std::runtime_error("Unsupported KV cache type: " + name);
+}
+
+void Interface::applyCacheParams(llama_context_params& params) {
+    const int head_k = headSize(model, "key_length");
+    const int head_v = headSize(model, "value_length");
+    for (ggml_type type : {config.type_k, config.type_v}) {
+        if (std::find(std::begin(KV_CACHE_TYPES), std::end(KV_CACHE_TYPES), type) == std::end(KV_CACHE_TYPES)) {
+            throw std::runtime_error(std::string("Unsupported KV cache type: ") + ggml_type_name(type));
+        }
+    }
+    // Each head's row has to be made of whole quantization blocks
+    if (head_k % ggml_blck_size(config.type_k) != 0 || head_v % ggml_blck_size(config.type_v) != 0) {
+        throw std::runtime_error("KV cache type doesn't divide the model's head size");
+    }
+    if (isQuantized(config.type_v)) {
+        if (config.flash_attn == LLAMA_FLASH_ATTN_TYPE_DISABLED) {
+            throw std::runtime_error("A quantized V cache needs flash attention");
+        }
+        config.flash_attn = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+
+    params.type_k = config.type_k;
+    params.type_v = config.type_v;
+    params.flash_attn_type = config.flash_attn;
+}
+
+void Interface::attachThreadpools(llama_context* context) {
+    if (config.numa_node < 0) return;
+
+    if (threadpool == NULL) {
+        auto makePool = [&](int n_threads) {
+            ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+            for (int cpu : numaNodeCpus(config.numa_node)) {
+                if (cpu < GGML_MAX_N_THREADS) params.cpumask[cpu] = true;
+            }
+            params.strict_cpu = false;  // Any CPU of the node, the scheduler balances within it
+            ggml_threadpool* pool = ggml_threadpool_new(&params);
+            if (pool == NULL) {
+                throw std::runtime_error("Failed to create threadpool for NUMA node " + std::to_string(config.numa_node));
+            }
+            return pool;
+        };
+        threadpool = makePool(config.threads);
+        // Prefill gets its own pool only when it runs a different thread count
+        threadpool_batch = prefillThreads() != config.threads ? makePool(prefillThreads()) : nullptr;
+    }
+    llama_attach_threadpool(context, threadpool, threadpool_batch != NULL ? threadpool_batch : threadpool);
+}
+
+void Interface::warmupContext() {
+    // BOS + EOS like llama.cpp's tools. Warm-up mode runs every expert of an MoE model, so
+    // all weights are touched, not just the ones these two tokens route to.
+    std::vector<llama_token> tokens;
+    if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) tokens.push_back(llama_vocab_bos(vocab));
+    if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) tokens.push_back(llama_vocab_eos(vocab));
+    if (tokens.empty()) tokens.push_back(0);
+
+    llama_set_warmup(ctx, true);
+    llama_decode(ctx, llama_batch_get_one(tokens.data(), static_cast<int32_t>(tokens.size())));
+    llama_set_warmup(ctx, false);
+    llama_synchronize(ctx);
+    llama_memory_clear(memory, true);
+    llama_perf_context_reset(ctx);
 }
 
 void Interface::initializeContext() {
     auto ctx_params = llama_context_default_params();
     ctx_params.n_ctx = config.ctx;
     ctx_params.n_batch = config.batch;
-    ctx_params.n_ubatch = 2048;
+    ctx_params.n_ubatch = ubatchSize();
     ctx_params.n_threads = config.threads;
-    ctx_params.n_threads_batch = config.threads;
+    ctx_params.n_threads_batch = prefillThreads();
+    try {
+        applyCacheParams(ctx_params);
+    } catch (...) {
+        llama_model_free(model);
+        model = nullptr;
+        throw;
+    }
 
+    // Pages land on the node of the thread that first touches them. llama.cpp zeroes the KV
+    // cache while creating the context and the warm-up below fills the compute buffers, so
+    // both run pinned to the replica's node. No-op without a numa_node.
+    std::unique_lock<std::mutex> window = huge_pages.window();
+    NodeAffinity pin(config.numa_node);
     ctx = llama_init_from_model(model, ctx_params);
     if (ctx == NULL) {
         llama_model_free(model);
         throw std::runtime_error("Failed to create context");
     }
+    attachThreadpools(ctx);
+    huge_pages.adviseNew();  // KV cache and compute buffers, before the warm-up touches them
+    if (window) window.unlock();
+
+    // Roughly what the cache costs at this size. llama.cpp doesn't expose its buffer sizes,
+    // so this assumes every layer is full attention (SWA layers use less, recurrent state
+    // isn't counted) and ignores padding.
+    const size_t n_embd_k = static_cast<size_t>(headSize(model, "key_length")) * llama_model_n_head_kv(model);
+    const size_t n_embd_v = static_cast<size_t>(headSize(model, "value_length")) * llama_model_n_head_kv(model);
+    kv_estimate = static_cast<size_t>(llama_n_ctx(ctx)) * llama_model_n_layer(model) *
+               (ggml_row_size(config.type_k, n_embd_k) + ggml_row_size(config.type_v, n_embd_v));
+    std::cout << "KV cache: " << llama_n_ctx(ctx) << " cells, ~" << kv_estimate / (1024.0 * 1024.0) << " MiB (K "
+              << ggml_type_name(config.type_k) << ", V " << ggml_type_name(config.type_v) << ")" << std::endl;
 
     // Get memory handle for KV cache management
     memory = llama_get_memory(ctx);
@@ -129,36 +493,205 @@ void Interface::initializeContext() {
         throw std::runtime_error("Failed to get memory handle");
     }
 
+    // Lets cancel() and timeouts interrupt a long llama_decode
+    llama_set_abort_callback(ctx, abortCallback, this);
+
+    if (config.warmup) {
+        PhaseTimer timer(load_stats.warmup_ms);
+        warmupContext();
+    }
+    if (config.huge_pages) {
+        HugePageCoverage coverage = huge_pages.coverage();
+        std::cout << "Huge pages: " << (coverage.huge_bytes >> 20) << " of " << (coverage.bytes >> 20)
+                  << " MiB resident (" << static_cast<int>(coverage.ratio() * 100.0) << "%, THP "
+                  << HugePageRegions::systemMode() << ")" << std::endl;
+    }
+
     // Initialize sampler chain
-    auto sparams = llama_sampler_chain_default_params();
-    sampler = llama_sampler_chain_init(sparams);
+    sampler = createSampler(config.seed);
+    if (!config.json_schema.empty()) {
+        setJsonSchema(config.json_schema);
+    } else if (!config.grammar.empty()) {
+        setGrammar(config.grammar);
+    }
 
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(config.top_k));
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(config.top_p, 1));
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(config.temperature));
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(config.seed));
+    // Everything the decode loop touches is sized once here, so steady-state generation
+    // doesn't hit the allocator
+    batch = llama_batch_init(config.batch, 0, 1);
+    candidates.resize(llama_vocab_n_tokens(vocab));
+    draft.reserve(config.batch);
 
     // Initialize context state
     n_past = 0;
     token_history.clear();
+    token_history.reserve(config.ctx);
+}
+
+llama_sampler* Interface::createSampler(uint32_t seed) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler* chain = llama_sampler_chain_init(sparams);
+
+    fused_chain = config.fused_sampler;
+    if (fused_chain) {
+        fused_params.top_k = config.top_k;
+        fused_params.top_p = config.top_p;
+        fused_params.temperature = config.temperature;
+        llama_sampler_chain_add(chain, fusedSamplerInit(fused_params));
+    } else {
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(config.top_k));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(config.top_p, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(config.temperature));
+    }
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+
+    return chain;
+}
+
+llama_sampler* Interface::compileGrammar(const std::string& source, bool is_schema) {
+    uint64_t key = hashText((is_schema ? "schema\n" : "gbnf\n") + source);
+    auto it = grammar_cache.find(key);
+    if (it != grammar_cache.end()) {
+        return it->second;
+    }
+
+    std::string gbnf = is_schema ? jsonSchemaToGrammar(source) : source;
+    llama_sampler* compiled = llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+    if (compiled == NULL) {
+        throw std::runtime_error(is_schema ? "Failed to compile grammar for JSON schema" : "Failed to parse grammar");
+    }
+    grammar_cache[key] = compiled;
+    return compiled;
+}
+
+void Interface::setGrammar(const std::string& gbnf) {
+    grammar = compileGrammar(gbnf, false);
+    config.grammar = gbnf;
+    config.json_schema.clear();
+}
+
+void Interface::setJsonSchema(const std::string& schema) {
+    grammar = compileGrammar(schema, true);
+    config.json_schema = schema;
+    config.grammar.clear();
+}
+
+void Interface::clearGrammar() {
+    grammar = nullptr;
+    config.grammar.clear();
+    config.json_schema.clear();
+}
+
+void Interface::loadDraftModel(const std::string& modelPath) {
+    std::unique_lock<std::mutex> window = huge_pages.window();  // Weights through context
+    llama_model* new_model = loadModelFile(modelPath, config);
+    if (new_model == NULL) {
+        throw std::runtime_error("Failed to load draft model");
+    }
+
+    // Draft tokens are fed to the main model as-is, so the vocabularies must line up. Sizes
+    // may differ a little (added tokens at the end); ids past the smaller one are never
+    // exchanged, see draftTokens().
+    const llama_vocab* new_vocab = llama_model_get_vocab(new_model);
+    int n_vocab = llama_vocab_n_tokens(vocab);
+    int n_vocab_draft = llama_vocab_n_tokens(new_vocab);
+    if (std::abs(n_vocab - n_vocab_draft) > 128 ||
+        llama_vocab_bos(vocab) != llama_vocab_bos(new_vocab) ||
+        llama_vocab_eos(vocab) != llama_vocab_eos(new_vocab)) {
+        llama_model_free(new_model);
+        throw std::runtime_error("Draft model vocabulary doesn't match the main model");
+    }
+
+    auto ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = config.ctx;
+    ctx_params.n_batch = config.batch;
+    ctx_params.n_ubatch = std::min(config.batch, 512);
+    ctx_params.n_threads = config.threads;
+    ctx_params.n_threads_batch = prefillThreads();
+
+    NodeAffinity pin(config.numa_node);  // Cache zeroed on the draft model's node, see initializeContext()
+    llama_context* new_ctx = llama_init_from_model(new_model, ctx_params);
+    if (new_ctx == NULL) {
+        llama_model_free(new_model);
+        throw std::runtime_error("Failed to create draft context");
+    }
+
+    // Replace any previous draft model
+    if (draft_sampler != NULL) llama_sampler_free(draft_sampler);
+    if (draft_ctx != NULL) llama_free(draft_ctx);
+    if (draft_model != NULL) llama_model_free(draft_model);
+
+    draft_model = new_model;
+    draft_ctx = new_ctx;
+    attachThreadpools(draft_ctx);
+    huge_pages.adviseNew(modelPath);
+    draft_memory = llama_get_memory(draft_ctx);
+    draft_sampler = llama_sampler_init_greedy();
+    draft_n_past = 0;
+    draft_vocab = std::min(n_vocab, n_vocab_draft);
+    draft_pending.reserve(config.ctx + 1);
+    candidates.resize(std::max(n_vocab, n_vocab_draft));
+    config.draft_model = modelPath;
+    resetSpeculativeStats();
+
+    std::cout << "Loaded draft model: " << modelPath << std::endl;
 }
 
 Interface::~Interface() {
     if (ctx != NULL) {
         llama_synchronize(ctx);  // Wait for all GPU operations to complete
     }
+    if (draft_sampler != NULL) {
+        llama_sampler_free(draft_sampler);
+    }
+    if (draft_ctx != NULL) {
+        llama_free(draft_ctx);
+    }
+    if (draft_model != NULL) {
+        llama_model_free(draft_model);
+    }
+    llama_batch_free(batch);
+    freeParallel();
+    llama_batch_free(embed_batch);
+    if (embed_ctx != NULL) {
+        llama_free(embed_ctx);
+    }
+    for (auto& entry : grammar_cache) {
+        llama_sampler_free(entry.second);
+    }
     if (sampler != NULL) {
         llama_sampler_free(sampler);
     }
     if (ctx != NULL) {
         llama_free(ctx);
     }
+    // After every context that could use them
+    if (threadpool_batch != NULL) {
+        ggml_threadpool_free(threadpool_batch);
+    }
+    if (threadpool != NULL) {
+        ggml_threadpool_free(threadpool);
+    }
     if (model != NULL) {
         llama_model_free(model);
     }
     llama_backend_free();
 }
 
+std::string Interface::detokenize(const llama_token* tokens, int n_tokens) {
+    std::string text;
+    text.resize(std::max(n_tokens * 8, 64));
+    int n_chars = llama_detokenize(vocab, tokens, n_tokens, &text[0], static_cast<int>(text.size()), false, true);
+    if (n_chars < 0) {
+        text.resize(-n_chars);
+        n_chars = llama_detokenize(vocab, tokens, n_tokens, &text[0], static_cast<int>(text.size()), false, true);
+    }
+    if (n_chars < 0) {
+        throw std::runtime_error("Failed to convert tokens to text");
+    }
+    text.resize(n_chars);
+    return text;
+}
+
 std::vector<llama_token> Interface::tokenize(const std::string& text, bool add_bos, bool parse_special) {
     int n_tokens = -llama_tokenize(vocab, text.c_str(), text.length(), NULL, 0, add_bos, parse_special);
     std::vector<llama_token> tokens(n_tokens);
@@ -170,12 +703,148 @@ std::vector<llama_token> Interface::tokenize(const std::string& text, bool add_b
     return tokens;
 }
 
+void Interface::initEmbeddings(Pooling pooling) {
+    if (embed_ctx != NULL && embed_pooling == pooling) return;
+
+    auto ctx_params = llama_context_default_params();
+    // Each decode holds at most one batch and the cache is cleared in between
+    ctx_params.n_ctx = config.batch;
+    ctx_params.n_batch = config.batch;
+    ctx_params.n_ubatch = config.batch;  // Pooling needs a whole sequence in one ubatch
+    ctx_params.n_seq_max = EMBED_MAX_SEQS;
+    ctx_params.kv_unified = true;        // Sequences share the cells instead of n_ctx / n_seq_max each
+    ctx_params.n_threads = config.threads;
+    ctx_params.n_threads_batch = prefillThreads();
+    ctx_params.embeddings = true;
+    ctx_params.pooling_type = pooling == Pooling::Cls ? LLAMA_POOLING_TYPE_CLS
+                            : pooling == Pooling::Last ? LLAMA_POOLING_TYPE_LAST
+                            : LLAMA_POOLING_TYPE_MEAN;
+
+    std::unique_lock<std::mutex> window = huge_pages.window();
+    NodeAffinity pin(config.numa_node);  // See initializeContext()
+    llama_context* new_ctx = llama_init_from_model(model, ctx_params);
+    if (new_ctx == NULL) {
+        throw std::runtime_error("Failed to create embeddings context");
+    }
+    if (embed_ctx != NULL) {
+        llama_free(embed_ctx);
+    }
+    embed_ctx = new_ctx;
+    embed_pooling = pooling;
+    attachThreadpools(embed_ctx);
+    huge_pages.adviseNew();
+    if (embed_batch.token == nullptr) {
+        embed_batch = llama_batch_init(config.batch, 0, 1);
+    }
+}
+
+void Interface::embed(const std::vector<std::string>& texts, float* out, Pooling pooling, bool normalize) {
+    if (texts.empty()) return;
+    initEmbeddings(pooling);
+
+    const int n_embd = getEmbeddingSize();
+    const bool encoder_only = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+    llama_memory_t embed_memory = llama_get_memory(embed_ctx);  // NULL for encoder-only models
+    size_t first = 0;  // Text in sequence 0 of the pending batch
+    int n_seqs = 0;
+
+    auto flush = [&]() {
+        if (n_seqs == 0) return;
+        if (embed_memory != NULL) {
+            llama_memory_clear(embed_memory, true);
+        }
+        int result = encoder_only ? llama_encode(embed_ctx, embed_batch) : llama_decode(embed_ctx, embed_batch);
+        if (result != 0) {
+            throw std::runtime_error("Failed to compute embeddings");
+        }
+        for (int s = 0; s < n_seqs; s++) {
+            const float* pooled = llama_get_embeddings_seq(embed_ctx, s);
+            if (pooled == NULL) {
+                throw std::runtime_error("Failed to get pooled embeddings");
+            }
+            float* row = out + (first + s) * n_embd;
+            float scale = 1.0f;
+            if (normalize) {
+                double sum = 0.0;
+                for (int i = 0; i < n_embd; i++) sum += static_cast<double>(pooled[i]) * pooled[i];
+                if (sum > 0.0) scale = static_cast<float>(1.0 / std::sqrt(sum));
+            }
+            for (int i = 0; i < n_embd; i++) row[i] = pooled[i] * scale;
+        }
+        first += n_seqs;
+        n_seqs = 0;
+        embed_batch.n_tokens = 0;
+    };
+
+    embed_batch.n_tokens = 0;
+    for (const std::string& text : texts) {
+        std::vector<llama_token> tokens = tokenize(text, true, false);
+        const int n_tokens = static_cast<int>(tokens.size());
+        if (n_tokens == 0) {
+            throw std::runtime_error("Cannot embed an empty text");
+        }
+        if (n_tokens > config.batch) {
+            throw std::runtime_error("Text is longer than the batch size");
+        }
+        if (embed_batch.n_tokens + n_tokens > config.batch || n_seqs == EMBED_MAX_SEQS) {
+            flush();
+        }
+        for (int i = 0; i < n_tokens; i++) {
+            int row = embed_batch.n_tokens++;
+            embed_batch.token[row] = tokens[i];
+            embed_batch.pos[row] = i;
+            embed_batch.n_seq_id[row] = 1;
+            embed_batch.seq_id[row][0] = n_seqs;
+            embed_batch.logits[row] = true;
+        }
+        n_seqs++;
+    }
+    flush();
+}
+
+int Interface::reuseCachedPrefix(const llama_token* tokens, int n_tokens) {
+    int cached = static_cast<int>(token_history.size());
+    if (cached <= n_past) {
+        return 0;  // Nothing stale in the cache, we're just continuing the conversation
+    }
+
+    // Count how far the cache beyond n_past already matches the new tokens
+    int reused = 0;
+    int limit = std::min(cached - n_past, n_tokens);
+    while (reused < limit && token_history[n_past + reused] == tokens[reused]) {
+        reused++;
+    }
+
+    // Always evaluate at least one token so there are fresh logits to sample from
+    if (reused > 0 && reused == n_tokens) {
+        reused--;
+    }
+
+    // Drop everything after the divergence point
+    int keep = n_past + reused;
+    if (!llama_memory_seq_rm(memory, MAIN_SEQ, keep, -1)) {
+        // Some memory types (recurrent) can't drop a partial tail, start over instead
+        llama_memory_seq_rm(memory, MAIN_SEQ, n_past, -1);
+        reused = 0;
+        keep = n_past;
+    }
+    token_history.resize(keep);
+    syncDraft(keep);
+
+    if (reused > 0) {
+        std::cout << "Reusing " << reused << " cached prompt tokens" << std::endl;
+        n_past = keep;
+    }
+
+    return reused;
+}
+
 bool Interface::canFitTokens(int num_tokens) {
     return (n_past + num_tokens) <= config.ctx;
 }
 
-void Interface::manageContext(const std::vector<llama_token>& new_tokens) {
-    int tokens_needed = new_tokens.size() + config.max_tokens; // Reserve space for generation
+void Interface::manageContext(int n_new_tokens) {
+    int tokens_needed = n_new_tokens + config.max_tokens; // Reserve space for generation
 
     if (!canFitTokens(tokens_needed)) {
         // Calculate how many tokens to remove
@@ -197,134 +866,627 @@ void Interface::manageContext(const std::vector<llama_token>& new_tokens) {
 }
 
 void Interface::shiftContext(int tokens_to_remove) {
-    if (tokens_to_remove <= 0 || tokens_to_remove >= n_past) {
+    PhaseTimer timer(stats.shift_ms);
+    // Sink tokens and the system prompt stay at the front, everything after them can go
+    int n_keep = std::min(std::max(config.n_sink, n_pinned), n_past);
+    if (tokens_to_remove <= 0 || n_keep + tokens_to_remove >= n_past) {
         return;
     }
+    stats.context_shifts++;
+
+    // Round up to the next turn boundary so no turn is left half-evicted. If the current
+    // turn alone is that long, cut inside it instead.
+    int end = n_keep + tokens_to_remove;
+    for (int start : turn_starts) {
+        if (start >= end) {
+            if (start < n_past) end = start;
+            break;
+        }
+    }
+    int n_discard = end - n_keep;
+
+    std::cout << "Shifting context: removing " << n_discard << " tokens after the first "
+              << n_keep << " of " << n_past << " total" << std::endl;
+
+    if (llama_memory_can_shift(memory)) {
+        // Drop the span and slide the rest back so positions stay contiguous - no re-prefill
+        llama_memory_seq_rm(memory, MAIN_SEQ, n_keep, end);
+        llama_memory_seq_add(memory, MAIN_SEQ, end, n_past, -n_discard);
+
+        if (draft_ctx != NULL && draft_n_past > n_keep) {
+            if (draft_n_past > end && llama_memory_can_shift(draft_memory)) {
+                llama_memory_seq_rm(draft_memory, MAIN_SEQ, n_keep, end);
+                llama_memory_seq_add(draft_memory, MAIN_SEQ, end, draft_n_past, -n_discard);
+                draft_n_past -= n_discard;
+            } else {
+                llama_memory_seq_rm(draft_memory, MAIN_SEQ, n_keep, -1);
+                draft_n_past = n_keep;
+            }
+        }
 
-    std::cout << "Shifting context: removing " << tokens_to_remove
-              << " tokens from " << n_past << " total" << std::endl;
+        token_history.erase(token_history.begin() + n_keep, token_history.begin() + end);
+        n_past -= n_discard;
+    } else {
+        // Memory types without position shifting: re-evaluate what follows the evicted span
+        std::vector<llama_token> tail(token_history.begin() + end, token_history.begin() + n_past);
+        llama_memory_seq_rm(memory, MAIN_SEQ, n_keep, -1);
+        token_history.resize(n_keep);
+        n_past = n_keep;
+        syncDraft(n_keep);
+        prefillTokens(tail.data(), static_cast<int>(tail.size()));
+    }
 
-    // Remove tokens from the beginning of the sequence using the memory API
-    llama_memory_seq_rm(memory, MAIN_SEQ, 0, tokens_to_remove);
+    // Evicted turns are gone, later ones moved back
+    std::vector<int> shifted;
+    for (int start : turn_starts) {
+        if (start < n_keep) shifted.push_back(start);
+        else if (start >= end) shifted.push_back(start - n_discard);
+    }
+    turn_starts.swap(shifted);
 
-    // Update position tracking
-    n_past -= tokens_to_remove;
+    // History positions moved, the n-gram index is rebuilt on demand
+    clearNgramIndex();
+}
 
-    // Remove corresponding tokens from history
-    for (int i = 0; i < tokens_to_remove && !token_history.empty(); i++) {
-        token_history.pop_front();
-    }
+bool Interface::evaluateTokens(const std::vector<llama_token>& tokens) {
+    return evaluateTokens(tokens.data(), static_cast<int>(tokens.size()));
 }
 
-void Interface::evaluateTokens(const std::vector<llama_token>& tokens) {
-    if (tokens.empty()) return;
+bool Interface::evaluateTokens(const llama_token* tokens, int n_tokens) {
+    if (n_tokens <= 0) return true;
+    if (n_tokens > config.batch) {
+        throw std::runtime_error("Too many tokens for a single decode");
+    }
 
-    // Create batch for evaluation
-    llama_batch batch = llama_batch_get_one(
-        const_cast<llama_token*>(tokens.data()),
-        tokens.size()
-    );
+    // Fill the persistent batch, only the last position needs logits
+    batch.n_tokens = n_tokens;
+    for (int i = 0; i < n_tokens; i++) {
+        batch.token[i] = tokens[i];
+        batch.pos[i] = n_past + i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = MAIN_SEQ;
+        batch.logits[i] = i == n_tokens - 1;
+    }
 
-    if (llama_decode(ctx, batch)) {
+    int ret = llama_decode(ctx, batch);
+    if (ret != 0 && ret != 2) {
         throw std::runtime_error("Failed to evaluate tokens");
     }
 
-    // Update position and history
-    n_past += tokens.size();
-    for (const auto& token : tokens) {
-        token_history.push_back(token);
+    // Update position and history (within the reserved capacity)
+    n_past += n_tokens;
+    token_history.insert(token_history.end(), tokens, tokens + n_tokens);
+
+    if (ret == 2) {
+        // Aborted by cancel()/timeout - earlier ubatches of this call may have made it in
+        syncWithMemory();
+        return false;
     }
+    return true;
 }
 
-std::string Interface::sampleTokens(bool& should_stop, bool is_first) {
-    std::string result;
+bool Interface::shouldAbort() {
+    if (cancel_requested) return true;
+    return has_deadline && std::chrono::steady_clock::now() >= deadline;
+}
 
-    llama_token new_token_id = llama_sampler_sample(sampler, ctx, -1);
-    llama_sampler_accept(sampler, new_token_id);
+bool Interface::abortCallback(void* data) {
+    return static_cast<Interface*>(data)->shouldAbort();
+}
 
-    // Check for EOG tokens
-    if (llama_vocab_is_eog(vocab, new_token_id)) {
-        should_stop = true;
-        return result;
+void Interface::syncWithMemory() {
+    llama_pos pos_max = llama_memory_seq_pos_max(memory, MAIN_SEQ);
+    int n_kept = std::min(n_past, static_cast<int>(pos_max + 1));
+    if (n_kept < n_past) {
+        llama_memory_seq_rm(memory, MAIN_SEQ, n_kept, -1);
+        n_past = n_kept;
+        token_history.resize(n_kept);
+        syncDraft(n_kept);
     }
+}
 
-    // Check for role marker token (if using chat template)
-    if (formatPrompt && hasTemplate &&
-        stop_token != LLAMA_TOKEN_NULL &&
-        new_token_id == stop_token) {
-        should_stop = true;
-        return result;
-    }
+bool Interface::prefillTokens(const llama_token* tokens, int n_tokens) {
+    const int total = n_tokens;
 
-    char buf[128];
-    int lstrip = is_first ? 1 : 0;
-    int n_chars = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), lstrip, true);
-    if (n_chars < 0) {
-        throw std::runtime_error("Failed to convert token to text");
-    }
+    // llama_decode rejects more than n_batch tokens per call
+    int chunk = config.prefill_chunk > 0 ? config.prefill_chunk : config.batch;
+    chunk = std::max(1, std::min(chunk, config.batch));
 
-    result.append(buf, n_chars);
+    auto start = std::chrono::steady_clock::now();
+    for (int processed = 0; processed < total; ) {
+        int n = std::min(chunk, total - processed);
+        if (shouldAbort() || !evaluateTokens(tokens + processed, n)) {
+            std::cout << "Prefill interrupted after " << processed << " of " << total << " tokens" << std::endl;
+            interrupted = true;
+            return false;
+        }
+        processed += n;
 
-    // Evaluate the new token
-    std::vector<llama_token> new_token = {new_token_id};
-    evaluateTokens(new_token);
+        if (progressCallback) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-    return result;
-}
+            PrefillProgress progress;
+            progress.processed = processed;
+            progress.total = total;
+            progress.percent = 100.0f * processed / total;
+            progress.tokens_per_sec = elapsed.count() > 0.0 ? processed / elapsed.count() : 0.0;
 
-void Interface::setPromptFormat(const std::string& promptFormat) {
-    if (hasTemplate) {
-        formatPrompt = true;
+            // Cancelling here leaves the evaluated chunks in the KV cache and history
+            if (!progressCallback(progress) && processed < total) {
+                std::cout << "Prefill cancelled after " << processed << " of " << total << " tokens" << std::endl;
+                return false;
+            }
+        }
     }
-}
 
-void Interface::clearPromptFormat() {
-    formatPrompt = false;
+    return true;
 }
 
-void Interface::clearContext() {
-    llama_memory_clear(memory, true);
-    n_past = 0;
-    token_history.clear();
-    llama_sampler_reset(sampler);
+llama_token Interface::sampleToken(int idx) {
+    PhaseTimer timer(stats.sample_ms);
+    llama_token id = sampleFrom(sampler, ctx, idx, grammar);
+    if (config.logprobs) {
+        computeLogprob(idx, id);
+    }
+    return id;
 }
 
-int Interface::getContextUsage() {
-    // Use the memory API to get actual usage
-    llama_pos pos = llama_memory_seq_pos_max(memory, MAIN_SEQ);
-    return pos >= 0 ? pos + 1 : 0;
-}
+void Interface::computeLogprob(int idx, llama_token id) {
+    const float* logits = llama_get_logits_ith(ctx, idx);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    LogitStats stats = computeLogitStats(logits, n_vocab);
+    const float norm = stats.max + stats.log_sum;
 
-int Interface::getContextSize() {
-    return config.ctx;
+    last_logprob.token = id;
+    last_logprob.logprob = logits[id] - norm;
+    last_logprob.entropy = stats.entropy;
+
+    int k = std::min(config.top_logprobs, static_cast<int>(TokenLogprob::MAX_TOP));
+    last_logprob.n_top = topLogits(logits, n_vocab, k, last_logprob.top_tokens, last_logprob.top_logprobs);
+    for (int i = 0; i < last_logprob.n_top; i++) {
+        last_logprob.top_logprobs[i] -= norm;
+    }
 }
 
-std::string Interface::applyChatTemplate(const std::string& userMessage) {
-    // Create a single message for the current user input
-    llama_chat_message msg = {"user", userMessage.c_str()};
+llama_token Interface::sampleFrom(llama_sampler* chain, llama_context* context, int idx, llama_sampler* constraint) {
+    // llama_sampler_sample() builds a fresh vocab-sized candidate array on every call,
+    // this does the same work in a buffer that lives as long as the Interface
+    const float* logits = llama_get_logits_ith(context, idx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(context)));
+    auto fill = [&]() {
+        for (llama_token i = 0; i < n_vocab; i++) {
+            candidates[i] = {i, logits[i], 0.0f};
+        }
+        return llama_token_data_array{candidates.data(), static_cast<size_t>(n_vocab), -1, false};
+    };
+    auto select = [](const llama_token_data_array& cur_p) {
+        if (cur_p.selected < 0 || cur_p.selected >= static_cast<int64_t>(cur_p.size)) {
+            throw std::runtime_error("Sampler didn't select a token");
+        }
+        return cur_p.data[cur_p.selected].id;
+    };
+
+    llama_token_data_array cur_p;
+    // Every chain except the draft model's greedy sampler comes from createSampler()
+    if (fused_chain && chain != draft_sampler) {
+        // The fused stage runs straight on the logits row, then the rest of the chain (dist)
+        cur_p = {candidates.data(), fusedSelect(logits, n_vocab, fused_params, candidates.data()), -1, true};
+        for (int i = 1; i < llama_sampler_chain_n(chain); i++) {
+            llama_sampler_apply(llama_sampler_chain_get(chain, i), &cur_p);
+        }
+    } else {
+        cur_p = fill();
+        llama_sampler_apply(chain, &cur_p);
+    }
+    llama_token id = select(cur_p);
+
+    if (constraint != NULL) {
+        // Checking the one sampled token is cheap. Only when the model strays does the
+        // grammar go over the whole vocab, and the chain samples again from what's left.
+        // An approximation of masking first, see Config::grammar.
+        llama_token_data single = {id, 1.0f, 0.0f};
+        llama_token_data_array single_p = {&single, 1, -1, false};
+        llama_sampler_apply(constraint, &single_p);
+        if (std::isinf(single.logit)) {
+            cur_p = fill();
+            llama_sampler_apply(constraint, &cur_p);
+            llama_sampler_apply(chain, &cur_p);
+            id = select(cur_p);
+        }
+        llama_sampler_accept(constraint, id);
+    }
 
-    // Apply template to just this one message
-    std::vector<char> formatted(config.ctx);
-    int new_len = llama_chat_apply_template(
-        chatTemplate.c_str(),  // Use the model's chat template
-        &msg,
-        1,        // Just one message
-        true,     // Add assistant token
-        formatted.data(),
-        formatted.size()
-    );
+    llama_sampler_accept(chain, id);
+    return id;
+}
 
-    if (new_len < 0) {
-        throw std::runtime_error("Failed to apply chat template");
+bool Interface::isStopToken(llama_token id) {
+    // Check for EOG tokens
+    if (llama_vocab_is_eog(vocab, id)) {
+        return true;
     }
 
-    return std::string(formatted.begin(), formatted.begin() + new_len);
+    // Check for role marker token (if using chat template)
+    return formatPrompt && hasTemplate &&
+           stop_token != LLAMA_TOKEN_NULL &&
+           id == stop_token;
 }
 
-std::string Interface::generate(const std::string& prompt) {
-    // Check if we should use chat template formatting
-    bool use_chat_template = formatPrompt && hasTemplate;
-
+void Interface::appendPiece(std::string& out, llama_token id, bool is_first) {
+    char buf[128];
+    int lstrip = is_first ? 1 : 0;
+    int n_chars = llama_token_to_piece(vocab, id, buf, sizeof(buf), lstrip, true);
+    if (n_chars < 0) {
+        throw std::runtime_error("Failed to convert token to text");
+    }
+    out.append(buf, n_chars);
+}
+
+void Interface::syncDraft(int n_valid) {
+    // Index entries past n_valid (or all of them after a shift) point at the wrong tokens
+    if (ngram_indexed > n_valid || n_valid == 0) {
+        clearNgramIndex();
+    }
+
+    if (draft_ctx == NULL || draft_n_past <= n_valid) return;
+
+    if (n_valid == 0) {
+        llama_memory_clear(draft_memory, true);
+    } else {
+        llama_memory_seq_rm(draft_memory, MAIN_SEQ, n_valid, -1);
+    }
+    draft_n_past = n_valid;
+}
+
+void Interface::clearNgramIndex() {
+    std::fill(ngram_index.begin(), ngram_index.end(), NgramSlot{0, 0});
+    ngram_indexed = 0;
+}
+
+void Interface::lookupTokens(llama_token id, int n_draft) {
+    const int n = config.lookup_ngram;
+    const int size = static_cast<int>(token_history.size());
+    if (n <= 0 || size < n) return;
+
+    if (ngram_index.empty()) {
+        // At most one entry per history position - keep the load factor under 1/2
+        size_t slots = 1;
+        while (slots < 2 * static_cast<size_t>(config.ctx)) slots <<= 1;
+        ngram_index.assign(slots, NgramSlot{0, 0});
+        draft_pending.reserve(n);
+    }
+    if (ngram_size != n) {
+        clearNgramIndex();
+        ngram_size = n;
+    }
+
+    // Linear probing, stops at the slot holding hash or the first empty one
+    const size_t mask = ngram_index.size() - 1;
+    auto slotFor = [this, mask](uint64_t hash) -> NgramSlot& {
+        size_t i = hash & mask;
+        while (ngram_index[i].end != 0 && ngram_index[i].hash != hash) i = (i + 1) & mask;
+        return ngram_index[i];
+    };
+
+    // Index every n-gram that has a continuation, picking up where the last call stopped
+    draft_pending.resize(n);
+    for (int end = std::max(ngram_indexed, n); end < size; end++) {
+        for (int k = 0; k < n; k++) draft_pending[k] = token_history[end - n + k];
+        uint64_t hash = hashTokens(draft_pending.data(), n);
+        NgramSlot& slot = slotFor(hash);
+        slot.hash = hash;
+        slot.end = end;
+    }
+    ngram_indexed = std::max(ngram_indexed, size);
+
+    // The n-gram to look up ends with id, which isn't in the history yet
+    for (int k = 0; k < n - 1; k++) draft_pending[k] = token_history[size - n + 1 + k];
+    draft_pending[n - 1] = id;
+
+    const NgramSlot& found = slotFor(hashTokens(draft_pending.data(), n));
+    if (found.end == 0) return;
+
+    int start = found.end;
+    for (int k = 0; k < n; k++) {
+        if (token_history[start - n + k] != draft_pending[k]) return;  // Hash collision
+    }
+
+    for (int pos = start; pos < size && static_cast<int>(draft.size()) < n_draft; pos++) {
+        draft.push_back(token_history[pos]);
+    }
+}
+
+void Interface::draftTokens(llama_token id, int max_draft) {
+    draft.clear();
+    int n_draft = std::min(config.draft_tokens, max_draft);
+    if (n_draft <= 0) return;
+
+    if (draft_ctx == NULL) {
+        lookupTokens(id, n_draft);
+        return;
+    }
+
+    // Feed the draft model everything it hasn't seen yet, ending with id
+    draft_pending.assign(token_history.begin() + draft_n_past, token_history.end());
+    draft_pending.push_back(id);
+    for (llama_token token : draft_pending) {
+        // Not in the draft model's vocab - no drafts until the draft model is resynced past it
+        if (token >= draft_vocab) return;
+    }
+    for (size_t i = 0; i < draft_pending.size(); i += config.batch) {
+        int n = static_cast<int>(std::min<size_t>(config.batch, draft_pending.size() - i));
+        if (llama_decode(draft_ctx, llama_batch_get_one(draft_pending.data() + i, n))) {
+            throw std::runtime_error("Failed to evaluate draft tokens");
+        }
+    }
+    draft_n_past += static_cast<int>(draft_pending.size());
+
+    // Greedy continuation - only exact matches are kept, so the cheapest guess is the best one
+    for (int i = 0; i < n_draft; i++) {
+        llama_token d = sampleFrom(draft_sampler, draft_ctx, -1);
+        if (d >= draft_vocab) break;  // The main model has no such token
+        draft.push_back(d);
+        if (i + 1 == n_draft || llama_vocab_is_eog(vocab, d)) break;
+
+        if (llama_decode(draft_ctx, llama_batch_get_one(&d, 1))) {
+            throw std::runtime_error("Failed to evaluate draft tokens");
+        }
+        draft_n_past++;
+    }
+}
+
+bool Interface::decodeWithDraft(llama_token id) {
+    batch.n_tokens = 0;
+    for (size_t i = 0; i <= draft.size(); i++) {
+        batch.token[i] = i == 0 ? id : draft[i - 1];
+        batch.pos[i] = n_past + static_cast<llama_pos>(i);
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = MAIN_SEQ;
+        batch.logits[i] = true;
+        batch.n_tokens++;
+    }
+
+    int ret = llama_decode(ctx, batch);
+    if (ret == 2) {
+        // Aborted - nothing from this step is kept, the caller stops
+        llama_memory_seq_rm(memory, MAIN_SEQ, n_past, -1);
+        syncDraft(n_past);
+        return false;
+    }
+    if (ret != 0) {
+        throw std::runtime_error("Failed to evaluate tokens");
+    }
+    return true;
+}
+
+void Interface::setPromptFormat(const std::string& promptFormat) {
+    if (hasTemplate) {
+        formatPrompt = true;
+    }
+}
+
+void Interface::clearPromptFormat() {
+    formatPrompt = false;
+}
+
+void Interface::clearContext() {
+    if (!config.reuse_prefix) {
+        llama_memory_clear(memory, true);
+        token_history.clear();
+        syncDraft(0);
+    }
+    // Otherwise the KV cache and token_history stay as they are - the next generate()
+    // keeps the longest matching prefix (e.g. a shared system prompt) and drops the rest
+    n_past = 0;
+    n_pinned = 0;
+    turn_starts.clear();
+    llama_sampler_reset(sampler);
+}
+
+int Interface::getContextUsage() {
+    // Tokens cached past n_past after clearContext() don't belong to the conversation
+    return n_past;
+}
+
+int Interface::getContextSize() {
+    return config.ctx;
+}
+
+std::string Interface::resolveSessionPath(const std::string& path) {
+    std::filesystem::path resolved(path);
+    if (resolved.is_relative()) {
+        auto& folder_manager = iamai::FolderManager::getInstance();
+        if (folder_manager.getCachePath().empty()) {
+            folder_manager.createFolderStructure();
+        }
+        resolved = folder_manager.getCachePath() / "sessions" / resolved;
+    }
+    return resolved.string();
+}
+
+bool Interface::saveSession(const std::string& path) {
+    std::string file_path = resolveSessionPath(path);
+    std::filesystem::create_directories(std::filesystem::path(file_path).parent_path());
+
+    // Only the conversation is saved, not cache entries left over after clearContext()
+    llama_memory_seq_rm(memory, MAIN_SEQ, n_past, -1);
+    token_history.resize(n_past);
+
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, MAIN_SEQ));
+    size_t written = llama_state_seq_get_data(ctx, state.data(), state.size(), MAIN_SEQ);
+    if (written == 0 && !state.empty()) {
+        std::cerr << "Failed to read sequence state" << std::endl;
+        return false;
+    }
+
+    SessionHeader header = {};
+    header.magic = SESSION_MAGIC;
+    header.version = SESSION_VERSION;
+    header.n_past = n_past;
+    header.n_pinned = n_pinned;
+    header.n_tokens = static_cast<uint32_t>(token_history.size());
+    header.top_k = config.top_k;
+    header.top_p = config.top_p;
+    header.temperature = config.temperature;
+    header.seed = config.seed;
+    header.state_size = written;
+
+    FILE* fp = fopen(file_path.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "Failed to open session file: " << file_path << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(token_history.data(), sizeof(llama_token), token_history.size(), fp) == token_history.size() &&
+              fwrite(state.data(), 1, written, fp) == written;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok) {
+        std::cerr << "Failed to write session file: " << file_path << std::endl;
+        std::filesystem::remove(file_path);
+        return false;
+    }
+
+    std::cout << "Saved session (" << n_past << " tokens, " << written / 1024 << " KiB) to " << file_path << std::endl;
+    return true;
+}
+
+bool Interface::loadSession(const std::string& path) {
+    std::string file_path = resolveSessionPath(path);
+
+    MappedFile file(file_path);
+    if (!file.data || file.size < sizeof(SessionHeader)) {
+        std::cerr << "Failed to open session file: " << file_path << std::endl;
+        return false;
+    }
+
+    SessionHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if (header.magic != SESSION_MAGIC || header.version != SESSION_VERSION) {
+        std::cerr << "Not a session file (or from another version): " << file_path << std::endl;
+        return false;
+    }
+
+    size_t tokens_bytes = static_cast<size_t>(header.n_tokens) * sizeof(llama_token);
+    if (file.size < sizeof(header) + tokens_bytes + header.state_size ||
+        static_cast<int>(header.n_tokens) > config.ctx || header.n_past != static_cast<int>(header.n_tokens)) {
+        std::cerr << "Session file is truncated or doesn't fit the context: " << file_path << std::endl;
+        return false;
+    }
+
+    const uint8_t* tokens_data = file.data + sizeof(header);
+    const uint8_t* state_data = tokens_data + tokens_bytes;
+
+    // Replace the current conversation with the saved one
+    llama_memory_seq_rm(memory, MAIN_SEQ, -1, -1);
+    syncDraft(0);
+    if (llama_state_seq_set_data(ctx, state_data, header.state_size, MAIN_SEQ) == 0) {
+        std::cerr << "Failed to restore sequence state (different model or context settings?)" << std::endl;
+        llama_memory_seq_rm(memory, MAIN_SEQ, -1, -1);
+        n_past = 0;
+        n_pinned = 0;
+        token_history.clear();
+        turn_starts.clear();
+        return false;
+    }
+
+    token_history.resize(header.n_tokens);
+    memcpy(token_history.data(), tokens_data, tokens_bytes);
+    n_past = header.n_past;
+    n_pinned = std::min(header.n_pinned, n_past);
+    turn_starts.clear();
+
+    // llama.cpp can't serialize RNG state; restore the settings and restart the chain from its seed
+    if (header.top_k != config.top_k || header.top_p != config.top_p ||
+        header.temperature != config.temperature || header.seed != config.seed) {
+        config.top_k = header.top_k;
+        config.top_p = header.top_p;
+        config.temperature = header.temperature;
+        config.seed = header.seed;
+        llama_sampler_free(sampler);
+        sampler = createSampler(config.seed);
+    }
+    llama_sampler_reset(sampler);
+
+    std::cout << "Loaded session (" << n_past << " tokens) from " << file_path << std::endl;
+    return true;
+}
+
+std::string Interface::applyChatTemplate(const std::string& userMessage) {
+    // Create a single message for the current user input
+    return applyChatTemplate({{"user", userMessage.c_str()}}, true);
+}
+
+std::string Interface::applyChatTemplate(const std::vector<llama_chat_message>& messages, bool add_assistant) {
+    PhaseTimer timer(stats.template_ms);
+    std::vector<char> formatted(config.ctx);
+    int new_len = llama_chat_apply_template(
+        chatTemplate.c_str(),  // Use the model's chat template
+        messages.data(),
+        messages.size(),
+        add_assistant,
+        formatted.data(),
+        formatted.size()
+    );
+
+    // Long pastes can need more room than the initial guess
+    if (new_len > static_cast<int>(formatted.size())) {
+        formatted.resize(new_len);
+        new_len = llama_chat_apply_template(chatTemplate.c_str(), messages.data(), messages.size(),
+                                            add_assistant, formatted.data(), formatted.size());
+    }
+
+    if (new_len < 0) {
+        throw std::runtime_error("Failed to apply chat template");
+    }
+
+    return std::string(formatted.begin(), formatted.begin() + new_len);
+}
+
+std::string Interface::generate(const std::string& prompt) {
+    return generate(prompt, nullptr);
+}
+
+size_t Interface::completeUtf8Length(const std::string& text) {
+    // Walk back from the end to the start of the last (possibly partial) character
+    size_t len = text.size();
+    size_t i = len;
+    while (i > 0 && len - i < 4) {
+        unsigned char c = static_cast<unsigned char>(text[i - 1]);
+        if ((c & 0xC0) != 0x80) {
+            size_t expected = 1;
+            if ((c & 0xE0) == 0xC0) expected = 2;
+            else if ((c & 0xF0) == 0xE0) expected = 3;
+            else if ((c & 0xF8) == 0xF0) expected = 4;
+            return (len - (i - 1) >= expected) ? len : i - 1;
+        }
+        i--;
+    }
+    // Only continuation bytes (or nothing) - not a sequence we can complete, pass it through
+    return len;
+}
+
+void Interface::beginStats() {
+    stats = Stats();
+    call_start = std::chrono::steady_clock::now();
+}
+
+void Interface::endStats() {
+    stats.total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - call_start).count();
+    stats.kv_used = n_past;
+    stats.kv_size = config.ctx;
+    if (load_stats.first_token_ms == 0.0 && stats.generated_tokens > 0) {
+        load_stats.first_token_ms = load_stats.ready_ms + stats.first_token_ms;
+    }
+}
+
+std::string Interface::generate(const std::string& prompt, const TokenCallback& onToken) {
+    beginStats();
+    armCancellation();
+
+    // Check if we should use chat template formatting
+    bool use_chat_template = formatPrompt && hasTemplate;
+
     std::string formattedPrompt;
     if (use_chat_template) {
         formattedPrompt = applyChatTemplate(prompt);
@@ -333,28 +1495,839 @@ std::string Interface::generate(const std::string& prompt) {
     }
 
     // Tokenize the new prompt (parse special tokens when using chat templates)
-    std::vector<llama_token> new_tokens = tokenize(formattedPrompt, n_past == 0, use_chat_template);
+    std::vector<llama_token> new_tokens;
+    if (n_past == 0 && !systemPrompt.empty()) {
+        // New conversation: system prompt first, tokenized on its own so its span is exact
+        // (and identical across conversations for prefix reuse)
+        std::string systemPart = systemPrompt;
+        bool pin = true;
+        if (use_chat_template) {
+            llama_chat_message system = {"system", systemPrompt.c_str()};
+            llama_chat_message user = {"user", prompt.c_str()};
+            systemPart = applyChatTemplate({system}, false);
+            formattedPrompt = applyChatTemplate({system, user}, true);
+            // Templates without a system role fold it into the first user turn (Gemma), so
+            // the system render isn't a prefix of the full one. Nothing is pinned then.
+            pin = !systemPart.empty() && formattedPrompt.compare(0, systemPart.size(), systemPart) == 0;
+            if (pin) {
+                formattedPrompt.erase(0, systemPart.size());
+            }
+        }
 
-    // Manage context to make room for new tokens + generation
-    manageContext(new_tokens);
+        PhaseTimer timer(stats.tokenize_ms);
+        if (pin) {
+            new_tokens = tokenize(systemPart, true, use_chat_template);
+            n_pinned = static_cast<int>(new_tokens.size());
 
-    // Evaluate the new prompt tokens
-    evaluateTokens(new_tokens);
+            std::vector<llama_token> user_tokens = tokenize(formattedPrompt, false, use_chat_template);
+            new_tokens.insert(new_tokens.end(), user_tokens.begin(), user_tokens.end());
+        } else {
+            new_tokens = tokenize(formattedPrompt, true, use_chat_template);
+            n_pinned = 0;
+        }
+    } else {
+        PhaseTimer timer(stats.tokenize_ms);
+        new_tokens = tokenize(formattedPrompt, n_past == 0, use_chat_template);
+    }
 
-    // Generate response
+    // Generate response. Buffers are sized up front so pieces are appended in place.
     std::string result;
-    bool should_stop = false;
+    std::string pending;  // Bytes held back until a split UTF-8 character is complete
+    std::string chunk;    // Complete characters handed to onToken
+    result.reserve(static_cast<size_t>(std::max(config.max_tokens, 0)) * 8);
+    if (onToken) {
+        pending.reserve(64);
+        chunk.reserve(256);
+    }
+    bool is_first = true;
+    bool stopped = false;  // onToken asked to stop, it gets nothing more
+
+    bool completed = runGeneration(new_tokens.data(), static_cast<int>(new_tokens.size()), [&](llama_token id) {
+        size_t start = result.size();
+        {
+            PhaseTimer timer(stats.detokenize_ms);
+            appendPiece(result, id, is_first);
+        }
+        is_first = false;
+
+        if (onToken && result.size() > start) {
+            pending.append(result, start, std::string::npos);
+            size_t complete = completeUtf8Length(pending);
+            if (complete > 0) {
+                chunk.assign(pending, 0, complete);
+                pending.erase(0, complete);
+                stopped = !onToken(chunk);
+                return !stopped;
+            }
+        }
+        return true;
+    });
+    endStats();
+    if (!completed) {
+        return "";
+    }
+
+    // Flush whatever is left, even if the model stopped mid-character
+    if (onToken && !stopped && !pending.empty()) {
+        onToken(pending);
+    }
+
+    return result;
+}
+
+void Interface::setParallel(int sequences) {
+    sequences = std::max(1, sequences);
+    if (sequences == config.n_parallel) return;
+    config.n_parallel = sequences;
+    freeParallel();  // Rebuilt with the new sequence count on the next generateBatch()
+}
+
+void Interface::initParallel() {
+    if (parallel_ctx != NULL) return;
+
+    // Every sequence needs a row per step
+    const int n_slots = std::max(1, std::min(config.n_parallel, config.batch));
+
+    auto ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = config.ctx;
+    ctx_params.n_batch = config.batch;
+    ctx_params.n_ubatch = ubatchSize();
+    ctx_params.n_seq_max = n_slots;
+    ctx_params.kv_unified = true;  // Sequences share the whole cache instead of ctx / n_seq_max each
+    ctx_params.n_threads = config.threads;
+    ctx_params.n_threads_batch = prefillThreads();
+    applyCacheParams(ctx_params);
+
+    std::unique_lock<std::mutex> window = huge_pages.window();
+    NodeAffinity pin(config.numa_node);  // See initializeContext()
+    parallel_ctx = llama_init_from_model(model, ctx_params);
+    if (parallel_ctx == NULL) {
+        throw std::runtime_error("Failed to create batch generation context");
+    }
+    llama_set_abort_callback(parallel_ctx, abortCallback, this);
+    attachThreadpools(parallel_ctx);
+    huge_pages.adviseNew();
+
+    parallel_batch = llama_batch_init(config.batch, 0, 1);
+    parallel_slots.resize(n_slots);
+    for (int i = 0; i < n_slots; i++) {
+        uint32_t seed = config.seed == LLAMA_DEFAULT_SEED ? LLAMA_DEFAULT_SEED : config.seed + i;
+        parallel_slots[i].sampler = createSampler(seed);
+    }
+}
+
+void Interface::freeParallel() {
+    for (auto& slot : parallel_slots) {
+        if (slot.sampler != NULL) llama_sampler_free(slot.sampler);
+        if (slot.constraint != NULL) llama_sampler_free(slot.constraint);
+    }
+    parallel_slots.clear();
+    llama_batch_free(parallel_batch);
+    parallel_batch = {};
+    if (parallel_ctx != NULL) {
+        llama_free(parallel_ctx);
+        parallel_ctx = nullptr;
+    }
+}
+
+void Interface::armCancellation() {
+    // A cancel() made before this point was aimed at an earlier call
+    cancel_requested = false;
+    interrupted = false;
+    has_deadline = config.timeout_ms > 0;
+    if (has_deadline) {
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(config.timeout_ms);
+    }
+}
+
+std::vector<llama_token> Interface::tokenizeTurn(const std::string& prompt) {
+    std::vector<llama_token> tokens;
+    if (formatPrompt && hasTemplate) {
+        std::vector<llama_chat_message> messages;
+        if (!systemPrompt.empty()) messages.push_back({"system", systemPrompt.c_str()});
+        messages.push_back({"user", prompt.c_str()});
+        std::string formatted = applyChatTemplate(messages, true);
+        PhaseTimer timer(stats.tokenize_ms);
+        tokens = tokenize(formatted, true, true);
+    } else {
+        // Same split as generate(): system prompt with BOS, then the prompt on its own
+        PhaseTimer timer(stats.tokenize_ms);
+        tokens = tokenize(systemPrompt.empty() ? prompt : systemPrompt, true, false);
+        if (!systemPrompt.empty()) {
+            std::vector<llama_token> user_tokens = tokenize(prompt, false, false);
+            tokens.insert(tokens.end(), user_tokens.begin(), user_tokens.end());
+        }
+    }
+    if (static_cast<int>(tokens.size()) >= config.ctx) {
+        throw std::runtime_error("Prompt is longer than the context size");
+    }
+    return tokens;
+}
+
+std::vector<std::string> Interface::generateBatch(const std::vector<std::string>& prompts) {
+    beginStats();
+    armCancellation();
+
+    initParallel();
+    llama_memory_t parallel_memory = llama_get_memory(parallel_ctx);
+    llama_memory_clear(parallel_memory, true);
+
+    // Tokenize everything first, so a prompt that can't fit fails before any work is done
+    std::vector<std::vector<llama_token>> inputs(prompts.size());
+    for (size_t p = 0; p < prompts.size(); p++) {
+        inputs[p] = tokenizeTurn(prompts[p]);
+        stats.prompt_tokens += static_cast<int>(inputs[p].size());
+    }
+    stats.prefill_tokens = stats.prompt_tokens;
+
+    std::vector<std::string> replies(prompts.size());
+    if (config.max_tokens <= 0) {
+        endStats();
+        return replies;
+    }
+
+    const int n_slots = static_cast<int>(parallel_slots.size());
+    for (auto& slot : parallel_slots) {
+        slot.prompt = -1;
+        if (slot.constraint != NULL) llama_sampler_free(slot.constraint);
+        slot.constraint = grammar != NULL ? llama_sampler_clone(grammar) : nullptr;
+    }
+
+    size_t next_prompt = 0;
+    int reserved = 0;     // KV cells promised to the slots in flight
+    int active = 0;
+    int next_prefill = 0; // Round-robin start so one long prompt can't starve the others
+
+    auto retire = [&](int s) {
+        ParallelSlot& slot = parallel_slots[s];
+        llama_memory_seq_rm(parallel_memory, s, -1, -1);
+        reserved -= slot.reserved;
+        slot.prompt = -1;
+        active--;
+    };
+    auto batchAdd = [&](llama_token token, llama_pos pos, llama_seq_id seq, bool logits) {
+        int i = parallel_batch.n_tokens++;
+        parallel_batch.token[i] = token;
+        parallel_batch.pos[i] = pos;
+        parallel_batch.n_seq_id[i] = 1;
+        parallel_batch.seq_id[i][0] = seq;
+        parallel_batch.logits[i] = logits;
+    };
+
+    while (true) {
+        // Hand free slots the next prompts while their prompt + reply fits in the cache
+        for (int s = 0; s < n_slots && next_prompt < prompts.size(); s++) {
+            ParallelSlot& slot = parallel_slots[s];
+            if (slot.prompt >= 0) continue;
+
+            const std::vector<llama_token>& tokens = inputs[next_prompt];
+            if (tokens.empty()) {
+                next_prompt++;
+                continue;
+            }
+            int need = std::min(static_cast<int>(tokens.size()) + config.max_tokens, config.ctx);
+            if (active > 0 && reserved + need > config.ctx) break;
+
+            slot.prompt = static_cast<int>(next_prompt++);
+            slot.prompt_pos = 0;
+            slot.n_past = 0;
+            slot.generated = 0;
+            slot.reserved = need;
+            slot.last_token = LLAMA_TOKEN_NULL;
+            llama_sampler_reset(slot.sampler);
+            if (slot.constraint != NULL) llama_sampler_reset(slot.constraint);
+            replies[slot.prompt].reserve(static_cast<size_t>(config.max_tokens) * 8);
+            reserved += need;
+            active++;
+        }
+        if (active == 0) break;
+        if (shouldAbort()) {
+            interrupted = true;
+            break;
+        }
+
+        // One token for every slot that is generating, then prompt chunks
+        parallel_batch.n_tokens = 0;
+        bool generating = false;
+        for (int s = 0; s < n_slots; s++) {
+            ParallelSlot& slot = parallel_slots[s];
+            slot.i_batch = -1;
+            if (slot.prompt >= 0 && slot.last_token != LLAMA_TOKEN_NULL) {
+                slot.i_batch = parallel_batch.n_tokens;
+                batchAdd(slot.last_token, slot.n_past++, s, true);
+                generating = true;
+            }
+        }
+        for (int k = 0; k < n_slots && parallel_batch.n_tokens < config.batch; k++) {
+            int s = (next_prefill + k) % n_slots;
+            ParallelSlot& slot = parallel_slots[s];
+            if (slot.prompt < 0 || slot.last_token != LLAMA_TOKEN_NULL) continue;
+
+            const std::vector<llama_token>& tokens = inputs[slot.prompt];
+            int left = static_cast<int>(tokens.size() - slot.prompt_pos);
+            int n = std::min(config.batch - parallel_batch.n_tokens, left);
+            for (int j = 0; j < n; j++) {
+                bool last = j == left - 1;
+                if (last) slot.i_batch = parallel_batch.n_tokens;
+                batchAdd(tokens[slot.prompt_pos++], slot.n_past++, s, last);
+            }
+        }
+        next_prefill = (next_prefill + 1) % n_slots;
+
+        int ret;
+        {
+            PhaseTimer timer(generating ? stats.decode_ms : stats.prefill_ms);
+            stats.decode_calls++;
+            ret = llama_decode(parallel_ctx, parallel_batch);
+        }
+        if (ret == 2) {
+            interrupted = true;
+            break;
+        }
+        if (ret != 0) {
+            endStats();
+            throw std::runtime_error("Failed to evaluate batch");
+        }
+
+        for (int s = 0; s < n_slots; s++) {
+            ParallelSlot& slot = parallel_slots[s];
+            if (slot.prompt < 0 || slot.i_batch < 0) continue;
+
+            llama_token id;
+            {
+                PhaseTimer timer(stats.sample_ms);
+                id = sampleFrom(slot.sampler, parallel_ctx, slot.i_batch, slot.constraint);
+            }
+            if (isStopToken(id)) {
+                retire(s);
+                continue;
+            }
+
+            if (++stats.generated_tokens == 1) {
+                stats.first_token_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - call_start).count();
+            }
+            {
+                PhaseTimer timer(stats.detokenize_ms);
+                appendPiece(replies[slot.prompt], id, slot.generated == 0);
+            }
+            slot.generated++;
+            slot.last_token = id;
+            if (slot.generated >= config.max_tokens || slot.n_past + 1 >= slot.reserved) {
+                retire(s);
+            }
+        }
+    }
+
+    llama_memory_clear(parallel_memory, true);
+    endStats();
+    return replies;
+}
+
+void Interface::ensureParallel(int sequences) {
+    if (sequences > config.batch) {
+        throw std::runtime_error("More sequences than the batch size");
+    }
+    if (parallel_ctx != NULL && static_cast<int>(parallel_slots.size()) < sequences) {
+        freeParallel();
+    }
+    config.n_parallel = std::max(config.n_parallel, sequences);
+    initParallel();
+}
+
+bool Interface::forkPrompt(const std::vector<llama_token>& tokens, int n, int& logits_row) {
+    llama_memory_t parallel_memory = llama_get_memory(parallel_ctx);
+    llama_memory_clear(parallel_memory, true);
+
+    PhaseTimer timer(stats.prefill_ms);
+    const int n_tokens = static_cast<int>(tokens.size());
+    for (int start = 0; start < n_tokens; start += config.batch) {
+        if (shouldAbort()) {
+            interrupted = true;
+            return false;
+        }
+        parallel_batch.n_tokens = std::min(config.batch, n_tokens - start);
+        for (int i = 0; i < parallel_batch.n_tokens; i++) {
+            parallel_batch.token[i] = tokens[start + i];
+            parallel_batch.pos[i] = start + i;
+            parallel_batch.n_seq_id[i] = 1;
+            parallel_batch.seq_id[i][0] = 0;
+            parallel_batch.logits[i] = start + i == n_tokens - 1;
+        }
+        stats.decode_calls++;
+        int ret = llama_decode(parallel_ctx, parallel_batch);
+        if (ret == 2) {
+            interrupted = true;
+            return false;
+        }
+        if (ret != 0) {
+            throw std::runtime_error("Failed to evaluate tokens");
+        }
+    }
+    logits_row = parallel_batch.n_tokens - 1;
+    stats.prompt_tokens = n_tokens;
+    stats.prefill_tokens = n_tokens;
+
+    // The other sequences reference the same cells, nothing is copied
+    for (int s = 1; s < n; s++) {
+        llama_memory_seq_cp(parallel_memory, 0, s, -1, -1);
+    }
+    return true;
+}
+
+std::vector<Interface::Candidate> Interface::generateN(const std::string& prompt, int n) {
+    beginStats();
+    armCancellation();
+    std::vector<Candidate> results(std::max(n, 0));
+    if (n <= 0 || config.max_tokens <= 0) {
+        endStats();
+        return results;
+    }
+
+    std::vector<llama_token> tokens = tokenizeTurn(prompt);
+    if (static_cast<int>(tokens.size()) + n * config.max_tokens > config.ctx) {
+        throw std::runtime_error("Prompt and replies don't fit in the context");
+    }
+    ensureParallel(n);
+
+    int logits_row = 0;
+    if (tokens.empty() || !forkPrompt(tokens, n, logits_row)) {
+        endStats();
+        return {};
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    for (int s = 0; s < n; s++) {
+        ParallelSlot& slot = parallel_slots[s];
+        slot.prompt = s;
+        slot.n_past = static_cast<int>(tokens.size());
+        slot.generated = 0;
+        slot.i_batch = logits_row;  // Every branch samples its first token from the same row
+        llama_sampler_reset(slot.sampler);
+        if (slot.constraint != NULL) llama_sampler_free(slot.constraint);
+        slot.constraint = grammar != NULL ? llama_sampler_clone(grammar) : nullptr;
+        if (slot.constraint != NULL) llama_sampler_reset(slot.constraint);
+        results[s].tokens.reserve(config.max_tokens);
+    }
+
+    int active = n;
+    while (true) {
+        for (int s = 0; s < n; s++) {
+            ParallelSlot& slot = parallel_slots[s];
+            if (slot.prompt < 0) continue;
+
+            llama_token id;
+            float logprob;
+            {
+                PhaseTimer timer(stats.sample_ms);
+                id = sampleFrom(slot.sampler, parallel_ctx, slot.i_batch, slot.constraint);
+                const float* logits = llama_get_logits_ith(parallel_ctx, slot.i_batch);
+                LogitStats logit_stats = computeLogitStats(logits, n_vocab);
+                logprob = logits[id] - (logit_stats.max + logit_stats.log_sum);
+            }
+            if (isStopToken(id)) {
+                results[s].finished = true;
+                slot.prompt = -1;
+                active--;
+                continue;
+            }
+
+            if (++stats.generated_tokens == 1) {
+                stats.first_token_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - call_start).count();
+            }
+            Candidate& candidate = results[s];
+            candidate.logprob += logprob;
+            candidate.tokens.push_back(id);
+            {
+                PhaseTimer timer(stats.detokenize_ms);
+                appendPiece(candidate.text, id, slot.generated == 0);
+            }
+            slot.generated++;
+            slot.last_token = id;
+            if (slot.generated >= config.max_tokens) {
+                slot.prompt = -1;
+                active--;
+            }
+        }
+        if (active == 0) break;
+        if (shouldAbort()) {
+            interrupted = true;
+            break;
+        }
+
+        // Every live branch advances by one token in the same decode
+        parallel_batch.n_tokens = 0;
+        for (int s = 0; s < n; s++) {
+            ParallelSlot& slot = parallel_slots[s];
+            if (slot.prompt < 0) continue;
+            int i = parallel_batch.n_tokens++;
+            parallel_batch.token[i] = slot.last_token;
+            parallel_batch.pos[i] = slot.n_past++;
+            parallel_batch.n_seq_id[i] = 1;
+            parallel_batch.seq_id[i][0] = s;
+            parallel_batch.logits[i] = true;
+            slot.i_batch = i;
+        }
+        int ret;
+        {
+            PhaseTimer timer(stats.decode_ms);
+            stats.decode_calls++;
+            ret = llama_decode(parallel_ctx, parallel_batch);
+        }
+        if (ret == 2) {
+            interrupted = true;
+            break;
+        }
+        if (ret != 0) {
+            throw std::runtime_error("Failed to evaluate batch");
+        }
+    }
+
+    llama_memory_clear(llama_get_memory(parallel_ctx), true);
+    std::stable_sort(results.begin(), results.end(),
+        [](const Candidate& a, const Candidate& b) { return a.logprob > b.logprob; });
+    endStats();
+    return results;
+}
+
+std::vector<Interface::Candidate> Interface::beamSearch(const std::string& prompt, int width) {
+    beginStats();
+    armCancellation();
+    if (width <= 0 || config.max_tokens <= 0) {
+        endStats();
+        return {};
+    }
+
+    std::vector<llama_token> tokens = tokenizeTurn(prompt);
+    if (static_cast<int>(tokens.size()) + width * config.max_tokens > config.ctx) {
+        throw std::runtime_error("Prompt and beams don't fit in the context");
+    }
+    ensureParallel(width);
+
+    int logits_row = 0;
+    if (tokens.empty() || !forkPrompt(tokens, 1, logits_row)) {
+        endStats();
+        return {};
+    }
+    llama_memory_t parallel_memory = llama_get_memory(parallel_ctx);
+
+    struct Beam {
+        Candidate candidate;
+        llama_seq_id seq;
+        int i_batch;
+    };
+    struct Expansion {
+        int parent;
+        llama_token token;
+        float logprob;  // Cumulative, including token
+    };
+
+    // All beams have the same length, so they share one position
+    int n_past = static_cast<int>(tokens.size());
+    std::vector<Beam> beams = {{Candidate(), 0, logits_row}};
+    std::vector<Beam> next_beams;
+    std::vector<Candidate> finished;
+    std::vector<Expansion> expansions;
+    expansions.reserve(static_cast<size_t>(width) * width);
+    std::vector<llama_token> top_tokens(width);
+    std::vector<float> top_values(width);
+    std::vector<int> seq_owner(width);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    for (int step = 0; step < config.max_tokens && !beams.empty(); step++) {
+        // The best continuations of any beam are among the top `width` of each one
+        expansions.clear();
+        {
+            PhaseTimer timer(stats.sample_ms);
+            for (int b = 0; b < static_cast<int>(beams.size()); b++) {
+                const float* logits = llama_get_logits_ith(parallel_ctx, beams[b].i_batch);
+                LogitStats logit_stats = computeLogitStats(logits, n_vocab);
+                const float norm = logit_stats.max + logit_stats.log_sum;
+                int k = topLogits(logits, n_vocab, width, top_tokens.data(), top_values.data());
+                for (int j = 0; j < k; j++) {
+                    expansions.push_back({b, top_tokens[j], beams[b].candidate.logprob + top_values[j] - norm});
+                }
+            }
+            std::sort(expansions.begin(), expansions.end(),
+                [](const Expansion& a, const Expansion& b) { return a.logprob > b.logprob; });
+        }
+
+        next_beams.clear();
+        for (const Expansion& e : expansions) {
+            if (static_cast<int>(next_beams.size()) == width) break;
+            if (isStopToken(e.token)) {
+                Candidate done = beams[e.parent].candidate;
+                done.logprob = e.logprob;
+                done.finished = true;
+                finished.push_back(std::move(done));
+                continue;
+            }
+            Beam beam = {beams[e.parent].candidate, beams[e.parent].seq, -1};
+            beam.candidate.logprob = e.logprob;
+            beam.candidate.tokens.push_back(e.token);
+            {
+                PhaseTimer timer(stats.detokenize_ms);
+                appendPiece(beam.candidate.text, e.token, beam.candidate.tokens.size() == 1);
+            }
+            next_beams.push_back(std::move(beam));
+        }
+
+        // Scores only go down, so once `width` finished replies beat every live beam it's over
+        std::sort(finished.begin(), finished.end(),
+            [](const Candidate& a, const Candidate& b) { return a.logprob > b.logprob; });
+        if (static_cast<int>(finished.size()) >= width &&
+            (next_beams.empty() || next_beams[0].candidate.logprob <= finished[width - 1].logprob)) {
+            beams.clear();
+            break;
+        }
+        if (next_beams.empty() || step + 1 == config.max_tokens || shouldAbort()) {
+            // Nothing left to decode: the new beams are complete as they are
+            interrupted = !next_beams.empty() && step + 1 < config.max_tokens;
+            beams.swap(next_beams);
+            break;
+        }
+
+        // The first child of a beam keeps its sequence, further children get a copy of it
+        // in a sequence nobody continues (a copy shares cells, it doesn't duplicate them)
+        std::fill(seq_owner.begin(), seq_owner.end(), -1);
+        for (int i = 0; i < static_cast<int>(next_beams.size()); i++) {
+            if (seq_owner[next_beams[i].seq] < 0) seq_owner[next_beams[i].seq] = i;
+        }
+        int free_seq = 0;
+        for (int i = 0; i < static_cast<int>(next_beams.size()); i++) {
+            if (seq_owner[next_beams[i].seq] == i) continue;
+            while (seq_owner[free_seq] >= 0) free_seq++;
+            seq_owner[free_seq] = i;
+            llama_memory_seq_rm(parallel_memory, free_seq, -1, -1);
+            llama_memory_seq_cp(parallel_memory, next_beams[i].seq, free_seq, -1, -1);
+            next_beams[i].seq = free_seq;
+        }
+        for (int seq = 0; seq < width; seq++) {
+            if (seq_owner[seq] < 0) llama_memory_seq_rm(parallel_memory, seq, -1, -1);
+        }
+
+        parallel_batch.n_tokens = 0;
+        for (Beam& beam : next_beams) {
+            int i = parallel_batch.n_tokens++;
+            parallel_batch.token[i] = beam.candidate.tokens.back();
+            parallel_batch.pos[i] = n_past;
+            parallel_batch.n_seq_id[i] = 1;
+            parallel_batch.seq_id[i][0] = beam.seq;
+            parallel_batch.logits[i] = true;
+            beam.i_batch = i;
+        }
+        n_past++;
+        stats.generated_tokens++;
+        if (stats.generated_tokens == 1) {
+            stats.first_token_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - call_start).count();
+        }
+
+        int ret;
+        {
+            PhaseTimer timer(stats.decode_ms);
+            stats.decode_calls++;
+            ret = llama_decode(parallel_ctx, parallel_batch);
+        }
+        if (ret == 2) {
+            interrupted = true;
+            beams.swap(next_beams);
+            break;
+        }
+        if (ret != 0) {
+            throw std::runtime_error("Failed to evaluate batch");
+        }
+        beams.swap(next_beams);
+    }
+
+    // Beams still open at max_tokens (or when stopped early) compete as they are
+    for (Beam& beam : beams) {
+        finished.push_back(std::move(beam.candidate));
+    }
+    std::stable_sort(finished.begin(), finished.end(),
+        [](const Candidate& a, const Candidate& b) { return a.logprob > b.logprob; });
+    if (static_cast<int>(finished.size()) > width) {
+        finished.resize(width);
+    }
+
+    llama_memory_clear(parallel_memory, true);
+    endStats();
+    return finished;
+}
+
+int Interface::generateTokens(const llama_token* tokens, int n_tokens, std::vector<llama_token>& out_tokens) {
+    // With nothing to evaluate the first sample would read missing or stale logits
+    if (tokens == nullptr || n_tokens <= 0) {
+        throw std::invalid_argument("generateTokens needs at least one input token");
+    }
+    out_tokens.clear();
+    out_tokens.reserve(config.max_tokens);
+
+    beginStats();
+    armCancellation();
+    bool completed = runGeneration(tokens, n_tokens, [&out_tokens](llama_token id) {
+        out_tokens.push_back(id);
+        return true;
+    });
+    endStats();
+    return completed ? static_cast<int>(out_tokens.size()) : -1;
+}
+
+int Interface::generateTokens(const llama_token* tokens, int n_tokens, llama_token* out_tokens, int out_capacity) {
+    if (tokens == nullptr || n_tokens <= 0) {
+        throw std::invalid_argument("generateTokens needs at least one input token");
+    }
+    int written = 0;
+    if (out_capacity <= 0) return 0;
+
+    beginStats();
+    armCancellation();
+    bool completed = runGeneration(tokens, n_tokens, [out_tokens, out_capacity, &written](llama_token id) {
+        out_tokens[written++] = id;
+        return written < out_capacity;
+    });
+    endStats();
+    return completed ? written : -1;
+}
+
+bool Interface::runGeneration(const llama_token* tokens, int n_tokens, const std::function<bool(llama_token)>& onTokenId) {
+    // Every reply starts at the grammar's root
+    if (grammar != NULL) {
+        llama_sampler_reset(grammar);
+    }
+
+    logprobs.clear();
+    if (config.logprobs) {
+        logprobs.reserve(std::max(config.max_tokens, 0));
+    }
+
+    // Remember where this turn starts so shifts can evict it as a whole later
+    while (!turn_starts.empty() && turn_starts.back() >= n_past) turn_starts.pop_back();
+    turn_starts.push_back(n_past);
+
+    // Skip whatever the KV cache already holds from a previous conversation
+    stats.prompt_tokens = n_tokens;
+    int reused = reuseCachedPrefix(tokens, n_tokens);
+    tokens += reused;
+    n_tokens -= reused;
+    stats.reused_tokens = reused;
+    stats.prefill_tokens = n_tokens;
+
+    if (n_tokens >= config.ctx) {
+        throw std::runtime_error("Prompt is longer than the context size");
+    }
+
+    // Manage context to make room for new tokens + generation
+    manageContext(n_tokens);
+
+    // Evaluate the new prompt tokens in n_batch sized chunks
+    {
+        PhaseTimer timer(stats.prefill_ms);
+        if (!prefillTokens(tokens, n_tokens)) {
+            return false;
+        }
+    }
+
+    int generated = 0;
+
+    // Hand one token to the caller, returns false once generation should end after it.
+    // id is always the token sampleToken() returned last, so last_logprob belongs to it.
+    auto emit = [&](llama_token id) {
+        generated++;
+        stats.generated_tokens = generated;
+        if (generated == 1) {
+            stats.first_token_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - call_start).count();
+        }
+        if (config.logprobs) {
+            logprobs.push_back(last_logprob);
+        }
+        bool keep_going = onTokenId(id);
+        return keep_going && generated < config.max_tokens;
+    };
+
+    // Each step decodes the pending token together with any drafted continuation and keeps
+    // the drafts the main model would have sampled itself. Without drafts this is plain
+    // one-token-at-a-time decoding.
+    llama_token id = config.max_tokens > 0 ? sampleToken(-1) : LLAMA_TOKEN_NULL;
+    while (id != LLAMA_TOKEN_NULL && !isStopToken(id)) {
+        if (shouldAbort()) {
+            interrupted = true;
+            break;
+        }
 
-    for (int i = 0; i < config.max_tokens && !should_stop; i++) {
         // Check if we're approaching context limit during generation
         if (n_past >= config.ctx - 2) {
-            std::cout << "Warning: Approaching context limit during generation" << std::endl;
+            int n_keep = std::max(config.n_sink, n_pinned);
+            if (!config.unbounded || n_past - n_keep < 4) {
+                std::cout << "Warning: Approaching context limit during generation" << std::endl;
+                break;
+            }
+            // Free half of the evictable span and keep going
+            shiftContext((n_past - n_keep) / 2);
+        }
+
+        if (!emit(id)) {
+            PhaseTimer timer(stats.decode_ms);
+            stats.decode_calls++;
+            evaluateTokens(&id, 1);  // Keep the history complete
+            break;
+        }
+
+        int max_draft = std::min(config.max_tokens - generated, config.ctx - 3 - n_past);
+        max_draft = std::min(max_draft, config.batch - 1);
+        {
+            PhaseTimer timer(stats.draft_ms);
+            draftTokens(id, max_draft);
+        }
+        bool decoded;
+        {
+            PhaseTimer timer(stats.decode_ms);
+            stats.decode_calls++;
+            decoded = decodeWithDraft(id);
+        }
+        if (!decoded) {
+            interrupted = true;
             break;
         }
 
-        std::string token_str = sampleTokens(should_stop, i == 0);
-        result += token_str;
+        n_past++;
+        token_history.push_back(id);
+
+        // Batch row i holds the main model's prediction after draft[i - 1]
+        bool done = false;
+        llama_token next = LLAMA_TOKEN_NULL;
+        int accepted = 0;
+        for (size_t i = 0; i <= draft.size(); i++) {
+            llama_token sampled = sampleToken(static_cast<int>(i));
+            if (i == draft.size() || sampled != draft[i]) {
+                next = sampled;
+                break;
+            }
+
+            accepted++;
+            if (isStopToken(sampled)) {
+                done = true;
+                break;
+            }
+            n_past++;
+            token_history.push_back(sampled);
+            if (!emit(sampled)) {
+                done = true;
+                break;
+            }
+        }
+
+        if (!draft.empty()) {
+            spec_stats.steps++;
+            spec_stats.drafted += static_cast<int>(draft.size());
+            spec_stats.accepted += accepted;
+
+            // Drop rejected drafts from both caches
+            llama_memory_seq_rm(memory, MAIN_SEQ, n_past, -1);
+            syncDraft(n_past);
+        }
+
+        if (done) break;
+        id = next;
     }
 
-    return result;
+    return true;
 }
@@ -4,9 +4,15 @@
 #include <string>
 #include <vector>
 #include <stdexcept>
-#include <deque>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
 
 #include "llama.h"
+#include "fused_sampler.h"
+#include "huge_pages.h"
 
 class Interface {
 public:
@@ -14,25 +20,216 @@ public:
         int ctx = 512;
         int batch = 512;
         int max_tokens = 64;
-        int threads = 4;
+        int threads = 4;                 // Decode threads
+        int threads_batch = 0;           // Prefill threads (0 = threads)
+        int ubatch = 0;                  // Tokens per compute pass of a prefill (0 = min(batch, 512))
+        bool autotune = false;           // Measure threads, ubatch and flash attention for this model
+                                         // and CPU on first load (cached in the config directory)
+        int prefill_chunk = 0;           // Prompt tokens per decode call (0 = batch size)
+        int timeout_ms = 0;              // Wall-clock limit for each generate call (0 = none)
 
         // KV cache management settings
         float cache_keep_ratio = 0.75f;  // Keep 75% of context when full
         int min_keep_tokens = 512;       // Always keep at least this many tokens
+        int n_sink = 4;                  // Leading tokens never evicted (attention sinks, BOS)
+        bool unbounded = true;           // Shift instead of stopping when generation fills the context
+        bool reuse_prefix = true;        // Keep KV after clearContext() and reuse the matching prefix
+
+        // KV cache storage: q8_0 halves it, q4_0 quarters it (also f32, bf16, q4_1, q5_0, q5_1,
+        // iq4_nl). A quantized V cache needs flash attention, auto turns it on for that.
+        ggml_type type_k = GGML_TYPE_F16;
+        ggml_type type_v = GGML_TYPE_F16;
+        llama_flash_attn_type flash_attn = LLAMA_FLASH_ATTN_TYPE_AUTO;
 
         int top_k = 50;
         float top_p = 0.9f;
         float temperature = 0.7f;
         uint32_t seed = LLAMA_DEFAULT_SEED;
+        bool fused_sampler = true;       // One-pass top-k/top-p/temperature, same draws as the separate stages
+
+        // Speculative decoding with a small model from the same family
+        std::string draft_model;         // Path to the draft GGUF, empty = off
+        int draft_tokens = 8;            // Tokens drafted per verification step
+        int lookup_ngram = 0;            // Draft by matching this many tokens against the history (0 = off)
+
+        // Per-token logprobs of the model's raw distribution (before top-k/top-p/temperature)
+        bool logprobs = false;
+        int top_logprobs = 0;            // Alternatives recorded per token (up to TokenLogprob::MAX_TOP)
+
+        // Constrained decoding, applied at construction (json_schema wins if both are set).
+        // Only the sampled token is checked; when it's rejected, the grammar masks the whole
+        // vocab and the chain samples again. Replies always match, but the draws differ from
+        // masking first: an accepted token was picked from the top-k/top-p cut of the full
+        // vocab, not of the tokens the grammar allows. check-grammar covers the fallback.
+        std::string grammar;             // GBNF with a "root" rule
+        std::string json_schema;
+
+        int n_parallel = 8;              // Sequences generateBatch() decodes together
+
+        // NUMA: pin this instance's compute threads to one node and load the weights into
+        // that node's memory (read, not mmap'd), e.g. one Interface per socket. Or set a ggml
+        // strategy for the whole process (distribute, isolate, numactl) - not both.
+        int numa_node = -1;              // -1 = threads float
+        ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
+
+        // Model loading
+        bool use_mmap = true;            // Map the file instead of reading it (off for numa_node)
+        bool use_mlock = false;          // Keep the weights resident, never paged out
+        bool warmup = true;              // One throwaway decode at load, so the first reply doesn't
+                                         // pay for page faults and graph setup
+        bool huge_pages = false;         // Linux: transparent huge pages for the KV cache, compute
+                                         // buffers and weights (see HugePageRegions). Loads
+                                         // in one process then take turns, not run in parallel
     };
     Config config;
 
+    struct SpeculativeStats {
+        int steps = 0;         // Verification batches run on the main model
+        int drafted = 0;       // Draft tokens proposed
+        int accepted = 0;      // Draft tokens the main model agreed with
+        float acceptanceRate() const { return drafted > 0 ? static_cast<float>(accepted) / drafted : 0.0f; }
+    };
+
+    // One entry per emitted token when config.logprobs is set. Fixed size, so recording
+    // them doesn't allocate in the decode loop.
+    struct TokenLogprob {
+        static const int MAX_TOP = 20;
+        llama_token token = LLAMA_TOKEN_NULL;
+        float logprob = 0.0f;
+        float entropy = 0.0f;       // Of the whole distribution, in nats
+        int n_top = 0;
+        llama_token top_tokens[MAX_TOP];  // Most likely alternatives, best first
+        float top_logprobs[MAX_TOP];
+    };
+
+    // Where the last generate/generateTokens call spent its time (milliseconds) and what it did
+    struct Stats {
+        double total_ms = 0.0;
+        double first_token_ms = 0.0;  // Call start to the first emitted token
+        double template_ms = 0.0;
+        double tokenize_ms = 0.0;
+        double prefill_ms = 0.0;
+        double decode_ms = 0.0;       // Main-model decodes after the prefill
+        double draft_ms = 0.0;        // Speculative drafting (draft model or n-gram lookup)
+        double sample_ms = 0.0;       // Including logprobs when enabled
+        double detokenize_ms = 0.0;
+        double shift_ms = 0.0;        // Context shifts, including any re-evaluation
+        int prompt_tokens = 0;
+        int reused_tokens = 0;        // Prompt tokens found in the KV cache
+        int prefill_tokens = 0;       // Prompt tokens actually evaluated
+        int generated_tokens = 0;
+        int decode_calls = 0;
+        int context_shifts = 0;
+        int kv_used = 0;              // Context usage when the call ended
+        int kv_size = 0;
+
+        double prefillTokensPerSec() const { return prefill_ms > 0.0 ? prefill_tokens * 1000.0 / prefill_ms : 0.0; }
+        double generatedTokensPerSec() const {
+            double ms = total_ms - first_token_ms;
+            return generated_tokens > 1 && ms > 0.0 ? (generated_tokens - 1) * 1000.0 / ms : 0.0;
+        }
+    };
+
+    // Cold start: what construction cost and how soon the first reply began (milliseconds)
+    struct LoadStats {
+        double model_ms = 0.0;        // Reading or mapping the weights
+        double warmup_ms = 0.0;
+        double ready_ms = 0.0;        // Construction start to end, both of the above included
+        double first_token_ms = 0.0;  // ready_ms + the first reply's time to first token (0 until then)
+    };
+
+    // One reply from generateN() / beamSearch()
+    struct Candidate {
+        std::string text;
+        std::vector<llama_token> tokens;
+        float logprob = 0.0f;   // Sum over its tokens, under the model's raw distribution
+        bool finished = false;  // Ended on a stop token rather than max_tokens
+    };
+
+    // Receives each piece of generated text as soon as it is sampled.
+    // Pieces always end on a UTF-8 character boundary. Return false to stop generating.
+    using TokenCallback = std::function<bool(const std::string& piece)>;
+
+    // Reported after every prefill chunk
+    struct PrefillProgress {
+        int processed = 0;          // Prompt tokens evaluated so far
+        int total = 0;              // Prompt tokens to evaluate in this call
+        float percent = 0.0f;
+        double tokens_per_sec = 0.0;
+    };
+    // Return false to cancel the rest of the prefill (generate() then returns an empty string)
+    using ProgressCallback = std::function<bool(const PrefillProgress& progress)>;
+
     void setMaxTokens(int tokens) { config.max_tokens = tokens; }
+    void setPrefillChunk(int tokens) { config.prefill_chunk = tokens; }
+    void setProgressCallback(ProgressCallback callback) { progressCallback = std::move(callback); }
+    void setTimeout(int milliseconds) { config.timeout_ms = milliseconds; }
+
+    // Safe to call from any thread. Stops the running generate call at the next decode
+    // step or prefill chunk (or inside a long decode); whatever was produced is returned.
+    // A call starts listening first thing, before formatting its prompt, so a cancel() made
+    // any time after that reaches it; one made before a call starts doesn't carry over.
+    void cancel() { cancel_requested = true; }
+    bool wasInterrupted() const { return interrupted; }  // Last call ended by cancel() or timeout
     void setPromptFormat(const std::string& promptFormat);
     void clearPromptFormat();
-    void clearContext();  // Method to clear KV cache
+    void clearContext();  // Start a new conversation (cached prefix is kept for reuse)
+    // Prepended to every new conversation and pinned - context shifts never evict it
+    void setSystemPrompt(const std::string& prompt) { systemPrompt = prompt; }
     int getContextUsage(); // Get current context usage
     int getContextSize();  // Get total context size
+    // Main context's KV cache worked out from n_ctx, layers and the K/V row sizes - not
+    // measured, so SWA layers, padding and recurrent state aren't accounted for
+    size_t estimateKvCacheBytes() const { return kv_estimate; }
+
+    // "f16", "q8_0", "q4_0", ... to a type usable for Config::type_k / type_v, throws otherwise
+    static ggml_type kvCacheType(const std::string& name);
+
+    // Snapshot the conversation (KV state, tokens, sampler settings) to disk and back.
+    // Relative paths are resolved inside FolderManager's cache directory.
+    bool saveSession(const std::string& path);
+    bool loadSession(const std::string& path);
+
+    // Attach a draft model for speculative decoding (must share the main model's vocab)
+    void loadDraftModel(const std::string& modelPath);
+    bool hasDraftModel() const { return draft_ctx != nullptr; }
+    SpeculativeStats getSpeculativeStats() const { return spec_stats; }
+    void resetSpeculativeStats() { spec_stats = SpeculativeStats(); }
+    // Draft-free speculation: copy what followed the last occurrence of the current n-gram
+    void setLookupDecoding(int ngram) { config.lookup_ngram = ngram; }
+
+    void setLogprobs(bool enabled, int top = 0) { config.logprobs = enabled; config.top_logprobs = top; }
+
+    const Stats& getStats() const { return stats; }
+    const LoadStats& getLoadStats() const { return load_stats; }
+    // Share of this instance's buffers backed by huge pages (all zero unless config.huge_pages)
+    HugePageCoverage getHugePageCoverage() const { return huge_pages.coverage(); }
+
+    // Starts reading a model file into the OS page cache on a background thread and returns
+    // straight away - call it while the app starts up, the load that follows then finds the
+    // pages cached. Skipped for files larger than the free memory.
+    static void prefetchModel(const std::string& modelPath);
+
+    // ggml_backend_load_all() once per process. It edits ggml's backend registry without a
+    // lock, so everything that loads models in parallel goes through here.
+    static void loadBackends();
+
+    // Constrain every following reply to a GBNF grammar or a JSON schema. Each distinct one
+    // is compiled once and cached. Throws std::runtime_error if it doesn't parse.
+    void setGrammar(const std::string& gbnf);
+    void setJsonSchema(const std::string& schema);
+    void clearGrammar();
+    // Tokens emitted by the last generate/generateTokens call (empty unless config.logprobs)
+    const std::vector<TokenLogprob>& getLogprobs() const { return logprobs; }
+
+    // How embed() reduces a text's token states to one vector
+    enum class Pooling { Mean, Cls, Last };
+    int getEmbeddingSize() const { return llama_model_n_embd(model); }
+    // Writes texts.size() * getEmbeddingSize() floats to out, row i for texts[i]. Texts are
+    // packed as parallel sequences into as few decode calls as the batch size allows, on a
+    // separate embeddings context (created on first use, the conversation is untouched).
+    // Throws std::runtime_error if a text is empty or longer than config.batch tokens.
+    void embed(const std::vector<std::string>& texts, float* out, Pooling pooling = Pooling::Mean, bool normalize = true);
 
     Interface(const std::string& modelPath);
     Interface(const std::string& modelPath, Config config);
@@ -40,38 +237,191 @@ public:
 
     // Main inference method - maintains context across calls
     std::string generate(const std::string& prompt);
+    // Streaming variant - calls onToken for every piece, still returns the full reply
+    std::string generate(const std::string& prompt, const TokenCallback& onToken);
+
+    // Independent single-turn replies, in prompt order. The system prompt and chat template
+    // apply as in generate(), the conversation doesn't. Up to config.n_parallel prompts share
+    // every decode call and a finished one is replaced by the next prompt straight away.
+    // Runs on its own context of config.ctx cells (created on first use), so the
+    // conversation's KV cache is untouched. Cancel/timeout return what was produced so far.
+    std::vector<std::string> generateBatch(const std::vector<std::string>& prompts);
+    void setParallel(int sequences);
+
+    // n sampled replies to one prompt, most likely first. The prompt is prefilled once and
+    // shared by all branches (llama_memory_seq_cp), every step decodes all of them together.
+    // Same context, system prompt and template handling as generateBatch().
+    std::vector<Candidate> generateN(const std::string& prompt, int n);
+    // Deterministic beam search keeping `width` beams, best cumulative logprob first.
+    // The grammar doesn't apply here. Throws if prompt + width * max_tokens exceeds the context.
+    std::vector<Candidate> beamSearch(const std::string& prompt, int width);
+
+    // Token-level generation for callers that already hold token ids. The input goes
+    // through the same context management as generate(); accepted tokens are written to
+    // out_tokens (its capacity is reused across calls). Returns the number generated,
+    // or -1 if the prefill was cancelled. Throws std::invalid_argument if n_tokens <= 0.
+    int generateTokens(const llama_token* tokens, int n_tokens, std::vector<llama_token>& out_tokens);
+    // Same, into a caller-owned buffer - stops once out_capacity tokens are written
+    int generateTokens(const llama_token* tokens, int n_tokens, llama_token* out_tokens, int out_capacity);
+
+    std::vector<llama_token> tokenize(const std::string& text, bool add_bos = true, bool parse_special = false);
+    std::string detokenize(const llama_token* tokens, int n_tokens);
+
+    // Length of the longest prefix of text that doesn't end in a split UTF-8 character
+    static size_t completeUtf8Length(const std::string& text);
+
+    // Token that opens the next role in chatTemplate (e.g. <|im_start|>), generation stops on
+    // it like on EOG. LLAMA_TOKEN_NULL if the template has no known marker.
+    static llama_token roleMarkerToken(const llama_vocab* vocab, const std::string& chatTemplate);
 
 private:
     llama_context* ctx = nullptr;
     llama_model* model = nullptr;
     const llama_vocab* vocab = nullptr;
     llama_sampler* sampler = nullptr;
+    bool fused_chain = false;          // sampler is [fused stage, dist]
+    FusedSamplerParams fused_params;
     llama_memory_t memory = nullptr;
+    llama_batch batch = {};            // Reused by every main-model decode (prefill chunks, verification)
+    std::vector<llama_token_data> candidates;  // Sampling scratch, one entry per vocab token
+
+    // Draft model state - its KV mirrors token_history[0, draft_n_past)
+    llama_model* draft_model = nullptr;
+    llama_context* draft_ctx = nullptr;
+    llama_sampler* draft_sampler = nullptr;
+    llama_memory_t draft_memory = nullptr;
+    int draft_n_past = 0;
+    int draft_vocab = 0;                    // Ids both vocabularies have, [0, draft_vocab)
+    std::vector<llama_token> draft;         // Tokens proposed for the current step
+    std::vector<llama_token> draft_pending; // History the draft model hasn't seen yet
+    SpeculativeStats spec_stats;
+
+    llama_sampler* grammar = nullptr;       // Active constraint, owned by grammar_cache
+    std::unordered_map<uint64_t, llama_sampler*> grammar_cache;  // Compiled grammars by source hash
+
+    // generateBatch() state, one slot per sequence of parallel_ctx
+    struct ParallelSlot {
+        int prompt = -1;                  // Index of the prompt being answered, -1 = free
+        size_t prompt_pos = 0;            // Prompt tokens decoded so far
+        int n_past = 0;
+        int generated = 0;
+        int reserved = 0;                 // KV cells set aside: prompt + max_tokens
+        llama_token last_token = LLAMA_TOKEN_NULL;
+        int i_batch = -1;                 // Logits row in the current batch
+        llama_sampler* sampler = nullptr;
+        llama_sampler* constraint = nullptr;  // Clone of the active grammar for this call
+    };
+    llama_context* parallel_ctx = nullptr;
+    llama_batch parallel_batch = {};
+    std::vector<ParallelSlot> parallel_slots;
+    void initParallel();
+    void freeParallel();
+    void ensureParallel(int sequences);  // At least this many slots
+    // Prefills sequence 0 and shares it with sequences 1..n-1. False if cancelled.
+    bool forkPrompt(const std::vector<llama_token>& tokens, int n, int& logits_row);
+    std::vector<llama_token> tokenizeTurn(const std::string& prompt);  // System prompt + template
+
+    // Embeddings context - recreated when the pooling changes, since llama.cpp fixes it per context
+    llama_context* embed_ctx = nullptr;
+    llama_batch embed_batch = {};
+    Pooling embed_pooling = Pooling::Mean;
+    static const int EMBED_MAX_SEQS = 64;   // Texts per decode call
+    void initEmbeddings(Pooling pooling);
+
+    std::vector<TokenLogprob> logprobs;     // Reserved for max_tokens at the start of each call
+    TokenLogprob last_logprob;              // For the token sampleToken() returned last
+
+    // Prompt lookup index: n-gram hash -> history position right after its latest occurrence.
+    // Open addressing over a table sized for a full context, so indexing never allocates.
+    struct NgramSlot {
+        uint64_t hash;
+        int end;               // 0 = empty slot (n-grams always end past position 0)
+    };
+    std::vector<NgramSlot> ngram_index;
+    int ngram_indexed = 0;    // History positions covered by the index
+    int ngram_size = 0;       // lookup_ngram the index was built with
 
     bool formatPrompt = false;
     bool hasTemplate = false;
     std::string chatTemplate;  // Store the chat template string
     llama_token stop_token = LLAMA_TOKEN_NULL;  // Stop token for chat templates
+    std::string systemPrompt;
+    ProgressCallback progressCallback;
+
+    Stats stats;
+    LoadStats load_stats;
+    void warmupContext();
+    std::chrono::steady_clock::time_point call_start;
+    void beginStats();
+    void endStats();
+
+    // Cancellation, checked between decode steps and by llama.cpp's abort callback
+    std::atomic<bool> cancel_requested{false};  // One word, a single store on either side
+    std::chrono::steady_clock::time_point deadline;
+    bool has_deadline = false;
+    bool interrupted = false;
 
     // KV cache state tracking
-    int n_past = 0;                    // Current position in context
-    std::deque<llama_token> token_history;  // Track all tokens for context management
+    int n_past = 0;                    // Current position in context (end of the conversation)
+    std::vector<llama_token> token_history;  // Tokens in the KV cache, may run past n_past after clearContext()
+                                             // (capacity reserved for a full context up front)
     static const llama_seq_id MAIN_SEQ = 0; // Main sequence ID
+    int n_pinned = 0;                  // Leading tokens (system prompt) that shifts must keep
+    std::vector<int> turn_starts;      // Position where each generate call's input begins
+
+    size_t kv_estimate = 0;  // See estimateKvCacheBytes()
+
+    // Compute threads pinned to config.numa_node, shared by every context of this instance
+    ggml_threadpool* threadpool = nullptr;
+    ggml_threadpool* threadpool_batch = nullptr;
+    void attachThreadpools(llama_context* context);
+
+    HugePageRegions huge_pages;          // Buffers allocated since construction began
+    void applyCacheParams(llama_context_params& params);  // Validated KV types + flash attention
 
     void loadModel(const std::string& modelPath);     // Pure model loading
+    static llama_model* loadModelFile(const std::string& modelPath, const Config& config);
     void setThreadDefaults();                         // Set default thread count
+    void applyAutotune(const std::string& modelPath); // Cached or measured host settings into config
+    int prefillThreads() const { return config.threads_batch > 0 ? config.threads_batch : config.threads; }
+    int ubatchSize() const { return std::min(config.batch, config.ubatch > 0 ? config.ubatch : 512); }
     void initializeContext();  // Context and sampler setup
+    llama_sampler* createSampler(uint32_t seed);      // Sampler chain from config
+    llama_sampler* compileGrammar(const std::string& source, bool is_schema);  // Cached
     std::string applyChatTemplate(const std::string& userMessage);
+    std::string applyChatTemplate(const std::vector<llama_chat_message>& messages, bool add_assistant);
+    static std::string resolveSessionPath(const std::string& path);
 
     // Enhanced context management
-    void manageContext(const std::vector<llama_token>& new_tokens);
-    void shiftContext(int tokens_to_remove);
+    void manageContext(int n_new_tokens);
+    void shiftContext(int tokens_to_remove);  // Evicts whole old turns after the pinned span
     bool canFitTokens(int num_tokens);
+    int reuseCachedPrefix(const llama_token* tokens, int n_tokens);  // Returns tokens to skip
+
+    // Speculative decoding
+    void draftTokens(llama_token id, int max_draft);  // Fills draft
+    void lookupTokens(llama_token id, int n_draft);   // Fills draft from the n-gram index
+    void syncDraft(int n_valid);                      // Drop draft state past n_valid (0 = everything)
+    void clearNgramIndex();
+    bool decodeWithDraft(llama_token id);             // id + draft at n_past, logits for every position
 
     // Helper methods
-    std::string sampleTokens(bool& should_stop, bool is_first);
-    std::vector<llama_token> tokenize(const std::string& text, bool add_bos = true, bool parse_special = false);
-    void evaluateTokens(const std::vector<llama_token>& tokens);
+    llama_token sampleToken(int idx);
+    void computeLogprob(int idx, llama_token id);     // Fills last_logprob from the logits row
+    // Same as llama_sampler_sample, optionally restricted to tokens the constraint accepts
+    llama_token sampleFrom(llama_sampler* chain, llama_context* context, int idx, llama_sampler* constraint = nullptr);
+    bool isStopToken(llama_token id);
+    void appendPiece(std::string& out, llama_token id, bool is_first);
+    bool evaluateTokens(const std::vector<llama_token>& tokens);  // False if aborted
+    bool evaluateTokens(const llama_token* tokens, int n_tokens);
+    bool shouldAbort();
+    void armCancellation();  // Starts a new call for cancel() and its timeout, first thing in every public entry
+    static bool abortCallback(void* data);
+    void syncWithMemory();  // Trim history to what survived an aborted decode
+    bool prefillTokens(const llama_token* tokens, int n_tokens);  // Chunked, false if cancelled
+    // Prefill + decode loop shared by generate() and generateTokens(). onTokenId sees every
+    // accepted token and returns false to stop after it. False if the prefill was cancelled.
+    bool runGeneration(const llama_token* tokens, int n_tokens, const std::function<bool(llama_token)>& onTokenId);
 };
 
 #endif // INTERFACE_H
@@ -0,0 +1,507 @@
+#include "json_schema.h"
+#include <vector>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+struct JsonValue {
+    enum Type { Null, Bool, Number, String, Array, Object };
+    Type type = Null;
+    bool boolean = false;
+    std::string text;  // String contents, or a number as written
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue* get(const std::string& key) const {
+        if (type != Object) return nullptr;
+        for (const auto& member : members) {
+            if (member.first == key) return &member.second;
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(const std::string& text) : text(text) {}
+
+    JsonValue parse() {
+        JsonValue result = value();
+        skipSpace();
+        if (pos != text.size()) fail("unexpected trailing characters");
+        return result;
+    }
+
+private:
+    const std::string& text;
+    size_t pos = 0;
+
+    [[noreturn]] void fail(const std::string& message) {
+        throw std::runtime_error("Invalid JSON schema at offset " + std::to_string(pos) + ": " + message);
+    }
+
+    void skipSpace() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) pos++;
+    }
+
+    bool consume(const char* literal) {
+        size_t len = std::char_traits<char>::length(literal);
+        if (text.compare(pos, len, literal) != 0) return false;
+        pos += len;
+        return true;
+    }
+
+    JsonValue value() {
+        skipSpace();
+        if (pos >= text.size()) fail("unexpected end of input");
+
+        JsonValue result;
+        char c = text[pos];
+        if (c == '{') {
+            result.type = JsonValue::Object;
+            pos++;
+            skipSpace();
+            if (consume("}")) return result;
+            do {
+                skipSpace();
+                std::string key = string();
+                skipSpace();
+                if (!consume(":")) fail("expected ':'");
+                result.members.emplace_back(std::move(key), value());
+                skipSpace();
+            } while (consume(","));
+            if (!consume("}")) fail("expected '}'");
+        } else if (c == '[') {
+            result.type = JsonValue::Array;
+            pos++;
+            skipSpace();
+            if (consume("]")) return result;
+            do {
+                result.items.push_back(value());
+                skipSpace();
+            } while (consume(","));
+            if (!consume("]")) fail("expected ']'");
+        } else if (c == '"') {
+            result.type = JsonValue::String;
+            result.text = string();
+        } else if (consume("true")) {
+            result.type = JsonValue::Bool;
+            result.boolean = true;
+        } else if (consume("false")) {
+            result.type = JsonValue::Bool;
+        } else if (consume("null")) {
+            result.type = JsonValue::Null;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            size_t start = pos++;
+            while (pos < text.size() && (isdigit(static_cast<unsigned char>(text[pos])) ||
+                   text[pos] == '.' || text[pos] == 'e' || text[pos] == 'E' || text[pos] == '+' || text[pos] == '-')) pos++;
+            result.type = JsonValue::Number;
+            result.text = text.substr(start, pos - start);
+        } else {
+            fail("unexpected character");
+        }
+        return result;
+    }
+
+    unsigned hex4() {
+        if (pos + 4 > text.size()) fail("truncated \\u escape");
+        unsigned code = 0;
+        for (int i = 0; i < 4; i++) {
+            char h = text[pos++];
+            code <<= 4;
+            if (h >= '0' && h <= '9') code |= h - '0';
+            else if (h >= 'a' && h <= 'f') code |= h - 'a' + 10;
+            else if (h >= 'A' && h <= 'F') code |= h - 'A' + 10;
+            else fail("bad \\u escape");
+        }
+        return code;
+    }
+
+    static void appendUtf8(std::string& out, unsigned code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    std::string string() {
+        if (!consume("\"")) fail("expected a string");
+        std::string out;
+        while (true) {
+            if (pos >= text.size()) fail("unterminated string");
+            char c = text[pos++];
+            if (c == '"') break;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size()) fail("unterminated escape");
+            char e = text[pos++];
+            switch (e) {
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    unsigned code = hex4();
+                    if (code >= 0xD800 && code < 0xDC00 && consume("\\u")) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (hex4() - 0xDC00);
+                    }
+                    appendUtf8(out, code);
+                    break;
+                }
+                default: out += e; break;
+            }
+        }
+        return out;
+    }
+};
+
+// Compact serialization - enum/const values have to come out exactly like this
+std::string toJson(const JsonValue& value) {
+    switch (value.type) {
+        case JsonValue::Null: return "null";
+        case JsonValue::Bool: return value.boolean ? "true" : "false";
+        case JsonValue::Number: return value.text;
+        case JsonValue::String: {
+            std::string out = "\"";
+            for (unsigned char c : value.text) {
+                if (c == '"') out += "\\\"";
+                else if (c == '\\') out += "\\\\";
+                else if (c == '\n') out += "\\n";
+                else if (c == '\r') out += "\\r";
+                else if (c == '\t') out += "\\t";
+                else if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else out += static_cast<char>(c);
+            }
+            return out + "\"";
+        }
+        case JsonValue::Array: {
+            std::string out = "[";
+            for (size_t i = 0; i < value.items.size(); i++) {
+                if (i > 0) out += ",";
+                out += toJson(value.items[i]);
+            }
+            return out + "]";
+        }
+        case JsonValue::Object: {
+            std::string out = "{";
+            for (size_t i = 0; i < value.members.size(); i++) {
+                if (i > 0) out += ",";
+                JsonValue key;
+                key.type = JsonValue::String;
+                key.text = value.members[i].first;
+                out += toJson(key) + ":" + toJson(value.members[i].second);
+            }
+            return out + "}";
+        }
+    }
+    return "null";
+}
+
+std::string gbnfLiteral(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"') out += "\\\"";
+        else if (c == '\\') out += "\\\\";
+        else if (c == '\n') out += "\\n";
+        else if (c == '\r') out += "\\r";
+        else if (c == '\t') out += "\\t";
+        else out += c;
+    }
+    return out + "\"";
+}
+
+std::string repetition(int min, int max) {
+    if (max < 0) return min == 0 ? "*" : (min == 1 ? "+" : "{" + std::to_string(min) + ",}");
+    return "{" + std::to_string(min) + "," + std::to_string(max) + "}";
+}
+
+// Counts (minLength, maxItems, ...) - any JSON number spelling of a non-negative integer, so 1e3 too
+int intField(const JsonValue& schema, const char* key, int fallback) {
+    const JsonValue* field = schema.get(key);
+    if (!field || field->type != JsonValue::Number) return fallback;
+    const double value = std::strtod(field->text.c_str(), nullptr);
+    if (!(value >= 0.0 && value <= std::numeric_limits<int>::max()) || value != std::floor(value)) {
+        throw std::runtime_error(std::string(key) + " must be an integer from 0 to " +
+                                 std::to_string(std::numeric_limits<int>::max()) + ", got " + field->text);
+    }
+    return static_cast<int>(value);
+}
+
+// Shared rules, same shape as llama.cpp's grammars/json.gbnf
+const std::map<std::string, std::pair<std::string, std::vector<std::string>>> PRIMITIVES = {
+    {"space", {R"(| " " | "\n" [ \t]{0,20})", {}}},
+    {"boolean", {R"(("true" | "false") space)", {"space"}}},
+    {"null", {R"("null" space)", {"space"}}},
+    {"decimal-part", {R"([0-9]{1,16})", {}}},
+    {"integral-part", {R"([0] | [1-9] [0-9]{0,15})", {}}},
+    {"integer", {R"(("-"? integral-part) space)", {"integral-part", "space"}}},
+    {"number", {R"(("-"? integral-part) ("." decimal-part)? ([eE] [-+]? integral-part)? space)",
+                {"integral-part", "decimal-part", "space"}}},
+    {"char", {R"([^"\\\x7F\x00-\x1F] | [\\] (["\\bfnrt] | "u" [0-9a-fA-F]{4}))", {}}},
+    {"string", {R"("\"" char* "\"" space)", {"char", "space"}}},
+    {"object", {R"("{" space ( string ":" space value ("," space string ":" space value)* )? "}" space)",
+                {"string", "value", "space"}}},
+    {"array", {R"("[" space ( value ("," space value)* )? "]" space)", {"value", "space"}}},
+    {"value", {R"(object | array | string | number | boolean | null)",
+               {"object", "array", "string", "number", "boolean", "null"}}},
+};
+
+class SchemaConverter {
+public:
+    explicit SchemaConverter(const JsonValue& root) : root(root) {}
+
+    std::string convert() {
+        std::string top = visit(root, "root");
+        if (top != "root") {
+            rules.insert(rules.begin(), {"root", top});  // Top-level $ref
+        }
+        std::string grammar;
+        for (const auto& rule : rules) {
+            grammar += rule.first + " ::= " + rule.second + "\n";
+        }
+        return grammar;
+    }
+
+private:
+    const JsonValue& root;
+    std::vector<std::pair<std::string, std::string>> rules;  // In output order
+    std::set<std::string> names;
+    std::map<std::string, std::string> refs;  // $ref -> rule name
+
+    std::string reserveName(const std::string& hint) {
+        std::string name;
+        for (char c : hint) {
+            name += isalnum(static_cast<unsigned char>(c)) ? c : '-';
+        }
+        std::string unique = name;
+        for (int i = 1; names.count(unique) || PRIMITIVES.count(unique); i++) {
+            unique = name + std::to_string(i);
+        }
+        names.insert(unique);
+        return unique;
+    }
+
+    std::string primitive(const std::string& name) {
+        if (names.insert(name).second) {
+            const auto& rule = PRIMITIVES.at(name);
+            rules.emplace_back(name, rule.first);
+            for (const auto& dep : rule.second) primitive(dep);
+        }
+        return name;
+    }
+
+    const JsonValue& resolve(const std::string& ref) {
+        if (ref.compare(0, 1, "#") != 0) {
+            throw std::runtime_error("Only local $ref is supported: " + ref);
+        }
+        const JsonValue* node = &root;
+        size_t start = 2;
+        while (start <= ref.size() && ref.size() > 1) {
+            size_t end = ref.find('/', start);
+            std::string key = ref.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            for (size_t p; (p = key.find("~1")) != std::string::npos; ) key.replace(p, 2, "/");
+            for (size_t p; (p = key.find("~0")) != std::string::npos; ) key.replace(p, 2, "~");
+            node = node->get(key);
+            if (!node) throw std::runtime_error("Unresolved $ref: " + ref);
+            if (end == std::string::npos) break;
+            start = end + 1;
+        }
+        return *node;
+    }
+
+    // Adds a rule for schema and returns its name
+    std::string visit(const JsonValue& schema, const std::string& hint) {
+        if (const JsonValue* ref = schema.get("$ref")) {
+            auto it = refs.find(ref->text);
+            if (it != refs.end()) return it->second;  // Also ends recursion
+            std::string name = reserveName("ref-" + ref->text.substr(ref->text.rfind('/') + 1));
+            refs[ref->text] = name;
+            size_t slot = rules.size();
+            rules.emplace_back(name, "");
+            std::string body = expression(resolve(ref->text), name);
+            rules[slot].second = body;
+            return name;
+        }
+
+        std::string name = reserveName(hint);
+        size_t slot = rules.size();
+        rules.emplace_back(name, "");
+        std::string body = expression(schema, name);
+        rules[slot].second = body;
+        return name;
+    }
+
+    std::string alternatives(const std::vector<std::string>& options) {
+        std::string out;
+        for (size_t i = 0; i < options.size(); i++) {
+            if (i > 0) out += " | ";
+            out += options[i];
+        }
+        return options.size() > 1 ? "(" + out + ")" : out;
+    }
+
+    std::string expression(const JsonValue& schema, const std::string& name) {
+        if (schema.type == JsonValue::Bool || (schema.type == JsonValue::Object && schema.members.empty())) {
+            return primitive("value");
+        }
+        if (schema.type != JsonValue::Object) {
+            throw std::runtime_error("A schema must be an object or a boolean");
+        }
+
+        if (schema.get("$ref")) {
+            return visit(schema, name + "-ref");
+        }
+        if (const JsonValue* value = schema.get("const")) {
+            return gbnfLiteral(toJson(*value)) + " " + primitive("space");
+        }
+        if (const JsonValue* values = schema.get("enum")) {
+            std::vector<std::string> options;
+            for (const auto& value : values->items) options.push_back(gbnfLiteral(toJson(value)));
+            return alternatives(options) + " " + primitive("space");
+        }
+        const JsonValue* any = schema.get("anyOf");
+        if (!any) any = schema.get("oneOf");
+        if (any) {
+            std::vector<std::string> options;
+            for (size_t i = 0; i < any->items.size(); i++) {
+                options.push_back(visit(any->items[i], name + "-" + std::to_string(i)));
+            }
+            return alternatives(options);
+        }
+
+        const JsonValue* type = schema.get("type");
+        if (type && type->type == JsonValue::Array) {
+            std::vector<std::string> options;
+            for (const auto& single : type->items) {
+                JsonValue narrowed = schema;
+                for (auto& member : narrowed.members) {
+                    if (member.first == "type") member.second = single;
+                }
+                options.push_back(visit(narrowed, name + "-" + single.text));
+            }
+            return alternatives(options);
+        }
+
+        std::string kind = type ? type->text : "";
+        if (kind.empty()) {
+            if (schema.get("properties")) kind = "object";
+            else if (schema.get("items")) kind = "array";
+            else return primitive("value");
+        }
+
+        if (kind == "object") return objectExpression(schema, name);
+        if (kind == "array") return arrayExpression(schema, name);
+        if (kind == "string") {
+            int min = intField(schema, "minLength", 0);
+            int max = intField(schema, "maxLength", -1);
+            if (min == 0 && max < 0) return primitive("string");
+            return "\"\\\"\" " + primitive("char") + repetition(min, max) + " \"\\\"\" " + primitive("space");
+        }
+        if (kind == "number" || kind == "integer" || kind == "boolean" || kind == "null") {
+            return primitive(kind);
+        }
+        throw std::runtime_error("Unsupported schema type: " + kind);
+    }
+
+    std::string objectExpression(const JsonValue& schema, const std::string& name) {
+        const JsonValue* properties = schema.get("properties");
+        if (!properties || properties->members.empty()) {
+            return properties ? "\"{\" " + primitive("space") + " \"}\" space" : primitive("object");
+        }
+
+        std::set<std::string> required;
+        if (const JsonValue* list = schema.get("required")) {
+            for (const auto& key : list->items) required.insert(key.text);
+        }
+
+        // "key" space ":" space value
+        std::vector<std::string> required_kv, optional_kv;
+        for (const auto& property : properties->members) {
+            JsonValue key;
+            key.type = JsonValue::String;
+            key.text = property.first;
+            std::string kv = gbnfLiteral(toJson(key)) + " space \":\" space " +
+                             visit(property.second, name + "-" + property.first);
+            (required.count(property.first) ? required_kv : optional_kv).push_back(kv);
+        }
+
+        std::string body = "\"{\" " + primitive("space");
+        if (!required_kv.empty()) {
+            for (size_t i = 0; i < required_kv.size(); i++) {
+                body += (i > 0 ? " \",\" space " : " ") + required_kv[i];
+            }
+            for (const auto& kv : optional_kv) {
+                body += " (\",\" space " + kv + ")?";
+            }
+        } else {
+            // Pick the first optional property present, any later ones may follow it
+            std::vector<std::string> starts;
+            for (size_t i = 0; i < optional_kv.size(); i++) {
+                std::string start = optional_kv[i];
+                for (size_t j = i + 1; j < optional_kv.size(); j++) {
+                    start += " (\",\" space " + optional_kv[j] + ")?";
+                }
+                starts.push_back(optional_kv.size() > 1 ? "(" + start + ")" : start);
+            }
+            std::string options;
+            for (size_t i = 0; i < starts.size(); i++) {
+                options += (i > 0 ? " | " : "") + starts[i];
+            }
+            body += " (" + options + ")?";
+        }
+        return body + " \"}\" space";
+    }
+
+    std::string arrayExpression(const JsonValue& schema, const std::string& name) {
+        const JsonValue* items = schema.get("items");
+        std::string item = items ? visit(*items, name + "-item") : primitive("value");
+        primitive("space");
+
+        int min = intField(schema, "minItems", 0);
+        int max = intField(schema, "maxItems", -1);
+        std::string body = "\"[\" space ";
+        if (max == 0) {
+            return body + "\"]\" space";
+        }
+        std::string rest = "(\",\" space " + item + ")" + repetition(std::max(min - 1, 0), max < 0 ? -1 : max - 1);
+        if (min == 0) {
+            body += "(" + item + " " + rest + ")?";
+        } else {
+            body += item + " " + rest;
+        }
+        return body + " \"]\" space";
+    }
+};
+
+} // namespace
+
+std::string jsonSchemaToGrammar(const std::string& schema) {
+    JsonValue root = JsonParser(schema).parse();
+    return SchemaConverter(root).convert();
+}
@@ -0,0 +1,14 @@
+#ifndef JSON_SCHEMA_H
+#define JSON_SCHEMA_H
+
+#include <string>
+
+// Converts a JSON schema into a GBNF grammar for llama_sampler_init_grammar (root rule "root").
+// Supported: type (including lists of types), properties/required, items, enum, const,
+// anyOf/oneOf, minLength/maxLength, and local $ref into definitions/$defs. Objects only
+// produce their listed properties, in order; optional ones may be left out from the end.
+// Throws std::runtime_error on malformed JSON, an unresolvable $ref or a length/count bound
+// that isn't a non-negative integer.
+std::string jsonSchemaToGrammar(const std::string& schema);
+
+#endif // JSON_SCHEMA_H
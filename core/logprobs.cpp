@@ -0,0 +1,236 @@
+#include "logprobs.h"
+#include <cmath>
+#include <algorithm>
+
+// x86 builds compile the AVX2 kernels with target attributes and pick them at runtime,
+// so the library doesn't need -mavx2. MSVC only gets them with /arch:AVX2.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LOGPROBS_AVX2 1
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+static bool hasAvx2() {
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+}
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#include <immintrin.h>
+#define LOGPROBS_AVX2 1
+#define AVX2_TARGET
+static bool hasAvx2() { return true; }
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define LOGPROBS_NEON 1
+#endif
+
+namespace {
+
+// exp() underflows below this; clamping also keeps -inf logits out of the entropy sum
+const float MIN_EXP_ARG = -87.3f;
+
+LogitStats finishStats(float max, float sum, float weighted) {
+    // H = -sum(p * log p) with p = exp(d) / sum, d = logit - max
+    LogitStats stats;
+    stats.max = max;
+    stats.log_sum = std::log(sum);
+    stats.entropy = std::max(0.0f, stats.log_sum - weighted / sum);
+    return stats;
+}
+
+void accumulateScalar(const float* logits, int begin, int end, float max, float& sum, float& weighted) {
+    for (int i = begin; i < end; i++) {
+        float d = std::max(logits[i] - max, MIN_EXP_ARG);
+        float e = std::exp(d);
+        sum += e;
+        weighted += e * d;
+    }
+}
+
+LogitStats statsScalar(const float* logits, int n) {
+    float max = -INFINITY;
+    for (int i = 0; i < n; i++) max = std::max(max, logits[i]);
+    float sum = 0.0f, weighted = 0.0f;
+    accumulateScalar(logits, 0, n, max, sum, weighted);
+    return finishStats(max, sum, weighted);
+}
+
+// Sorted insert into the running top-k, values descending
+inline void insertTop(llama_token id, float value, int k, int& count, llama_token* tokens, float* values) {
+    if (count == k && value <= values[k - 1]) return;
+    int pos = count < k ? count++ : k - 1;
+    while (pos > 0 && values[pos - 1] < value) {
+        values[pos] = values[pos - 1];
+        tokens[pos] = tokens[pos - 1];
+        pos--;
+    }
+    values[pos] = value;
+    tokens[pos] = id;
+}
+
+#ifdef LOGPROBS_AVX2
+
+// Cephes-style exp: x = n*ln2 + r, degree-5 polynomial for exp(r), 2^n via the exponent bits
+AVX2_TARGET inline __m256 exp256(__m256 x) {
+    x = _mm256_max_ps(x, _mm256_set1_ps(MIN_EXP_ARG));
+    __m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(r, r), r);
+    y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+
+    __m256i n = _mm256_cvtps_epi32(fx);
+    n = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+}
+
+AVX2_TARGET inline float hsum256(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+AVX2_TARGET inline float hmax256(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+AVX2_TARGET LogitStats statsAvx2(const float* logits, int n) {
+    int i = 0;
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(logits + i));
+    }
+    float max = hmax256(vmax);
+    for (; i < n; i++) max = std::max(max, logits[i]);
+
+    const __m256 vm = _mm256_set1_ps(max);
+    const __m256 vmin = _mm256_set1_ps(MIN_EXP_ARG);
+    __m256 vsum = _mm256_setzero_ps();
+    __m256 vweighted = _mm256_setzero_ps();
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(logits + i), vm), vmin);
+        __m256 e = exp256(d);
+        vsum = _mm256_add_ps(vsum, e);
+        vweighted = _mm256_fmadd_ps(e, d, vweighted);
+    }
+    float sum = hsum256(vsum);
+    float weighted = hsum256(vweighted);
+    accumulateScalar(logits, i, n, max, sum, weighted);
+    return finishStats(max, sum, weighted);
+}
+
+// Only blocks with a value above the current k-th best go through the scalar insert
+AVX2_TARGET int topAvx2(const float* logits, int n, int k, llama_token* tokens, float* values) {
+    int count = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int mask = 0xFF;
+        if (count == k) {
+            __m256 gt = _mm256_cmp_ps(_mm256_loadu_ps(logits + i), _mm256_set1_ps(values[k - 1]), _CMP_GT_OQ);
+            mask = _mm256_movemask_ps(gt);
+        }
+        for (int j = 0; mask != 0; j++, mask >>= 1) {
+            if (mask & 1) insertTop(i + j, logits[i + j], k, count, tokens, values);
+        }
+    }
+    for (; i < n; i++) insertTop(i, logits[i], k, count, tokens, values);
+    return count;
+}
+
+#endif // LOGPROBS_AVX2
+
+#ifdef LOGPROBS_NEON
+
+inline float32x4_t exp128(float32x4_t x) {
+    x = vmaxq_f32(x, vdupq_n_f32(MIN_EXP_ARG));
+    float32x4_t fx = vrndnq_f32(vmulq_n_f32(x, 1.44269504088896341f));
+    float32x4_t r = vfmsq_n_f32(x, fx, 0.693359375f);
+    r = vfmsq_n_f32(r, fx, -2.12194440e-4f);
+
+    float32x4_t y = vdupq_n_f32(1.9875691500e-4f);
+    y = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), y, r);
+    y = vfmaq_f32(r, y, vmulq_f32(r, r));
+    y = vaddq_f32(y, vdupq_n_f32(1.0f));
+
+    int32x4_t n = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(fx), vdupq_n_s32(127)), 23);
+    return vmulq_f32(y, vreinterpretq_f32_s32(n));
+}
+
+LogitStats statsNeon(const float* logits, int n) {
+    int i = 0;
+    float32x4_t vmax = vdupq_n_f32(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        vmax = vmaxq_f32(vmax, vld1q_f32(logits + i));
+    }
+    float max = vmaxvq_f32(vmax);
+    for (; i < n; i++) max = std::max(max, logits[i]);
+
+    const float32x4_t vm = vdupq_n_f32(max);
+    const float32x4_t vmin = vdupq_n_f32(MIN_EXP_ARG);
+    float32x4_t vsum = vdupq_n_f32(0.0f);
+    float32x4_t vweighted = vdupq_n_f32(0.0f);
+    for (i = 0; i + 4 <= n; i += 4) {
+        float32x4_t d = vmaxq_f32(vsubq_f32(vld1q_f32(logits + i), vm), vmin);
+        float32x4_t e = exp128(d);
+        vsum = vaddq_f32(vsum, e);
+        vweighted = vfmaq_f32(vweighted, e, d);
+    }
+    float sum = vaddvq_f32(vsum);
+    float weighted = vaddvq_f32(vweighted);
+    accumulateScalar(logits, i, n, max, sum, weighted);
+    return finishStats(max, sum, weighted);
+}
+
+int topNeon(const float* logits, int n, int k, llama_token* tokens, float* values) {
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        if (count == k && vmaxvq_u32(vcgtq_f32(vld1q_f32(logits + i), vdupq_n_f32(values[k - 1]))) == 0) {
+            continue;
+        }
+        for (int j = 0; j < 4; j++) insertTop(i + j, logits[i + j], k, count, tokens, values);
+    }
+    for (; i < n; i++) insertTop(i, logits[i], k, count, tokens, values);
+    return count;
+}
+
+#endif // LOGPROBS_NEON
+
+} // namespace
+
+LogitStats computeLogitStats(const float* logits, int n_vocab) {
+    if (n_vocab <= 0) return LogitStats();
+#if defined(LOGPROBS_AVX2)
+    if (hasAvx2()) return statsAvx2(logits, n_vocab);
+#elif defined(LOGPROBS_NEON)
+    return statsNeon(logits, n_vocab);
+#endif
+    return statsScalar(logits, n_vocab);
+}
+
+int topLogits(const float* logits, int n_vocab, int k, llama_token* tokens, float* values) {
+    k = std::min(k, n_vocab);
+    if (k <= 0) return 0;
+#if defined(LOGPROBS_AVX2)
+    if (hasAvx2()) return topAvx2(logits, n_vocab, k, tokens, values);
+#elif defined(LOGPROBS_NEON)
+    return topNeon(logits, n_vocab, k, tokens, values);
+#endif
+    int count = 0;
+    for (int i = 0; i < n_vocab; i++) insertTop(i, logits[i], k, count, tokens, values);
+    return count;
+}
@@ -0,0 +1,19 @@
+#ifndef LOGPROBS_H
+#define LOGPROBS_H
+
+#include "llama.h"
+
+// Log-softmax over a row of raw logits. logprob(token) = logits[token] - max - log_sum.
+struct LogitStats {
+    float max = 0.0f;       // Largest logit
+    float log_sum = 0.0f;   // log(sum(exp(logit - max)))
+    float entropy = 0.0f;   // Of the softmax distribution, in nats
+};
+
+// Two passes over the vocab (max, then exp-sum), AVX2/FMA or NEON when the CPU has them
+LogitStats computeLogitStats(const float* logits, int n_vocab);
+
+// The k largest logits, best first. Returns how many were written (min(k, n_vocab)).
+int topLogits(const float* logits, int n_vocab, int k, llama_token* tokens, float* values);
+
+#endif // LOGPROBS_H
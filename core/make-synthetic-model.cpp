@@ -0,0 +1,53 @@
+// Writes a small random-weight GGUF for offline benchmarks and tests (see synthetic_model.h).
+//
+// Usage: make-synthetic-model <out.gguf> [--arch llama] [--vocab 1024] [--embd 256] [--layers 2]
+//                             [--heads 4] [--heads-kv 2] [--ff 512] [--ctx 4096] [--type f16] [--seed 42]
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include "synthetic_model.h"
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: make-synthetic-model <out.gguf> [--arch llama|qwen2] [--vocab N] [--embd N] "
+                     "[--layers N] [--heads N] [--heads-kv N] [--ff N] [--ctx N] [--type f16|q8_0|q4_K|...] [--seed N]"
+                  << std::endl;
+        return 2;
+    }
+
+    const std::string path = argv[1];
+    SyntheticModelParams params;
+    try {
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << std::endl;
+                return 2;
+            }
+            std::string value = argv[++i];
+            if (arg == "--arch") params.architecture = value;
+            else if (arg == "--vocab") params.n_vocab = std::atoi(value.c_str());
+            else if (arg == "--embd") params.n_embd = std::atoi(value.c_str());
+            else if (arg == "--layers") params.n_layer = std::atoi(value.c_str());
+            else if (arg == "--heads") params.n_head = std::atoi(value.c_str());
+            else if (arg == "--heads-kv") params.n_head_kv = std::atoi(value.c_str());
+            else if (arg == "--ff") params.n_ff = std::atoi(value.c_str());
+            else if (arg == "--ctx") params.n_ctx_train = std::atoi(value.c_str());
+            else if (arg == "--type") params.type = syntheticModelType(value);
+            else if (arg == "--seed") params.seed = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+            else {
+                std::cerr << "Unknown argument: " << arg << std::endl;
+                return 2;
+            }
+        }
+
+        writeSyntheticModel(path, params);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Wrote " << path << ": " << params.architecture << ", " << params.n_layer << " layers, n_embd "
+              << params.n_embd << ", vocab " << params.n_vocab << ", " << ggml_type_name(params.type) << std::endl;
+    return 0;
+}
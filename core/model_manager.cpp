@@ -1,10 +1,13 @@
 #include "../core/interface.h"
 #include "../core/folder_manager.h"
 #include "../core/model_manager.h"
+#include "../core/autotune.h"
+#include "../core/numa.h"
 #include <iostream>
 #include <stdexcept>
 #include <filesystem>
 #include <thread>
+#include <algorithm>
 
 namespace iamai {
 
@@ -39,8 +42,16 @@ bool ModelManager::switchModel(const std::string& model_name) {
             return false;
         }
 
+        // Held until the new model is in, so nothing is torn down unless the switch goes ahead
+        std::lock_guard<std::mutex> lock(router_mutex);
+        if (replicasInUse()) {
+            std::cerr << "Can't switch models while replicas are leased" << std::endl;
+            return false;
+        }
+
         std::cout << "....................................................................................." << std::endl;
         if (current_model) current_model.reset();
+        replicas.clear();
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
         auto new_model = std::make_unique<Interface>(model_path.string());
@@ -54,8 +65,119 @@ bool ModelManager::switchModel(const std::string& model_name) {
     }
 }
 
+void ModelManager::prefetchModel(const std::string& model_name) {
+    Interface::prefetchModel((models_dir / model_name).string());
+}
+
 Interface* ModelManager::getCurrentModel() {
     return current_model.get();
 }
 
+bool ModelManager::replicasInUse() const {
+    return std::any_of(replicas.begin(), replicas.end(),
+        [](const std::unique_ptr<Replica>& replica) { return replica->load > 0; });
+}
+
+bool ModelManager::loadReplicas(const std::string& model_name, Interface::Config config) {
+    std::filesystem::path model_path = models_dir / model_name;
+    if (!std::filesystem::exists(model_path)) {
+        std::cerr << "Model file not found: " << model_path.string() << std::endl;
+        return false;
+    }
+
+    // Held until the new replicas are in place: acquire() waits for them instead of leasing
+    // one that's about to go
+    std::lock_guard<std::mutex> lock(router_mutex);
+    if (replicasInUse()) {
+        std::cerr << "Can't reload replicas while they're leased" << std::endl;
+        return false;
+    }
+    current_model.reset();
+    replicas.clear();
+
+    std::vector<int> nodes = numaNodes();
+    if (nodes.size() == 1) nodes[0] = -1;  // Nothing to pin to
+    if (config.threads <= 0) {
+        config.threads = std::max(1, performanceCores() / static_cast<int>(nodes.size()));
+    }
+
+    std::vector<std::unique_ptr<Replica>> loaded(nodes.size());
+    std::vector<std::string> errors(nodes.size());
+    auto load = [&](size_t i, Interface::Config node_config) {
+        try {
+            node_config.numa_node = nodes[i];
+            auto replica = std::make_unique<Replica>();
+            replica->node = nodes[i];
+            replica->model = std::make_unique<Interface>(model_path.string(), node_config);
+            loaded[i] = std::move(replica);
+        } catch (const std::exception& e) {
+            errors[i] = e.what();
+        }
+    };
+
+    // Backends are registered once, before any loader runs. With autotune the first replica
+    // loads alone, so its probes have the cores to themselves and the cache file is written
+    // once; the others reuse its ubatch and flash attention. They keep their per-node thread
+    // share - replica 0's counts were tuned for its own node's CPUs.
+    Interface::loadBackends();
+    size_t first = 0;
+    if (config.autotune) {
+        load(0, config);
+        if (loaded[0]) {
+            const Interface::Config& tuned = loaded[0]->model->config;
+            config.ubatch = tuned.ubatch;
+            config.flash_attn = tuned.flash_attn;
+        }
+        config.autotune = false;
+        first = 1;
+    }
+
+    // The rest in parallel, each on its own thread, pinned by Interface to the replica's node
+    std::vector<std::thread> loaders;
+    for (size_t i = first; i < nodes.size() && errors[0].empty(); i++) {
+        loaders.emplace_back(load, i, config);
+    }
+    for (auto& loader : loaders) loader.join();
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!errors[i].empty()) {
+            std::cerr << "Error loading replica for NUMA node " << nodes[i] << ": " << errors[i] << std::endl;
+            return false;
+        }
+    }
+    replicas = std::move(loaded);
+    std::cout << "Loaded " << replicas.size() << " replica(s) of " << model_name << std::endl;
+    return true;
+}
+
+ModelManager::Lease ModelManager::acquire() {
+    Replica* best = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(router_mutex);
+        if (replicas.empty()) {
+            throw std::runtime_error("No replicas loaded");
+        }
+        for (auto& replica : replicas) {
+            if (best == nullptr || replica->load < best->load) best = replica.get();
+        }
+        best->load++;
+    }
+    return Lease(this, best);
+}
+
+ModelManager::Lease::Lease(ModelManager* manager, Replica* replica)
+    : manager(manager), replica(replica), lock(replica->mutex) {}
+
+ModelManager::Lease::Lease(Lease&& other) noexcept
+    : manager(other.manager), replica(other.replica), lock(std::move(other.lock)) {
+    other.replica = nullptr;
+}
+
+ModelManager::Lease::~Lease() {
+    if (replica == nullptr) return;
+    lock.unlock();
+    std::lock_guard<std::mutex> guard(manager->router_mutex);
+    replica->load--;
+}
+
 } // namespace iamai
@@ -4,6 +4,7 @@
 #include <filesystem>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include "../core/interface.h"
 #include "../core/folder_manager.h"
 
@@ -11,15 +12,57 @@ namespace iamai {
 
 class ModelManager {
 private:
+    // One copy of the model in a NUMA node's memory, its threads pinned to that node
+    struct Replica {
+        std::unique_ptr<Interface> model;
+        int node = -1;
+        int load = 0;       // Leases holding or waiting for it, guarded by router_mutex
+        std::mutex mutex;   // Held by the active lease - an Interface runs one call at a time
+    };
+
     std::filesystem::path models_dir;
     std::unique_ptr<Interface> current_model;
+    std::vector<std::unique_ptr<Replica>> replicas;
+    std::mutex router_mutex;
+    bool replicasInUse() const;  // Any lease held or waiting, call with router_mutex held
 
 public:
+    // Exclusive use of one replica until it goes out of scope
+    class Lease {
+    public:
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&&) = delete;
+        ~Lease();
+        Interface* operator->() const { return replica->model.get(); }
+        Interface& operator*() const { return *replica->model; }
+        int node() const { return replica->node; }
+
+    private:
+        friend class ModelManager;
+        Lease(ModelManager* manager, Replica* replica);
+        ModelManager* manager;
+        Replica* replica;
+        std::unique_lock<std::mutex> lock;
+    };
+
     ModelManager();
 
     std::vector<std::string> listModels();
     bool switchModel(const std::string& model_name);
+    // Background read of a model into the page cache, so a later switchModel() loads warm
+    void prefetchModel(const std::string& model_name);
     Interface* getCurrentModel();
+
+    // Loads one replica per NUMA node, in parallel, each reading its own copy of the weights
+    // into node-local memory. config.threads <= 0 gives each replica its share of the
+    // physical cores. On a single-node machine this is one unpinned instance. With
+    // config.autotune the first replica is tuned alone on its node and the rest use its ubatch
+    // and flash attention setting.
+    // Fails without touching the current replicas while any of them is leased.
+    bool loadReplicas(const std::string& model_name, Interface::Config config);
+    // The replica with the fewest active and waiting leases; blocks until it's free
+    Lease acquire();
+    int replicaCount() const { return static_cast<int>(replicas.size()); }
 };
 
 } // namespace iamai
@@ -0,0 +1,159 @@
+#include "numa.h"
+#include "llama.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <mutex>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace {
+
+std::mutex numa_mutex;
+bool numa_initialized = false;
+ggml_numa_strategy numa_strategy = GGML_NUMA_STRATEGY_DISABLED;
+
+#if defined(__linux__)
+
+std::string readLine(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+std::set<int> allowedCpus() {
+    std::set<int> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) cpus.insert(cpu);
+    }
+    return cpus;
+}
+
+#endif
+
+} // namespace
+
+std::set<int> parseCpuList(const std::string& list) {
+    std::set<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) cpus.insert(cpu);
+    }
+    return cpus;
+}
+
+std::vector<int> numaNodeCpus(int node) {
+    std::vector<int> cpus;
+#if defined(_WIN32)
+    GROUP_AFFINITY affinity = {};
+    if (node < 0 || !GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity)) return cpus;
+    for (int bit = 0; bit < 64; bit++) {
+        if (affinity.Mask & (KAFFINITY(1) << bit)) cpus.push_back(affinity.Group * 64 + bit);
+    }
+#elif defined(__linux__)
+    const std::set<int> allowed = allowedCpus();
+    for (int cpu : parseCpuList(readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))) {
+        if (allowed.count(cpu)) cpus.push_back(cpu);
+    }
+#else
+    (void)node;
+#endif
+    return cpus;
+}
+
+std::vector<int> numaNodes() {
+    std::vector<int> nodes;
+#if defined(_WIN32)
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest)) {
+        for (int node = 0; node <= static_cast<int>(highest); node++) {
+            if (!numaNodeCpus(node).empty()) nodes.push_back(node);
+        }
+    }
+#elif defined(__linux__)
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.rfind("node", 0) != 0 || name.size() == 4) continue;
+        const int node = std::atoi(name.c_str() + 4);
+        if (!numaNodeCpus(node).empty()) nodes.push_back(node);
+    }
+    std::sort(nodes.begin(), nodes.end());
+#endif
+    if (nodes.empty()) nodes.push_back(0);
+    return nodes;
+}
+
+void initNumaStrategy(ggml_numa_strategy strategy) {
+    std::lock_guard<std::mutex> lock(numa_mutex);
+    if (numa_initialized) {
+        if (strategy != numa_strategy) {
+            std::cerr << "Warning: NUMA strategy " << strategy << " ignored, already initialized with "
+                      << numa_strategy << std::endl;
+        }
+        return;
+    }
+    llama_numa_init(strategy);
+    numa_initialized = true;
+    numa_strategy = strategy;
+}
+
+NodeAffinity::NodeAffinity(int node) {
+    if (node < 0) return;
+#if defined(_WIN32)
+    GROUP_AFFINITY affinity = {};
+    GROUP_AFFINITY previous = {};
+    if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity)) return;
+    if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous)) return;
+    saved.resize(sizeof(previous));
+    std::memcpy(saved.data(), &previous, sizeof(previous));
+    pinned = true;
+#elif defined(__linux__)
+    const std::vector<int> cpus = numaNodeCpus(node);
+    cpu_set_t previous;
+    CPU_ZERO(&previous);
+    if (cpus.empty() || sched_getaffinity(0, sizeof(previous), &previous) != 0) return;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cpus) CPU_SET(cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0) return;
+    saved.resize(sizeof(previous));
+    std::memcpy(saved.data(), &previous, sizeof(previous));
+    pinned = true;
+#else
+    (void)node;
+#endif
+}
+
+NodeAffinity::~NodeAffinity() {
+    if (!pinned) return;
+#if defined(_WIN32)
+    GROUP_AFFINITY previous;
+    std::memcpy(&previous, saved.data(), sizeof(previous));
+    SetThreadGroupAffinity(GetCurrentThread(), &previous, nullptr);
+#elif defined(__linux__)
+    cpu_set_t previous;
+    std::memcpy(&previous, saved.data(), sizeof(previous));
+    sched_setaffinity(0, sizeof(previous), &previous);
+#endif
+}
@@ -0,0 +1,38 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <set>
+#include <string>
+#include <vector>
+#include "ggml.h"
+
+// NUMA nodes with CPUs this process may run on, in id order. {0} on single-node machines
+// and where the topology isn't readable.
+std::vector<int> numaNodes();
+
+// CPU numbers of a node, limited to the process affinity. Empty if the node is unknown.
+std::vector<int> numaNodeCpus(int node);
+
+// llama_numa_init() for the whole process, once. A later call asking for a different
+// strategy is ignored with a warning - ggml keeps the first one.
+void initNumaStrategy(ggml_numa_strategy strategy);
+
+// "0-7,16-23" (sysfs cpulist format) -> those CPU numbers
+std::set<int> parseCpuList(const std::string& list);
+
+// Pins the calling thread to a node's CPUs for its lifetime, then restores the previous
+// affinity. Memory the thread touches first in the meantime is placed on that node.
+// A negative node leaves the thread as it is.
+class NodeAffinity {
+public:
+    explicit NodeAffinity(int node);
+    ~NodeAffinity();
+    NodeAffinity(const NodeAffinity&) = delete;
+    NodeAffinity& operator=(const NodeAffinity&) = delete;
+
+private:
+    bool pinned = false;
+    std::vector<unsigned char> saved;  // Platform affinity mask to restore
+};
+
+#endif // NUMA_H
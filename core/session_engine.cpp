@@ -0,0 +1,465 @@
+#include "session_engine.h"
+#include "interface.h"
+#include "fused_sampler.h"
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+SessionEngine::SessionEngine(const std::string& modelPath, Config config) : config(config) {
+    Interface::loadBackends();
+
+    model = llama_model_load_from_file(modelPath.c_str(), llama_model_default_params());
+    if (model == NULL) {
+        throw std::runtime_error("Failed to load model");
+    }
+    vocab = llama_model_get_vocab(model);
+
+    const char* template_str = llama_model_chat_template(model, nullptr);
+    if (template_str != nullptr) chatTemplate = template_str;
+    if (this->config.use_chat_template && !chatTemplate.empty()) {
+        stop_token = Interface::roleMarkerToken(vocab, chatTemplate);
+    }
+
+    // Every session needs room for at least one token per step
+    this->config.max_sessions = std::max(1, this->config.max_sessions);
+    this->config.batch = std::max(this->config.batch, this->config.max_sessions);
+
+    auto ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = this->config.ctx;
+    ctx_params.n_batch = this->config.batch;
+    ctx_params.n_ubatch = std::min(this->config.batch, 512);
+    ctx_params.n_seq_max = this->config.max_sessions;
+    ctx_params.kv_unified = true;  // Sessions share the whole cache instead of ctx / n_seq_max each
+    ctx_params.n_threads = this->config.threads;
+    ctx_params.n_threads_batch = this->config.threads;
+
+    ctx = llama_init_from_model(model, ctx_params);
+    if (ctx == NULL) {
+        llama_model_free(model);
+        throw std::runtime_error("Failed to create context");
+    }
+    memory = llama_get_memory(ctx);
+
+    // Sized once so the worker's steady state doesn't touch the allocator
+    batch = llama_batch_init(this->config.batch, 0, 1);
+    candidates.resize(llama_vocab_n_tokens(vocab));
+
+    sessions.resize(this->config.max_sessions);
+    slot_used.resize(this->config.max_sessions, false);
+    for (int i = 0; i < this->config.max_sessions; i++) {
+        sessions[i].seq = i;
+        uint32_t seed = this->config.seed == LLAMA_DEFAULT_SEED ? LLAMA_DEFAULT_SEED : this->config.seed + i;
+        sessions[i].sampler = createSampler(seed);
+        sessions[i].reply.reserve(static_cast<size_t>(std::max(this->config.max_tokens, 0)) * 8);
+        sessions[i].pending.reserve(64);
+        sessions[i].chunk.reserve(256);
+    }
+
+    worker = std::thread(&SessionEngine::run, this);
+}
+
+SessionEngine::~SessionEngine() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    for (auto& session : sessions) {
+        if (session.sampler != NULL) {
+            llama_sampler_free(session.sampler);
+        }
+    }
+    llama_batch_free(batch);
+    if (ctx != NULL) {
+        llama_free(ctx);
+    }
+    if (model != NULL) {
+        llama_model_free(model);
+    }
+}
+
+llama_sampler* SessionEngine::createSampler(uint32_t seed) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler* chain = llama_sampler_chain_init(sparams);
+
+    FusedSamplerParams params;
+    params.top_k = config.top_k;
+    params.top_p = config.top_p;
+    params.temperature = config.temperature;
+    llama_sampler_chain_add(chain, fusedSamplerInit(params));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+
+    return chain;
+}
+
+std::vector<llama_token> SessionEngine::tokenize(const std::string& text, bool add_bos) {
+    bool parse_special = config.use_chat_template && !chatTemplate.empty();
+    int n_tokens = -llama_tokenize(vocab, text.c_str(), text.length(), NULL, 0, add_bos, parse_special);
+    std::vector<llama_token> tokens(n_tokens);
+
+    if (llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(), add_bos, parse_special) < 0) {
+        throw std::runtime_error("Tokenization failed");
+    }
+
+    return tokens;
+}
+
+std::string SessionEngine::applyChatTemplate(const std::string& userMessage) {
+    llama_chat_message msg = {"user", userMessage.c_str()};
+
+    std::vector<char> formatted(userMessage.size() * 2 + 256);
+    int new_len = llama_chat_apply_template(chatTemplate.c_str(), &msg, 1, true, formatted.data(), formatted.size());
+    if (new_len > static_cast<int>(formatted.size())) {
+        formatted.resize(new_len);
+        new_len = llama_chat_apply_template(chatTemplate.c_str(), &msg, 1, true, formatted.data(), formatted.size());
+    }
+
+    if (new_len < 0) {
+        throw std::runtime_error("Failed to apply chat template");
+    }
+
+    return std::string(formatted.begin(), formatted.begin() + new_len);
+}
+
+int SessionEngine::openSession() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < slot_used.size(); i++) {
+        if (!slot_used[i]) {
+            slot_used[i] = true;
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+void SessionEngine::closeSession(int session) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (session < 0 || session >= static_cast<int>(slot_used.size()) || !slot_used[session]) return;
+        slot_used[session] = false;
+        closing.push_back(session);
+
+        // Drop anything still queued for it, the slot may be handed out again right away
+        incoming.erase(std::remove_if(incoming.begin(), incoming.end(),
+            [session](const Request& request) { return request.session == session; }), incoming.end());
+    }
+    cv.notify_all();
+}
+
+bool SessionEngine::submit(int session, const std::string& prompt, TokenCallback onToken, DoneCallback onDone) {
+    std::string text = (config.use_chat_template && !chatTemplate.empty()) ? applyChatTemplate(prompt) : prompt;
+
+    Request request;
+    request.session = session;
+    request.tokens = tokenize(text, true);  // BOS is stripped again for follow-up turns
+    if (static_cast<int>(request.tokens.size()) >= config.ctx) {
+        throw std::runtime_error("Prompt is longer than the context size");
+    }
+    request.onToken = std::move(onToken);
+    request.onDone = std::move(onDone);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (session < 0 || session >= static_cast<int>(slot_used.size()) || !slot_used[session]) return false;
+        incoming.push_back(std::move(request));
+    }
+    cv.notify_all();
+    return true;
+}
+
+int SessionEngine::activeSessions() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return static_cast<int>(std::count(slot_used.begin(), slot_used.end(), true));
+}
+
+bool SessionEngine::admit() {
+    std::vector<int> closed;
+    std::vector<Request> admitted;
+    std::vector<Request> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed.swap(closing);
+
+        // KV cells claimed so far: reservations of requests in flight, histories of idle
+        // sessions (closed ones are about to be freed)
+        auto history = [&closed](const Session& session) {
+            return std::find(closed.begin(), closed.end(), session.seq) != closed.end() ? 0 : session.n_past;
+        };
+        int committed = 0;
+        bool in_flight = false;
+        for (const auto& session : sessions) {
+            bool active = session.state != State::Idle;
+            committed += active ? session.reserved : history(session);
+            in_flight = in_flight || active;
+        }
+
+        // Take requests for sessions that aren't busy; the rest wait for their turn
+        for (auto it = incoming.begin(); it != incoming.end(); ) {
+            const Session& session = sessions[it->session];
+            bool busy = session.state != State::Idle ||
+                std::any_of(admitted.begin(), admitted.end(),
+                    [&it](const Request& request) { return request.session == it->session; });
+            if (busy) {
+                ++it;
+                continue;
+            }
+
+            int kept = history(session);
+            int prompt = static_cast<int>(it->tokens.size());
+            if (kept > 0 && prompt > 0 && it->tokens[0] == llama_vocab_bos(vocab)) prompt--;
+            const int others = committed - kept;
+            int need = kept + prompt + std::max(config.max_tokens, 0);
+            if (others + need > config.ctx) {
+                // Requests in flight free their unused cells when they end; wait for that
+                if (in_flight) break;
+
+                // Nothing will: take what's left, without the session's history if it's in the way
+                if (kept > 0 && others + kept + prompt + 1 > config.ctx) {
+                    it->fresh = true;
+                    kept = 0;
+                    prompt = static_cast<int>(it->tokens.size());
+                }
+                need = config.ctx - others;
+                if (kept + prompt + 1 > need) {
+                    dropped.push_back(std::move(*it));
+                    it = incoming.erase(it);
+                    continue;
+                }
+            }
+
+            it->reserved = need;
+            committed = others + need;
+            in_flight = true;
+            admitted.push_back(std::move(*it));
+            it = incoming.erase(it);
+        }
+    }
+
+    // Retire closed sessions and free their KV cells (callbacks run without the lock held)
+    for (int id : closed) {
+        Session& session = sessions[id];
+        if (session.state != State::Idle) finish(session);
+        llama_memory_seq_rm(memory, session.seq, -1, -1);
+        llama_sampler_reset(session.sampler);
+        session.n_past = 0;
+    }
+
+    for (auto& request : dropped) {
+        std::cerr << "SessionEngine: request on session " << request.session
+                  << " doesn't fit next to the other sessions' history, dropped" << std::endl;
+        if (request.onDone) request.onDone("");
+    }
+
+    for (auto& request : admitted) {
+        Session& session = sessions[request.session];
+        if (request.fresh) {
+            llama_memory_seq_rm(memory, session.seq, -1, -1);
+            llama_sampler_reset(session.sampler);
+            session.n_past = 0;
+        }
+
+        session.prompt = std::move(request.tokens);
+        if (session.n_past > 0 && !session.prompt.empty() && session.prompt[0] == llama_vocab_bos(vocab)) {
+            session.prompt.erase(session.prompt.begin());
+        }
+        session.prompt_pos = 0;
+        session.reserved = request.reserved;
+        session.generated = 0;
+        session.last_step = false;
+        session.reply.clear();
+        session.pending.clear();
+        session.onToken = std::move(request.onToken);
+        session.onDone = std::move(request.onDone);
+        session.state = session.prompt.empty() ? State::Idle : State::Prefill;
+    }
+
+    for (const auto& session : sessions) {
+        if (session.state != State::Idle) return true;
+    }
+    return false;
+}
+
+void SessionEngine::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !incoming.empty() || !closing.empty(); });
+            if (stopping) break;
+        }
+
+        // Keep stepping while any session has work, picking up new arrivals between steps
+        while (admit()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return;
+            }
+            step();
+        }
+    }
+}
+
+void SessionEngine::batchAdd(llama_token token, llama_pos pos, llama_seq_id seq, bool logits) {
+    int i = batch.n_tokens;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seq;
+    batch.logits[i] = logits;
+    batch.n_tokens++;
+}
+
+bool SessionEngine::step() {
+    batch.n_tokens = 0;
+
+    // Decode phase first: one token for every session that is generating
+    for (auto& session : sessions) {
+        session.i_batch = -1;
+        session.step_pos = session.n_past;
+        session.step_prompt_pos = session.prompt_pos;
+        if (session.state == State::Generating) {
+            if (!session.last_step) session.i_batch = batch.n_tokens;
+            batchAdd(session.last_token, session.n_past++, session.seq, !session.last_step);
+        }
+    }
+
+    // Fill the rest of the batch with prompt chunks
+    int n_sessions = static_cast<int>(sessions.size());
+    for (int k = 0; k < n_sessions && batch.n_tokens < config.batch; k++) {
+        Session& session = sessions[(next_prefill + k) % n_sessions];
+        if (session.state != State::Prefill) continue;
+
+        int room = config.batch - batch.n_tokens;
+        int left = static_cast<int>(session.prompt.size() - session.prompt_pos);
+        int n = std::min(room, left);
+        for (int j = 0; j < n; j++) {
+            bool last = (j == n - 1) && (n == left);
+            if (last) session.i_batch = batch.n_tokens;
+            batchAdd(session.prompt[session.prompt_pos++], session.n_past++, session.seq, last);
+        }
+    }
+    next_prefill = (next_prefill + 1) % n_sessions;
+
+    if (batch.n_tokens == 0) {
+        return false;
+    }
+
+    if (llama_decode(ctx, batch) != 0) {
+        // Admission keeps the reservations inside the cache, so this is a cache fuller than
+        // accounted for (fragmented cells) or a backend error. Undo the step for everyone and
+        // end only the request holding the most cells; the others retry next step.
+        Session* largest = nullptr;
+        for (auto& session : sessions) {
+            if (session.state == State::Idle) continue;
+            if (largest == nullptr || session.n_past > largest->n_past) largest = &session;
+        }
+        for (auto& session : sessions) {
+            if (session.state == State::Idle) continue;
+            llama_memory_seq_rm(memory, session.seq, session.step_pos, -1);
+            session.n_past = session.step_pos;
+            session.prompt_pos = session.step_prompt_pos;
+        }
+        if (largest != nullptr) {
+            std::cerr << "SessionEngine: decode failed with " << batch.n_tokens << " tokens, ending the request on session "
+                      << largest->seq << " (" << largest->n_past << " cells)" << std::endl;
+            llama_memory_seq_rm(memory, largest->seq, -1, -1);
+            largest->n_past = 0;
+            finish(*largest);
+        }
+        return true;
+    }
+
+    for (auto& session : sessions) {
+        // Sessions that hit their limit only needed their final token in the KV history
+        if (session.state == State::Generating && session.last_step) {
+            finish(session);
+            continue;
+        }
+        if (session.i_batch < 0) continue;
+
+        llama_token id = sample(session);
+        session.state = State::Generating;
+
+        if (isStopToken(id)) {
+            // The stop token isn't decoded, so the next turn continues right after the reply
+            finish(session);
+            continue;
+        }
+
+        char buf[128];
+        int n_chars = llama_token_to_piece(vocab, id, buf, sizeof(buf), session.generated == 0 ? 1 : 0, true);
+        session.last_token = id;
+        session.generated++;
+        generated_total++;
+
+        if (n_chars > 0) {
+            emit(session, buf, n_chars);
+        }
+
+        if (session.generated >= config.max_tokens || session.n_past + 1 >= session.reserved) {
+            session.last_step = true;
+        }
+    }
+
+    return true;
+}
+
+llama_token SessionEngine::sample(Session& session) {
+    // Same as llama_sampler_sample(), minus its per-call vocab-sized allocation
+    const float* logits = llama_get_logits_ith(ctx, session.i_batch);
+    const int n_vocab = static_cast<int>(candidates.size());
+    for (llama_token i = 0; i < n_vocab; i++) {
+        candidates[i] = {i, logits[i], 0.0f};
+    }
+
+    llama_token_data_array cur_p = {candidates.data(), candidates.size(), -1, false};
+    llama_sampler_apply(session.sampler, &cur_p);
+    llama_token id = cur_p.data[cur_p.selected].id;
+    llama_sampler_accept(session.sampler, id);
+    return id;
+}
+
+bool SessionEngine::isStopToken(llama_token id) const {
+    return llama_vocab_is_eog(vocab, id) || (stop_token != LLAMA_TOKEN_NULL && id == stop_token);
+}
+
+void SessionEngine::emit(Session& session, const char* piece, size_t length) {
+    session.reply.append(piece, length);
+    if (!session.onToken) return;
+
+    session.pending.append(piece, length);
+    size_t complete = Interface::completeUtf8Length(session.pending);
+    if (complete == 0) return;
+
+    session.chunk.assign(session.pending, 0, complete);
+    session.pending.erase(0, complete);
+    bool keep_going = session.onToken(session.chunk);
+    if (!keep_going) {
+        // The sampled token hasn't been decoded yet; leave it out of the history. onToken
+        // asked to stop, so the held-back bytes aren't flushed to it.
+        session.onToken = nullptr;
+        finish(session);
+    }
+}
+
+void SessionEngine::finish(Session& session) {
+    if (session.onToken && !session.pending.empty()) {
+        session.onToken(session.pending);
+    }
+    session.pending.clear();
+
+    // Prompt tokens that never got decoded (decode failure, close) are simply dropped
+    session.prompt.clear();
+    session.prompt_pos = 0;
+    session.state = State::Idle;
+    session.i_batch = -1;
+
+    if (session.onDone) {
+        session.onDone(session.reply);
+    }
+    session.onToken = nullptr;
+    session.onDone = nullptr;
+}
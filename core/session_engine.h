@@ -0,0 +1,132 @@
+#ifndef SESSION_ENGINE_H
+#define SESSION_ENGINE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <atomic>
+
+#include "llama.h"
+
+// Hosts many conversations in a single llama_context, one llama_seq_id per session.
+// A worker thread merges the next decode step of every active session (one sampled
+// token each, plus prompt chunks of newly admitted requests) into one llama_batch.
+//
+// A request is admitted once its session's history, prompt and max_tokens reply fit in
+// the cells the other sessions haven't claimed; until then it waits in arrival order. When
+// nothing is in flight to free cells, it gets whatever room is left instead (its session
+// starts over if its own history is in the way) and is dropped only if the prompt alone
+// can't fit.
+class SessionEngine {
+public:
+    struct Config {
+        int ctx = 8192;            // Shared by all sessions
+        int batch = 512;           // Max tokens per merged decode
+        int max_sessions = 16;
+        int max_tokens = 256;      // Per request
+        int threads = 4;
+
+        int top_k = 50;
+        float top_p = 0.9f;
+        float temperature = 0.7f;
+        uint32_t seed = LLAMA_DEFAULT_SEED;
+
+        bool use_chat_template = true;
+    };
+    Config config;
+
+    // Both run on the engine's worker thread
+    using TokenCallback = std::function<bool(const std::string& piece)>;  // Return false to stop
+    using DoneCallback = std::function<void(const std::string& reply)>;
+
+    SessionEngine(const std::string& modelPath, Config config);
+    ~SessionEngine();
+
+    int openSession();             // Returns a session id, or -1 when every slot is taken
+    void closeSession(int session);
+
+    // Queue a prompt on an open session. Turns of the same session share its KV history.
+    // Throws std::runtime_error if the prompt is longer than the context.
+    bool submit(int session, const std::string& prompt,
+                TokenCallback onToken = nullptr, DoneCallback onDone = nullptr);
+
+    int activeSessions();
+    long long generatedTokens() const { return generated_total; }  // Over all sessions so far
+
+private:
+    enum class State { Idle, Prefill, Generating };
+
+    struct Request {
+        int session;
+        std::vector<llama_token> tokens;
+        TokenCallback onToken;
+        DoneCallback onDone;
+        int reserved = 0;                 // KV cells promised to it, session history included
+        bool fresh = false;               // Drop the session's history first
+    };
+
+    // Only touched by the worker thread
+    struct Session {
+        llama_seq_id seq = 0;
+        State state = State::Idle;
+        llama_sampler* sampler = nullptr;
+
+        std::vector<llama_token> prompt;  // Tokens of the current request
+        size_t prompt_pos = 0;            // How many of them are already decoded
+        int n_past = 0;                   // Position in this session's sequence
+        int reserved = 0;                 // KV cells the current request may fill, n_past included
+        int step_pos = 0;                 // n_past and prompt_pos before the current step,
+        size_t step_prompt_pos = 0;       // restored if its decode fails
+        int generated = 0;
+        llama_token last_token = LLAMA_TOKEN_NULL;
+        int i_batch = -1;                 // Logits row in the current batch
+        bool last_step = false;           // Decode last_token without logits, then finish
+
+        std::string reply;
+        std::string pending;              // Incomplete UTF-8 bytes
+        std::string chunk;                // Complete characters handed to onToken
+        TokenCallback onToken;
+        DoneCallback onDone;
+    };
+
+    llama_model* model = nullptr;
+    const llama_vocab* vocab = nullptr;
+    llama_context* ctx = nullptr;
+    llama_memory_t memory = nullptr;
+    llama_batch batch = {};
+    std::vector<llama_token_data> candidates;  // Sampling scratch shared by all sessions
+    std::string chatTemplate;
+    llama_token stop_token = LLAMA_TOKEN_NULL;  // Role marker, see Interface::roleMarkerToken
+    std::atomic<long long> generated_total{0};
+
+    std::vector<Session> sessions;
+    int next_prefill = 0;  // Round-robin start so one long prompt can't starve the others
+
+    // Shared with caller threads
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<bool> slot_used;
+    std::deque<Request> incoming;
+    std::vector<int> closing;
+    bool stopping = false;
+    std::thread worker;
+
+    llama_sampler* createSampler(uint32_t seed);
+    std::vector<llama_token> tokenize(const std::string& text, bool add_bos);
+    std::string applyChatTemplate(const std::string& userMessage);
+
+    void run();
+    bool admit();       // Move queued requests/closes into worker state, false if idle
+    bool step();        // One merged decode, false if there was nothing to do
+    llama_token sample(Session& session);
+    bool isStopToken(llama_token id) const;
+    void emit(Session& session, const char* piece, size_t length);
+    void finish(Session& session);
+    void batchAdd(llama_token token, llama_pos pos, llama_seq_id seq, bool logits);
+};
+
+#endif // SESSION_ENGINE_H
@@ -0,0 +1,234 @@
+#include "synthetic_model.h"
+#include <stdexcept>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include "gguf.h"
+
+namespace {
+
+// llama_token_type values stored in tokenizer.ggml.token_type
+const int32_t TOKEN_NORMAL = 1;
+const int32_t TOKEN_UNKNOWN = 2;
+const int32_t TOKEN_CONTROL = 3;
+const int32_t TOKEN_BYTE = 6;
+
+const char* SPACE = "\xE2\x96\x81";  // U+2581, SentencePiece's word boundary
+
+struct Vocab {
+    std::vector<std::string> tokens;
+    std::vector<float> scores;
+    std::vector<int32_t> types;
+
+    void add(const std::string& text, float score, int32_t type) {
+        tokens.push_back(text);
+        scores.push_back(score);
+        types.push_back(type);
+    }
+};
+
+// Control tokens, byte fallback, single characters, then lowercase pieces of growing
+// length (with and without a word boundary) until the vocab is full
+Vocab buildVocab(int n_vocab) {
+    Vocab vocab;
+    vocab.add("<unk>", 0.0f, TOKEN_UNKNOWN);
+    vocab.add("<s>", 0.0f, TOKEN_CONTROL);
+    vocab.add("</s>", 0.0f, TOKEN_CONTROL);
+    vocab.add("<|im_start|>", 0.0f, TOKEN_CONTROL);
+    vocab.add("<|im_end|>", 0.0f, TOKEN_CONTROL);
+    for (int b = 0; b < 256; b++) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "<0x%02X>", b);
+        vocab.add(buf, 0.0f, TOKEN_BYTE);
+    }
+
+    auto addNormal = [&](const std::string& text) {
+        if (static_cast<int>(vocab.tokens.size()) < n_vocab) {
+            vocab.add(text, -static_cast<float>(vocab.tokens.size()), TOKEN_NORMAL);
+        }
+    };
+    addNormal(SPACE);
+    for (char c = '!'; c <= '~'; c++) addNormal(std::string(1, c));
+    for (char c = 'a'; c <= 'z'; c++) addNormal(SPACE + std::string(1, c));
+    for (char c = 'A'; c <= 'Z'; c++) addNormal(SPACE + std::string(1, c));
+
+    std::string piece = "z";
+    while (static_cast<int>(vocab.tokens.size()) < n_vocab) {
+        // Next string in aa, ab, ..., zz, aaa, ... order
+        int i = static_cast<int>(piece.size()) - 1;
+        while (i >= 0 && piece[i] == 'z') piece[i--] = 'a';
+        if (i < 0) piece.insert(piece.begin(), 'a');
+        else piece[i]++;
+        addNormal(piece);
+        addNormal(SPACE + piece);
+    }
+    return vocab;
+}
+
+struct TensorSpec {
+    std::string name;
+    ggml_type type;
+    int64_t ne0;
+    int64_t ne1;   // 0 for vectors
+    float scale;   // Standard deviation of the weights, 0 = all ones (norms)
+};
+
+// Quantized types need whole blocks per row; llama-quantize falls back the same way
+ggml_type rowType(ggml_type requested, int64_t ne0) {
+    return ne0 % ggml_blck_size(requested) == 0 ? requested : GGML_TYPE_F16;
+}
+
+std::vector<TensorSpec> tensorSpecs(const SyntheticModelParams& p) {
+    const int64_t head_dim = p.n_embd / p.n_head;
+    const int64_t n_embd_gqa = head_dim * p.n_head_kv;
+    const bool biases = p.architecture == "qwen2";
+    auto matrix = [&](const std::string& name, int64_t ne0, int64_t ne1) {
+        return TensorSpec{name, rowType(p.type, ne0), ne0, ne1, 1.0f / std::sqrt(static_cast<float>(ne0))};
+    };
+    auto vector = [](const std::string& name, int64_t ne0, float scale) {
+        return TensorSpec{name, GGML_TYPE_F32, ne0, 0, scale};
+    };
+
+    std::vector<TensorSpec> specs;
+    specs.push_back({"token_embd.weight", rowType(p.type, p.n_embd), p.n_embd, p.n_vocab, 1.0f});
+    for (int il = 0; il < p.n_layer; il++) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+        specs.push_back(vector(blk + "attn_norm.weight", p.n_embd, 0.0f));
+        specs.push_back(matrix(blk + "attn_q.weight", p.n_embd, p.n_embd));
+        specs.push_back(matrix(blk + "attn_k.weight", p.n_embd, n_embd_gqa));
+        specs.push_back(matrix(blk + "attn_v.weight", p.n_embd, n_embd_gqa));
+        if (biases) {
+            specs.push_back(vector(blk + "attn_q.bias", p.n_embd, 0.02f));
+            specs.push_back(vector(blk + "attn_k.bias", n_embd_gqa, 0.02f));
+            specs.push_back(vector(blk + "attn_v.bias", n_embd_gqa, 0.02f));
+        }
+        specs.push_back(matrix(blk + "attn_output.weight", p.n_embd, p.n_embd));
+        specs.push_back(vector(blk + "ffn_norm.weight", p.n_embd, 0.0f));
+        specs.push_back(matrix(blk + "ffn_gate.weight", p.n_embd, p.n_ff));
+        specs.push_back(matrix(blk + "ffn_up.weight", p.n_embd, p.n_ff));
+        specs.push_back(matrix(blk + "ffn_down.weight", p.n_ff, p.n_embd));
+    }
+    specs.push_back(vector("output_norm.weight", p.n_embd, 0.0f));
+    specs.push_back(matrix("output.weight", p.n_embd, p.n_vocab));
+    return specs;
+}
+
+void validate(const SyntheticModelParams& p) {
+    if (p.architecture != "llama" && p.architecture != "qwen2") {
+        throw std::runtime_error("Unsupported synthetic architecture: " + p.architecture);
+    }
+    if (p.n_vocab < SYNTHETIC_MIN_VOCAB) {
+        throw std::runtime_error("Synthetic vocab needs at least " + std::to_string(SYNTHETIC_MIN_VOCAB) + " tokens");
+    }
+    if (p.n_embd <= 0 || p.n_layer <= 0 || p.n_ff <= 0 || p.n_ctx_train <= 0 ||
+        p.n_head <= 0 || p.n_head_kv <= 0 || p.n_embd % p.n_head != 0 || p.n_head % p.n_head_kv != 0) {
+        throw std::runtime_error("Invalid synthetic model shape");
+    }
+    if ((p.n_embd / p.n_head) % 2 != 0) {
+        throw std::runtime_error("Synthetic head size must be even for RoPE");
+    }
+    if (p.type < 0 || p.type >= GGML_TYPE_COUNT || ggml_blck_size(p.type) <= 0 ||
+        ggml_quantize_requires_imatrix(p.type)) {
+        throw std::runtime_error(std::string("Unsupported synthetic weight type: ") + ggml_type_name(p.type));
+    }
+}
+
+} // namespace
+
+void writeSyntheticModel(const std::string& path, const SyntheticModelParams& params) {
+    validate(params);
+
+    const std::string arch = params.architecture;
+    const Vocab vocab = buildVocab(params.n_vocab);
+    const std::vector<TensorSpec> specs = tensorSpecs(params);
+
+    gguf_context* gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.architecture", arch.c_str());
+    gguf_set_val_str(gguf, "general.name", params.name.c_str());
+    gguf_set_val_u32(gguf, (arch + ".context_length").c_str(), params.n_ctx_train);
+    gguf_set_val_u32(gguf, (arch + ".embedding_length").c_str(), params.n_embd);
+    gguf_set_val_u32(gguf, (arch + ".block_count").c_str(), params.n_layer);
+    gguf_set_val_u32(gguf, (arch + ".feed_forward_length").c_str(), params.n_ff);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count").c_str(), params.n_head);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count_kv").c_str(), params.n_head_kv);
+    gguf_set_val_f32(gguf, (arch + ".attention.layer_norm_rms_epsilon").c_str(), 1e-5f);
+    gguf_set_val_f32(gguf, (arch + ".rope.freq_base").c_str(), 10000.0f);
+    gguf_set_val_u32(gguf, (arch + ".rope.dimension_count").c_str(), params.n_embd / params.n_head);
+    gguf_set_val_u32(gguf, (arch + ".vocab_size").c_str(), params.n_vocab);
+
+    std::vector<const char*> token_texts;
+    for (const std::string& token : vocab.tokens) token_texts.push_back(token.c_str());
+    gguf_set_val_str(gguf, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(gguf, "tokenizer.ggml.tokens", token_texts.data(), token_texts.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, vocab.scores.data(), vocab.scores.size());
+    gguf_set_arr_data(gguf, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, vocab.types.data(), vocab.types.size());
+    gguf_set_val_u32(gguf, "tokenizer.ggml.unknown_token_id", 0);
+    gguf_set_val_u32(gguf, "tokenizer.ggml.bos_token_id", 1);
+    gguf_set_val_u32(gguf, "tokenizer.ggml.eos_token_id", 2);
+    gguf_set_val_bool(gguf, "tokenizer.ggml.add_bos_token", true);
+    gguf_set_val_bool(gguf, "tokenizer.ggml.add_eos_token", false);
+    if (!params.chat_template.empty()) {
+        gguf_set_val_str(gguf, "tokenizer.chat_template", params.chat_template.c_str());
+    }
+
+    // All tensor data lives in one ggml context until the file is written
+    size_t mem_size = 0;
+    for (const TensorSpec& spec : specs) {
+        mem_size += ggml_tensor_overhead() + ggml_row_size(spec.type, spec.ne0) * std::max<int64_t>(spec.ne1, 1) + 64;
+    }
+    ggml_init_params ctx_params = {mem_size, nullptr, false};
+    ggml_context* ctx = ggml_init(ctx_params);
+    if (ctx == nullptr) {
+        gguf_free(gguf);
+        throw std::runtime_error("Failed to allocate synthetic model tensors");
+    }
+
+    std::mt19937 rng(params.seed);
+    std::vector<float> values;
+    for (const TensorSpec& spec : specs) {
+        const int64_t rows = std::max<int64_t>(spec.ne1, 1);
+        ggml_tensor* tensor = spec.ne1 > 0 ? ggml_new_tensor_2d(ctx, spec.type, spec.ne0, spec.ne1)
+                                           : ggml_new_tensor_1d(ctx, spec.type, spec.ne0);
+        ggml_set_name(tensor, spec.name.c_str());
+
+        values.assign(static_cast<size_t>(spec.ne0 * rows), 1.0f);
+        if (spec.scale > 0.0f) {
+            std::normal_distribution<float> dist(0.0f, spec.scale);
+            for (float& v : values) v = dist(rng);
+        }
+        if (spec.name == "output.weight") {
+            // Only normal tokens get a direction of their own
+            for (int64_t row = 0; row < rows; row++) {
+                if (vocab.types[row] == TOKEN_NORMAL) continue;
+                std::fill(values.begin() + row * spec.ne0, values.begin() + (row + 1) * spec.ne0, 0.0f);
+            }
+        }
+        ggml_quantize_chunk(spec.type, values.data(), tensor->data, 0, rows, spec.ne0, nullptr);
+        gguf_add_tensor(gguf, tensor);
+    }
+
+    bool written = gguf_write_to_file(gguf, path.c_str(), false);
+    ggml_free(ctx);
+    gguf_free(gguf);
+    if (!written) {
+        throw std::runtime_error("Failed to write synthetic model to " + path);
+    }
+}
+
+ggml_type syntheticModelType(const std::string& name) {
+    for (int t = 0; t < GGML_TYPE_COUNT; t++) {
+        ggml_type type = static_cast<ggml_type>(t);
+        const char* type_name = ggml_type_name(type);
+        if (type_name == nullptr || ggml_blck_size(type) <= 0 || name.size() != std::strlen(type_name)) continue;
+        bool same = true;
+        for (size_t i = 0; i < name.size() && same; i++) {
+            same = std::tolower(static_cast<unsigned char>(name[i])) == std::tolower(static_cast<unsigned char>(type_name[i]));
+        }
+        if (same) return type;
+    }
+    throw std::runtime_error("Unknown weight type: " + name);
+}
@@ -0,0 +1,39 @@
+#ifndef SYNTHETIC_MODEL_H
+#define SYNTHETIC_MODEL_H
+
+#include <string>
+#include "ggml.h"
+
+// Shape of a random-weight model. The defaults load in well under a second and still run
+// every Interface path (prefill, decode, context shift, sampling, chat template).
+struct SyntheticModelParams {
+    std::string architecture = "llama";  // "llama" or "qwen2" (adds q/k/v biases)
+    std::string name = "synthetic";
+    int n_vocab = 1024;                  // At least SYNTHETIC_MIN_VOCAB
+    int n_embd = 256;
+    int n_layer = 2;
+    int n_head = 4;
+    int n_head_kv = 2;
+    int n_ff = 512;
+    int n_ctx_train = 4096;
+    ggml_type type = GGML_TYPE_F16;      // Weight matrices; rows that don't fit its blocks stay F16
+    uint32_t seed = 42;
+    // chatml, so <|im_start|> / <|im_end|> are in the vocab as control tokens
+    std::string chat_template =
+        "{% for message in messages %}{{'<|im_start|>' + message['role'] + '\\n' + message['content'] + "
+        "'<|im_end|>' + '\\n'}}{% endfor %}{% if add_generation_prompt %}{{ '<|im_start|>assistant\\n' }}{% endif %}";
+};
+
+// Control tokens, 256 byte-fallback tokens and one piece per printable ASCII character
+const int SYNTHETIC_MIN_VOCAB = 408;
+
+// Writes a GGUF with a SentencePiece-style vocab (byte fallback, so any text tokenizes) and
+// random weights. The output rows of control and byte tokens are zero: with top-k sampling
+// replies don't end early and stream as plain ASCII. Throws std::runtime_error on invalid
+// shapes or if the file can't be written.
+void writeSyntheticModel(const std::string& path, const SyntheticModelParams& params = SyntheticModelParams());
+
+// "f16", "q8_0", "q4_K", ... as printed by ggml (case-insensitive). Throws on unknown names.
+ggml_type syntheticModelType(const std::string& name);
+
+#endif // SYNTHETIC_MODEL_H
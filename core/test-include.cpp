@@ -9,6 +9,7 @@ int main(int argc, char** argv) {
 
     // Initialize interface with model path
     const std::string model_path = "./models/Llama-3.2-1B-Instruct-Q4_K_M.gguf";
+    Interface::prefetchModel(model_path);
     Interface myInterface(model_path);
 
     std::cout << "Model initialized. Ready for input." << std::endl;
@@ -28,7 +29,13 @@ int main(int argc, char** argv) {
 
     std::cout << "Generated text: " << result << std::endl << std::endl;
     std::cout << "Generation took " << diff.count() << " seconds" << std::endl;
-    std::cout << "Tokens per second: " << 256.0 / diff.count() << std::endl;
+    const Interface::Stats& stats = myInterface.getStats();
+    std::cout << "Tokens generated: " << stats.generated_tokens << std::endl;
+    std::cout << "Time to first token: " << stats.first_token_ms << " ms" << std::endl;
+    std::cout << "Tokens per second: " << stats.generated_tokens / diff.count() << std::endl;
+    const Interface::LoadStats& load = myInterface.getLoadStats();
+    std::cout << "Load: " << load.model_ms << " ms model, " << load.warmup_ms << " ms warm-up, "
+              << load.ready_ms << " ms total; load to first token " << load.first_token_ms << " ms" << std::endl;
 
     return 0;
 }
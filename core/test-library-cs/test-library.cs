@@ -13,6 +13,9 @@ namespace iamai_core_lib
         public float TopP { get; set; } = 0.9f;
         public float Temperature { get; set; } = 0.5f;
         public uint Seed { get; set; } = 42;
+        public string TypeK { get; set; } = "f16";  // KV cache types: f16, q8_0, q4_0, ...
+        public string TypeV { get; set; } = "f16";
+        public int FlashAttn { get; set; } = -1;    // -1 auto, 0 off, 1 on
     }
 
     public class AI : IDisposable
@@ -43,7 +46,8 @@ namespace iamai_core_lib
         private delegate IntPtr FullInitDelegate(
             [MarshalAs(UnmanagedType.LPStr)] string modelPath,
             int maxTokens, int batch, int contextSize, int threads,
-            int topK, float topP, float temperature, uint seed);
+            int topK, float topP, float temperature, uint seed,
+            [MarshalAs(UnmanagedType.LPStr)] string typeK, [MarshalAs(UnmanagedType.LPStr)] string typeV, int flashAttn);
 
         [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
         private delegate bool GenerateDelegate(IntPtr context, [MarshalAs(UnmanagedType.LPStr)] string prompt,
@@ -122,7 +126,10 @@ namespace iamai_core_lib
                     config.TopK,
                     config.TopP,
                     config.Temperature,
-                    config.Seed
+                    config.Seed,
+                    config.TypeK,
+                    config.TypeV,
+                    config.FlashAttn
                 );
             }
 
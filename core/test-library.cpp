@@ -22,6 +22,15 @@ typedef bool (*GenerateFunc)(void*, const char*, char*, int);
 typedef void (*SetMaxTokensFunc)(void*, int);
 typedef void (*FreeFunc)(void*);
 
+// Mirrors struct Stats in interface-lib.cpp
+struct Stats {
+    double total_ms, first_token_ms, template_ms, tokenize_ms, prefill_ms;
+    double decode_ms, draft_ms, sample_ms, detokenize_ms, shift_ms;
+    int prompt_tokens, reused_tokens, prefill_tokens, generated_tokens;
+    int decode_calls, context_shifts, kv_used, kv_size;
+};
+typedef bool (*GetStatsFunc)(void*, Stats*);
+
 int main(int argc, char** argv) {
     LibraryHandle library = nullptr;
     void* context = nullptr;
@@ -47,8 +56,9 @@ int main(int argc, char** argv) {
     GenerateFunc Generate = (GenerateFunc)GET_PROC_ADDRESS(library, "Generate");
     SetMaxTokensFunc SetMaxTokens = (SetMaxTokensFunc)GET_PROC_ADDRESS(library, "SetMaxTokens");
     FreeFunc Free = (FreeFunc)GET_PROC_ADDRESS(library, "Free");
+    GetStatsFunc GetStats = (GetStatsFunc)GET_PROC_ADDRESS(library, "GetStats");
 
-    if (!Init || !Generate || !SetMaxTokens || !Free) {
+    if (!Init || !Generate || !SetMaxTokens || !Free || !GetStats) {
         std::cerr << "Error: Failed to get function pointers from library" << std::endl;
         FREE_LIBRARY(library);
         return 1;
@@ -92,7 +102,11 @@ int main(int argc, char** argv) {
 
     std::cout << "Generated text: " << output << std::endl << std::endl;
     std::cout << "Generation took " << diff.count() << " seconds" << std::endl;
-    std::cout << "Tokens per second: " << 256.0 / diff.count() << std::endl;
+    Stats stats = {};
+    GetStats(context, &stats);
+    std::cout << "Tokens generated: " << stats.generated_tokens << std::endl;
+    std::cout << "Time to first token: " << stats.first_token_ms << " ms" << std::endl;
+    std::cout << "Tokens per second: " << stats.generated_tokens / diff.count() << std::endl;
 
     // Cleanup
     Free(context);
@@ -8,6 +8,22 @@ dll_dir = os.path.join(os.getcwd(), "build", "bin", "Debug")
 os.add_dll_directory(dll_dir)
 LIBRARY_PATH = os.path.join(dll_dir, "iamai-core.dll")
 
+# bool (*StreamCallback)(const char* piece, void* user_data)
+STREAM_CALLBACK = CFUNCTYPE(c_bool, c_char_p, c_void_p)
+
+class Stats(Structure):
+    # Mirrors struct Stats in interface-lib.cpp
+    _fields_ = [(name, c_double) for name in (
+        'total_ms', 'first_token_ms', 'template_ms', 'tokenize_ms', 'prefill_ms',
+        'decode_ms', 'draft_ms', 'sample_ms', 'detokenize_ms', 'shift_ms')] + \
+        [(name, c_int) for name in (
+        'prompt_tokens', 'reused_tokens', 'prefill_tokens', 'generated_tokens',
+        'decode_calls', 'context_shifts', 'kv_used', 'kv_size')]
+
+class LoadStats(Structure):
+    # Mirrors struct LoadStats in interface-lib.cpp
+    _fields_ = [(name, c_double) for name in ('model_ms', 'warmup_ms', 'ready_ms', 'first_token_ms')]
+
 class AI:
     def __init__(self, model_path, config=None):
         # Load the library using the relative path
@@ -23,7 +39,8 @@ class AI:
             self.ctx = self.lib.Init(encoded_path)
         else:
             # Use FullInit function with configuration
-            self.lib.FullInit.argtypes = [c_char_p, c_int, c_int, c_int, c_int, c_int, c_float, c_float, c_uint32]
+            self.lib.FullInit.argtypes = [c_char_p, c_int, c_int, c_int, c_int, c_int, c_float, c_float, c_uint32,
+                                          c_char_p, c_char_p, c_int]
             self.lib.FullInit.restype = c_void_p
 
             # Initialize with full configuration
@@ -37,7 +54,10 @@ class AI:
                 config.get('top_k', 50),
                 config.get('top_p', 0.9),
                 config.get('temperature', 0.5),
-                config.get('seed', 42)
+                config.get('seed', 42),
+                config.get('type_k', 'f16').encode('utf-8'),
+                config.get('type_v', 'f16').encode('utf-8'),
+                config.get('flash_attn', -1)
             )
 
         if not self.ctx:
@@ -52,6 +72,41 @@ class AI:
         self.lib.SetPromptFormat.restype = None
         self.lib.ClearPromptFormat.argtypes = [c_void_p]
         self.lib.ClearPromptFormat.restype = None
+        self.lib.GenerateStream.argtypes = [c_void_p, c_char_p, STREAM_CALLBACK, c_void_p]
+        self.lib.GenerateStream.restype = c_bool
+        self.lib.Tokenize.argtypes = [c_void_p, c_char_p, c_bool, POINTER(c_int32), c_int]
+        self.lib.Tokenize.restype = c_int
+        self.lib.GenerateTokens.argtypes = [c_void_p, POINTER(c_int32), c_int, POINTER(c_int32), c_int]
+        self.lib.GenerateTokens.restype = c_int
+        self.lib.SetGrammar.argtypes = [c_void_p, c_char_p]
+        self.lib.SetGrammar.restype = c_bool
+        self.lib.SetJsonSchema.argtypes = [c_void_p, c_char_p]
+        self.lib.SetJsonSchema.restype = c_bool
+        self.lib.ClearGrammar.argtypes = [c_void_p]
+        self.lib.ClearGrammar.restype = None
+        self.lib.SetLogprobs.argtypes = [c_void_p, c_bool, c_int]
+        self.lib.SetLogprobs.restype = None
+        self.lib.GetLogprobs.argtypes = [c_void_p, POINTER(c_int32), POINTER(c_float), POINTER(c_float), c_int]
+        self.lib.GetLogprobs.restype = c_int
+        self.lib.GetTopLogprobs.argtypes = [c_void_p, c_int, POINTER(c_int32), POINTER(c_float), c_int]
+        self.lib.GetTopLogprobs.restype = c_int
+        self.lib.GetStats.argtypes = [c_void_p, POINTER(Stats)]
+        self.lib.GetStats.restype = c_bool
+        self.lib.GetLoadStats.argtypes = [c_void_p, POINTER(LoadStats)]
+        self.lib.GetLoadStats.restype = c_bool
+        self.lib.GenerateBatch.argtypes = [c_void_p, POINTER(c_char_p), c_int, POINTER(c_char_p), c_int]
+        self.lib.GenerateBatch.restype = c_bool
+        self.lib.SetParallel.argtypes = [c_void_p, c_int]
+        self.lib.SetParallel.restype = None
+        for name in ('GenerateN', 'BeamSearch'):
+            getattr(self.lib, name).argtypes = [c_void_p, c_char_p, c_int, POINTER(c_char_p), POINTER(c_float), c_int]
+            getattr(self.lib, name).restype = c_int
+        self.lib.EstimateKvCacheBytes.argtypes = [c_void_p]
+        self.lib.EstimateKvCacheBytes.restype = c_uint64
+        self.lib.GetEmbeddingSize.argtypes = [c_void_p]
+        self.lib.GetEmbeddingSize.restype = c_int
+        self.lib.Embed.argtypes = [c_void_p, POINTER(c_char_p), c_int, POINTER(c_float), c_int, c_bool]
+        self.lib.Embed.restype = c_bool
         self.lib.Free.argtypes = [c_void_p]
         self.lib.Free.restype = None
 
@@ -62,6 +117,111 @@ class AI:
             raise RuntimeError("Generation failed")
         return output.value.decode('utf-8')
 
+    def generate_batch(self, prompts, max_length=4096, parallel=None):
+        # One reply per prompt, decoded together (parallel = sequences in flight)
+        if parallel is not None:
+            self.lib.SetParallel(self.ctx, parallel)
+        inputs = (c_char_p * len(prompts))(*[prompt.encode('utf-8') for prompt in prompts])
+        buffers = [create_string_buffer(max_length) for _ in prompts]
+        outputs = (c_char_p * len(prompts))(*[addressof(buffer) for buffer in buffers])
+        if not self.lib.GenerateBatch(self.ctx, inputs, len(prompts), outputs, max_length):
+            raise RuntimeError("Batch generation failed")
+        return [buffer.value.decode('utf-8') for buffer in buffers]
+
+    def _candidates(self, function, prompt, n, max_length):
+        buffers = [create_string_buffer(max_length) for _ in range(n)]
+        outputs = (c_char_p * n)(*[addressof(buffer) for buffer in buffers])
+        logprobs = (c_float * n)()
+        count = function(self.ctx, prompt.encode('utf-8'), n, outputs, logprobs, max_length)
+        if count < 0:
+            raise RuntimeError("Generation failed")
+        return [(buffers[i].value.decode('utf-8'), logprobs[i]) for i in range(count)]
+
+    def generate_n(self, prompt, n, max_length=4096):
+        # [(reply, cumulative logprob), ...], most likely first
+        return self._candidates(self.lib.GenerateN, prompt, n, max_length)
+
+    def beam_search(self, prompt, width, max_length=4096):
+        return self._candidates(self.lib.BeamSearch, prompt, width, max_length)
+
+    def generate_stream(self, prompt, on_piece):
+        # on_piece(str) -> bool, return False to stop early
+        callback = STREAM_CALLBACK(lambda piece, _: bool(on_piece(piece.decode('utf-8'))))
+        if not self.lib.GenerateStream(self.ctx, prompt.encode('utf-8'), callback, None):
+            raise RuntimeError("Generation failed")
+
+    def tokenize(self, text, add_bos=True, capacity=4096):
+        tokens = (c_int32 * capacity)()
+        n = self.lib.Tokenize(self.ctx, text.encode('utf-8'), add_bos, tokens, capacity)
+        if n < 0:
+            raise RuntimeError("Tokenization failed")
+        return list(tokens[:n])
+
+    def generate_tokens(self, tokens, capacity=4096):
+        # Token ids in, token ids out - no detokenize/retokenize round trip
+        prompt = (c_int32 * len(tokens))(*tokens)
+        output = (c_int32 * capacity)()
+        n = self.lib.GenerateTokens(self.ctx, prompt, len(tokens), output, capacity)
+        if n < 0:
+            raise RuntimeError("Generation failed")
+        return list(output[:n])
+
+    def set_grammar(self, gbnf):
+        if not self.lib.SetGrammar(self.ctx, gbnf.encode('utf-8')):
+            raise ValueError("Invalid grammar")
+
+    def set_json_schema(self, schema):
+        # schema: JSON string (json.dumps a dict first)
+        if not self.lib.SetJsonSchema(self.ctx, schema.encode('utf-8')):
+            raise ValueError("Unsupported or invalid JSON schema")
+
+    def clear_grammar(self):
+        self.lib.ClearGrammar(self.ctx)
+
+    def set_logprobs(self, enabled=True, top=0):
+        self.lib.SetLogprobs(self.ctx, enabled, top)
+
+    def get_logprobs(self):
+        # [(token, logprob, entropy, [(alt_token, alt_logprob), ...]), ...] for the last call
+        n = self.lib.GetLogprobs(self.ctx, None, None, None, 0)
+        tokens = (c_int32 * max(n, 1))()
+        logprobs = (c_float * max(n, 1))()
+        entropies = (c_float * max(n, 1))()
+        n = self.lib.GetLogprobs(self.ctx, tokens, logprobs, entropies, n)
+        result = []
+        for i in range(max(n, 0)):
+            alt_tokens = (c_int32 * 20)()
+            alt_logprobs = (c_float * 20)()
+            k = self.lib.GetTopLogprobs(self.ctx, i, alt_tokens, alt_logprobs, 20)
+            top = [(alt_tokens[j], alt_logprobs[j]) for j in range(max(k, 0))]
+            result.append((tokens[i], logprobs[i], entropies[i], top))
+        return result
+
+    def get_stats(self):
+        # Timings and counters of the last generate call as a dict
+        stats = Stats()
+        self.lib.GetStats(self.ctx, byref(stats))
+        return {name: getattr(stats, name) for name, _ in Stats._fields_}
+
+    def get_load_stats(self):
+        # Cold start timings as a dict; first_token_ms is 0 until the first reply
+        stats = LoadStats()
+        self.lib.GetLoadStats(self.ctx, byref(stats))
+        return {name: getattr(stats, name) for name, _ in LoadStats._fields_}
+
+    def estimate_kv_cache_bytes(self):
+        return self.lib.EstimateKvCacheBytes(self.ctx)
+
+    def embed(self, texts, pooling='mean', normalize=True):
+        # One vector (list of floats) per text; pooling is 'mean', 'cls' or 'last'
+        n_embd = self.lib.GetEmbeddingSize(self.ctx)
+        inputs = (c_char_p * len(texts))(*[text.encode('utf-8') for text in texts])
+        output = (c_float * (n_embd * len(texts)))()
+        mode = {'mean': 0, 'cls': 1, 'last': 2}[pooling]
+        if not self.lib.Embed(self.ctx, inputs, len(texts), output, mode, normalize):
+            raise RuntimeError("Embedding failed")
+        return [list(output[i * n_embd:(i + 1) * n_embd]) for i in range(len(texts))]
+
     def set_max_tokens(self, max_tokens):
         self.lib.SetMaxTokens(self.ctx, max_tokens)
 
@@ -82,6 +242,10 @@ if __name__ == "__main__":
         ai.set_max_tokens(256)
         response = ai.generate("Tell me a story about a robot.")
         print("Simple init response:", response)
+        stats = ai.get_stats()
+        print(f"{stats['generated_tokens']} tokens, first after {stats['first_token_ms']:.0f} ms, {stats['total_ms']:.0f} ms total")
+        load = ai.get_load_stats()
+        print(f"Ready after {load['ready_ms']:.0f} ms, first token {load['first_token_ms']:.0f} ms after loading began")
 
         # Example usage with full configuration
         config = {
@@ -92,7 +256,9 @@ if __name__ == "__main__":
             'top_k': 40,
             'top_p': 0.8,
             'temperature': 0.7,
-            'seed': 1337
+            'seed': 1337,
+            'type_k': 'q8_0',
+            'type_v': 'q8_0'
         }
         ai_configured = AI("./models/llama-3.2-1b-instruct-q4_k_m.gguf", config)
 
@@ -100,6 +266,7 @@ if __name__ == "__main__":
         ai_configured.set_prompt_format("Human: {prompt}\nAssistant: ")
         response2 = ai_configured.generate("What is the meaning of life?")
         print("Configured response:", response2)
+        print(f"KV cache: ~{ai_configured.estimate_kv_cache_bytes() / 2**20:.1f} MiB (estimate)")
 
     except Exception as e:
         print(f"Error: {e}")